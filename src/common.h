@@ -26,6 +26,12 @@
 #define PACKED __attribute__((packed))
 #define CACHE_ALIGNED __attribute__((aligned(CACHELINE_SIZE)))
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
 #define atomic_incr(value) \
     __atomic_fetch_add(&value, 1, __ATOMIC_SEQ_CST)
 
@@ -59,4 +65,54 @@ uint32_t oat_hash(void * data, size_t len)
     return h;
 }
 
+/* 64-bit FNV-1a, with the murmur3 finalizer to spread its bits.
+ * For users needing more than 32 bits of hash (eg. cardinality estimation) */
+static inline
+uint64_t fnv_hash64(void * data, size_t len)
+{
+    const uint8_t * p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0 ; i < len ; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= (h >> 33);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= (h >> 33);
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= (h >> 33);
+
+    return h;
+}
+
+/* integer square root, rounded down */
+#define ISQRRT_NEXT(n, i)  (((n) + (i) / (n)) >> 1)
+
+static inline
+uint32_t isqrt(uint64_t number)
+{
+    uint64_t n, n1;
+
+    if (unlikely(number == UINT64_MAX))
+        return UINT32_MAX;
+
+    n = 1;
+    n1 = ISQRRT_NEXT(n, number);
+
+    /* the iterates do not fit in an int past 2^32 */
+    while ((n1 > n ? n1 - n : n - n1) > 1) {
+        n = n1;
+        n1 = ISQRRT_NEXT(n, number);
+    }
+
+    while (n1 > UINT32_MAX || n1 * n1 > number) {
+        n1--;
+    }
+
+    return (uint32_t) n1;
+}
+
 #endif /* COMMON_H */
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dsht.h"
+#include "sht.h"
+
+/* slots per ring, power of 2 */
+#define RING_SIZE 64
+#define RING_MASK (RING_SIZE - 1)
+
+/* empty polling rounds before yielding the cpu */
+#define IDLE_SPINS 1024
+
+struct request {
+    enum dsht_op op;
+    size_t keylen;
+    void * key;
+    void * value;
+    void * cookie;
+} CACHE_ALIGNED;
+
+struct response {
+    struct dsht_response r;
+} CACHE_ALIGNED;
+
+/* single producer, single consumer rings.
+ * Each index is written by a single side, on its own cacheline */
+struct request_ring {
+    uint32_t tail CACHE_ALIGNED; /* client */
+    uint32_t head CACHE_ALIGNED; /* server */
+    struct request slots[RING_SIZE];
+};
+
+struct response_ring {
+    uint32_t tail CACHE_ALIGNED; /* server */
+    uint32_t head CACHE_ALIGNED; /* client */
+    struct response slots[RING_SIZE];
+};
+
+struct channel {
+    struct request_ring req;
+    struct response_ring resp;
+};
+
+struct shard {
+    struct dsht * h;
+    int id;
+    pthread_t thread;
+    struct sht * sht;
+
+    /* stats, only written by the server */
+    uint64_t cpt_requests;
+    uint64_t cpt_batches;
+} CACHE_ALIGNED;
+
+struct dsht_client {
+    struct dsht * h;
+    int id;
+
+    /* client side copies of the ring indexes */
+    struct {
+        uint32_t req_tail;  /* not published yet */
+        uint32_t req_head;  /* last seen */
+        uint32_t resp_head;
+    } * idx;
+};
+
+struct dsht {
+    int num_shards;
+    int max_clients;
+    int num_started;
+    volatile int stop;
+
+    int * clients_used;
+    struct channel * channels; /* [client][shard] */
+    struct shard * shards;
+};
+
+static inline
+struct channel * channel(struct dsht const * h, int client, int shard)
+{
+    return &h->channels[client * h->num_shards + shard];
+}
+
+static inline
+int shard_of(struct dsht const * h, void * key, size_t keylen)
+{
+    /* high bits select the shard, the shard table uses the low ones */
+    return ((uint64_t) oat_hash(key, keylen) * h->num_shards) >> 32;
+}
+
+static void
+shard_process(struct shard * s, struct request const * req,
+        struct dsht_response * resp)
+{
+    resp->cookie = req->cookie;
+    resp->value = NULL;
+    resp->rv = 0;
+
+    switch (req->op) {
+    case DSHT_LOOKUP:
+        resp->value = sht_lookup(s->sht, req->key, req->keylen);
+        break;
+    case DSHT_INSERT:
+        resp->rv = sht_insert(s->sht, req->key, req->keylen, req->value);
+        break;
+    case DSHT_LOOKUP_INSERT:
+        resp->value = sht_lookup_insert(s->sht, req->key, req->keylen,
+                req->value);
+        break;
+    case DSHT_REMOVE:
+        resp->rv = sht_remove(s->sht, req->key, req->keylen);
+        break;
+    default:
+        resp->rv = -1;
+        break;
+    }
+}
+
+/* serve a whole batch of a client, bounded by its response ring space */
+static int
+shard_serve(struct shard * s, struct channel * ch)
+{
+    int i, n;
+    uint32_t head, tail, resp_tail, resp_head;
+
+    head = ch->req.head;
+    tail = __atomic_load_n(&ch->req.tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return 0;
+
+    resp_tail = ch->resp.tail;
+    resp_head = __atomic_load_n(&ch->resp.head, __ATOMIC_ACQUIRE);
+    n = MIN(tail - head, RING_SIZE - (resp_tail - resp_head));
+
+    for (i = 0 ; i < n ; i++) {
+        shard_process(s, &ch->req.slots[(head + i) & RING_MASK],
+                &ch->resp.slots[(resp_tail + i) & RING_MASK].r);
+    }
+
+    __atomic_store_n(&ch->resp.tail, resp_tail + n, __ATOMIC_RELEASE);
+    __atomic_store_n(&ch->req.head, head + n, __ATOMIC_RELEASE);
+
+    if (n > 0) {
+        s->cpt_requests += n;
+        s->cpt_batches++;
+    }
+
+    return n;
+}
+
+static void *
+shard_thread(void * arg)
+{
+    int c, work, idle;
+    struct shard * s = arg;
+    struct dsht * h = s->h;
+
+    idle = 0;
+    while (!__atomic_load_n(&h->stop, __ATOMIC_ACQUIRE)) {
+        work = 0;
+        for (c = 0 ; c < h->max_clients ; c++)
+            work += shard_serve(s, channel(h, c, s->id));
+
+        if (work == 0 && ++idle >= IDLE_SPINS) {
+            idle = 0;
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+void dsht_destroy(struct dsht * h)
+{
+    int i;
+
+    if (h == NULL)
+        return;
+
+    __atomic_store_n(&h->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0 ; i < h->num_started ; i++)
+        pthread_join(h->shards[i].thread, NULL);
+
+    for (i = 0 ; h->shards != NULL && i < h->num_shards ; i++)
+        sht_destroy(h->shards[i].sht);
+
+    free(h->shards);
+    free(h->channels);
+    free(h->clients_used);
+    free(h);
+}
+
+struct dsht * dsht_create(int num_shards, int max_clients, int size,
+        int const * cpus)
+{
+    int i;
+    void * mem;
+    cpu_set_t cpuset;
+    struct dsht * h;
+    size_t num_channels;
+
+    if (num_shards <= 0 || max_clients <= 0)
+        return NULL;
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    h->num_shards = num_shards;
+    h->max_clients = max_clients;
+
+    num_channels = (size_t) num_shards * max_clients;
+    h->clients_used = calloc(max_clients, sizeof(*h->clients_used));
+    if (h->clients_used == NULL)
+        goto err;
+
+    if (posix_memalign(&mem, CACHELINE_SIZE,
+                num_channels * sizeof(*h->channels)) != 0)
+        goto err;
+
+    h->channels = mem;
+    memset(h->channels, 0, num_channels * sizeof(*h->channels));
+
+    if (posix_memalign(&mem, CACHELINE_SIZE,
+                num_shards * sizeof(*h->shards)) != 0)
+        goto err;
+
+    h->shards = mem;
+    memset(h->shards, 0, num_shards * sizeof(*h->shards));
+
+    for (i = 0 ; i < num_shards ; i++) {
+        h->shards[i].h = h;
+        h->shards[i].id = i;
+        h->shards[i].sht = sht_create_ext(size, SHT_F_NOSYNC, NULL, NULL,
+                NULL);
+        if (h->shards[i].sht == NULL)
+            goto err;
+    }
+
+    for (i = 0 ; i < num_shards ; i++) {
+        if (pthread_create(&h->shards[i].thread, NULL, shard_thread,
+                    &h->shards[i]) != 0)
+            goto err;
+
+        h->num_started++;
+
+        if (cpus != NULL) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpus[i], &cpuset);
+            pthread_setaffinity_np(h->shards[i].thread, sizeof(cpuset),
+                    &cpuset);
+        }
+    }
+
+    return h;
+
+err:
+    dsht_destroy(h);
+    return NULL;
+}
+
+struct dsht_client * dsht_client_create(struct dsht * h)
+{
+    int i, s, unused;
+    struct channel * ch;
+    struct dsht_client * c;
+
+    c = malloc(sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    c->idx = calloc(h->num_shards, sizeof(*c->idx));
+    if (c->idx == NULL) {
+        free(c);
+        return NULL;
+    }
+
+    c->h = h;
+    for (i = 0 ; i < h->max_clients ; i++) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&h->clients_used[i], &unused, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            c->id = i;
+            break;
+        }
+    }
+
+    if (i == h->max_clients) {
+        free(c->idx);
+        free(c);
+        return NULL;
+    }
+
+    /* resume where the previous client of this slot left the rings */
+    for (s = 0 ; s < h->num_shards ; s++) {
+        ch = channel(h, c->id, s);
+        c->idx[s].req_tail = ch->req.tail;
+        c->idx[s].req_head = __atomic_load_n(&ch->req.head,
+                __ATOMIC_ACQUIRE);
+        c->idx[s].resp_head = ch->resp.head;
+    }
+
+    return c;
+}
+
+void dsht_client_destroy(struct dsht_client * c)
+{
+    if (c != NULL) {
+        __atomic_store_n(&c->h->clients_used[c->id], 0, __ATOMIC_RELEASE);
+        free(c->idx);
+        free(c);
+    }
+}
+
+int dsht_submit(struct dsht_client * c, enum dsht_op op, void * key,
+        size_t keylen, void * value, void * cookie)
+{
+    int s;
+    struct channel * ch;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    s = shard_of(c->h, key, keylen);
+    ch = channel(c->h, c->id, s);
+
+    if (c->idx[s].req_tail - c->idx[s].req_head == RING_SIZE) {
+        c->idx[s].req_head = __atomic_load_n(&ch->req.head,
+                __ATOMIC_ACQUIRE);
+        if (c->idx[s].req_tail - c->idx[s].req_head == RING_SIZE)
+            return -1;
+    }
+
+    ch->req.slots[c->idx[s].req_tail & RING_MASK] = (struct request) {
+        .op = op,
+        .keylen = keylen,
+        .key = key,
+        .value = value,
+        .cookie = cookie,
+    };
+    c->idx[s].req_tail++;
+
+    return 0;
+}
+
+void dsht_flush(struct dsht_client * c)
+{
+    int s;
+    struct channel * ch;
+
+    for (s = 0 ; s < c->h->num_shards ; s++) {
+        ch = channel(c->h, c->id, s);
+        if (ch->req.tail != c->idx[s].req_tail)
+            __atomic_store_n(&ch->req.tail, c->idx[s].req_tail,
+                    __ATOMIC_RELEASE);
+    }
+}
+
+int dsht_poll(struct dsht_client * c, struct dsht_response * responses,
+        int max)
+{
+    int s, n;
+    uint32_t head, tail;
+    struct channel * ch;
+
+    dsht_flush(c);
+
+    n = 0;
+    for (s = 0 ; s < c->h->num_shards && n < max ; s++) {
+        ch = channel(c->h, c->id, s);
+        head = c->idx[s].resp_head;
+        tail = __atomic_load_n(&ch->resp.tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail && n < max)
+            responses[n++] = ch->resp.slots[head++ & RING_MASK].r;
+
+        if (head != c->idx[s].resp_head) {
+            c->idx[s].resp_head = head;
+            __atomic_store_n(&ch->resp.head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    return n;
+}
+
+static struct dsht_response
+dsht_call(struct dsht_client * c, enum dsht_op op, void * key,
+        size_t keylen, void * value)
+{
+    int idle;
+    struct dsht_response resp = { .rv = -1 };
+
+    if (dsht_submit(c, op, key, keylen, value, NULL) != 0)
+        return resp;
+
+    idle = 0;
+    while (dsht_poll(c, &resp, 1) == 0) {
+        if (++idle >= IDLE_SPINS) {
+            idle = 0;
+            sched_yield();
+        }
+    }
+
+    return resp;
+}
+
+int dsht_insert(struct dsht_client * c, void * key, size_t keylen,
+        void * value)
+{
+    return dsht_call(c, DSHT_INSERT, key, keylen, value).rv;
+}
+
+void * dsht_lookup(struct dsht_client * c, void * key, size_t keylen)
+{
+    return dsht_call(c, DSHT_LOOKUP, key, keylen, NULL).value;
+}
+
+void * dsht_lookup_insert(struct dsht_client * c, void * key, size_t keylen,
+        void * value)
+{
+    return dsht_call(c, DSHT_LOOKUP_INSERT, key, keylen, value).value;
+}
+
+int dsht_remove(struct dsht_client * c, void * key, size_t keylen)
+{
+    return dsht_call(c, DSHT_REMOVE, key, keylen, NULL).rv;
+}
+
+void dsht_dump_stats(struct dsht const * h)
+{
+    int i;
+    struct shard const * s;
+
+    for (i = 0 ; i < h->num_shards ; i++) {
+        s = &h->shards[i];
+        printf("### shard %d\n", i);
+        printf("requests: %lu\n", s->cpt_requests);
+        printf("batches: %lu\n", s->cpt_batches);
+        sht_dump_stats(s->sht);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef DELEGATED_HASHTABLE_HEADER
+#define DELEGATED_HASHTABLE_HEADER
+
+#include <stddef.h>
+
+/* delegated hashtable: the key space is split in shards, each owned by a
+ * server thread running an unsynchronized sht. Clients never touch the
+ * tables, they send their requests to the shard owning the key through a
+ * ring dedicated to this (client, shard) pair, and poll for the responses.
+ *
+ * Keys are read by the server: they must stay valid until the response
+ * of their request has been polled */
+struct dsht;
+struct dsht_client;
+
+enum dsht_op {
+    DSHT_LOOKUP,
+    DSHT_INSERT,
+    DSHT_LOOKUP_INSERT,
+    DSHT_REMOVE,
+};
+
+struct dsht_response {
+    void * cookie;
+    void * value; /* DSHT_LOOKUP and DSHT_LOOKUP_INSERT result */
+    int rv;       /* DSHT_INSERT and DSHT_REMOVE result */
+};
+
+/* start num_shards server threads, pinned to cpus[i] if cpus is not NULL */
+struct dsht * dsht_create(int num_shards, int max_clients, int size,
+        int const * cpus);
+void dsht_destroy(struct dsht * h);
+
+/* a client is used by a single thread,
+ * and destroyed with no request in flight */
+struct dsht_client * dsht_client_create(struct dsht * h);
+void dsht_client_destroy(struct dsht_client * c);
+
+/* queue a request, return -1 if its ring is full: poll some responses.
+ * Requests are sent by batch, on dsht_flush() and dsht_poll() */
+int dsht_submit(struct dsht_client * c, enum dsht_op op, void * key,
+        size_t keylen, void * value, void * cookie);
+void dsht_flush(struct dsht_client * c);
+int dsht_poll(struct dsht_client * c, struct dsht_response * responses,
+        int max);
+
+/* synchronous helpers, expect no request in flight */
+int dsht_insert(struct dsht_client * c, void * key, size_t keylen,
+        void * value);
+void * dsht_lookup(struct dsht_client * c, void * key, size_t keylen);
+void * dsht_lookup_insert(struct dsht_client * c, void * key, size_t keylen,
+        void * value);
+int dsht_remove(struct dsht_client * c, void * key, size_t keylen);
+
+void dsht_dump_stats(struct dsht const * h);
+
+#endif /* DELEGATED_HASHTABLE_HEADER */
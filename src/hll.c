@@ -0,0 +1,324 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "hll.h"
+
+#define MIN_PRECISION 4
+#define MAX_PRECISION 18
+#define DEFAULT_PRECISION 12
+
+#define HASH_BITS 64
+
+/* sparse entries are (register index << 8 | rank), sorted */
+#define SPARSE_MIN_CAP 16
+#define SPARSE_ENTRY(idx, rank) (((uint32_t) (idx) << 8) | (rank))
+#define SPARSE_IDX(entry) ((entry) >> 8)
+#define SPARSE_RANK(entry) ((uint8_t) ((entry) & 0xff))
+
+struct hll {
+    int precision;
+    uint32_t num_registers;
+
+    /* sparse while registers is NULL */
+    uint32_t sparse_len;
+    uint32_t sparse_cap;
+    uint32_t * sparse;
+
+    uint8_t * registers;
+};
+
+struct hll * hll_create(int precision)
+{
+    struct hll * h;
+
+    if (precision <= 0)
+        precision = DEFAULT_PRECISION;
+
+    if (precision < MIN_PRECISION || precision > MAX_PRECISION)
+        return NULL;
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    h->precision = precision;
+    h->num_registers = 1 << precision;
+
+    return h;
+}
+
+void hll_destroy(struct hll * h)
+{
+    if (h != NULL) {
+        free(h->sparse);
+        free(h->registers);
+        free(h);
+    }
+}
+
+static int
+hll_densify(struct hll * h)
+{
+    uint32_t i;
+
+    h->registers = calloc(h->num_registers, sizeof(*h->registers));
+    if (h->registers == NULL)
+        return -1;
+
+    for (i = 0 ; i < h->sparse_len ; i++)
+        h->registers[SPARSE_IDX(h->sparse[i])] = SPARSE_RANK(h->sparse[i]);
+
+    free(h->sparse);
+    h->sparse = NULL;
+    h->sparse_len = 0;
+    h->sparse_cap = 0;
+
+    return 0;
+}
+
+/* first index of sparse not below idx */
+static uint32_t
+sparse_lower_bound(struct hll const * h, uint32_t idx)
+{
+    uint32_t lo, hi, mid;
+
+    lo = 0;
+    hi = h->sparse_len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (SPARSE_IDX(h->sparse[mid]) < idx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void
+sparse_set(struct hll * h, uint32_t idx, uint8_t rank)
+{
+    uint32_t i, cap;
+    uint32_t * sparse;
+
+    i = sparse_lower_bound(h, idx);
+    if (i < h->sparse_len && SPARSE_IDX(h->sparse[i]) == idx) {
+        if (rank > SPARSE_RANK(h->sparse[i]))
+            h->sparse[i] = SPARSE_ENTRY(idx, rank);
+
+        return;
+    }
+
+    if (h->sparse_len == h->sparse_cap) {
+        /* past this point, one byte per register is smaller */
+        cap = MAX(h->sparse_cap * 2, SPARSE_MIN_CAP);
+        if (cap * sizeof(*sparse) >= h->num_registers)
+            goto densify;
+
+        sparse = realloc(h->sparse, cap * sizeof(*sparse));
+        if (sparse == NULL)
+            goto densify;
+
+        h->sparse = sparse;
+        h->sparse_cap = cap;
+    }
+
+    memmove(&h->sparse[i + 1], &h->sparse[i],
+            (h->sparse_len - i) * sizeof(*h->sparse));
+    h->sparse[i] = SPARSE_ENTRY(idx, rank);
+    h->sparse_len++;
+
+    return;
+
+densify:
+    /* on failure, the estimator stays sparse and this key is lost */
+    if (hll_densify(h) == 0)
+        h->registers[idx] = rank;
+}
+
+static inline
+void hll_set(struct hll * h, uint32_t idx, uint8_t rank)
+{
+    if (likely(h->registers != NULL)) {
+        if (rank > h->registers[idx])
+            h->registers[idx] = rank;
+    } else {
+        sparse_set(h, idx, rank);
+    }
+}
+
+void hll_add_hash(struct hll * h, uint64_t hash)
+{
+    uint8_t rank;
+    uint32_t idx;
+    uint64_t rest;
+
+    /* first bits select the register,
+     * it keeps the longest run of leading zeros seen in the others */
+    idx = hash >> (HASH_BITS - h->precision);
+    rest = hash << h->precision;
+    if (rest == 0)
+        rank = HASH_BITS - h->precision + 1;
+    else
+        rank = __builtin_clzll(rest) + 1;
+
+    hll_set(h, idx, rank);
+}
+
+uint64_t hll_hash(void * key, size_t keylen)
+{
+    return fnv_hash64(key, keylen);
+}
+
+void hll_add(struct hll * h, void * key, size_t keylen)
+{
+    hll_add_hash(h, hll_hash(key, keylen));
+}
+
+/* registers-wise max */
+static void
+registers_merge(uint8_t * dst, uint8_t const * src, uint32_t n)
+{
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i a, b;
+
+    for (; i + 32 <= n ; i += 32) {
+        a = _mm256_loadu_si256((__m256i const *) &dst[i]);
+        b = _mm256_loadu_si256((__m256i const *) &src[i]);
+        _mm256_storeu_si256((__m256i *) &dst[i], _mm256_max_epu8(a, b));
+    }
+#elif defined(__SSE2__)
+    __m128i a, b;
+
+    for (; i + 16 <= n ; i += 16) {
+        a = _mm_loadu_si128((__m128i const *) &dst[i]);
+        b = _mm_loadu_si128((__m128i const *) &src[i]);
+        _mm_storeu_si128((__m128i *) &dst[i], _mm_max_epu8(a, b));
+    }
+#endif
+
+    for (; i < n ; i++)
+        dst[i] = MAX(dst[i], src[i]);
+}
+
+int hll_merge(struct hll * dst, struct hll const * src)
+{
+    uint32_t i;
+
+    if (dst->precision != src->precision)
+        return -1;
+
+    if (src->registers == NULL) {
+        for (i = 0 ; i < src->sparse_len ; i++)
+            hll_set(dst, SPARSE_IDX(src->sparse[i]),
+                    SPARSE_RANK(src->sparse[i]));
+
+        return 0;
+    }
+
+    if (dst->registers == NULL && hll_densify(dst) != 0)
+        return -1;
+
+    registers_merge(dst->registers, src->registers, dst->num_registers);
+
+    return 0;
+}
+
+/* helpers of the estimator from O. Ertl, "New cardinality estimation
+ * algorithms for HyperLogLog sketches" (2017). No empirical bias
+ * correction needed, over the whole range */
+static double
+ertl_sigma(double x)
+{
+    double y, z, prev;
+
+    if (x == 1.0)
+        return INFINITY;
+
+    y = 1.0;
+    z = x;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (z != prev);
+
+    return z;
+}
+
+static double
+ertl_tau(double x)
+{
+    double y, z, prev;
+
+    if (x == 0.0 || x == 1.0)
+        return 0.0;
+
+    y = 1.0;
+    z = 1.0 - x;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != prev);
+
+    return z / 3.0;
+}
+
+uint64_t hll_count(struct hll const * h)
+{
+    int k, q;
+    uint32_t i;
+    double m, z;
+    uint32_t histogram[HASH_BITS + 2] = {0};
+
+    /* registers are only used through the histogram of their ranks */
+    if (h->registers != NULL) {
+        for (i = 0 ; i < h->num_registers ; i++)
+            histogram[h->registers[i]]++;
+    } else {
+        histogram[0] = h->num_registers - h->sparse_len;
+        for (i = 0 ; i < h->sparse_len ; i++)
+            histogram[SPARSE_RANK(h->sparse[i])]++;
+    }
+
+    m = h->num_registers;
+    q = HASH_BITS - h->precision;
+
+    z = m * ertl_tau(1.0 - histogram[q + 1] / m);
+    for (k = q ; k >= 1 ; k--)
+        z = 0.5 * (z + histogram[k]);
+
+    z += m * ertl_sigma(histogram[0] / m);
+
+    return (uint64_t) llround(m * m / (2.0 * log(2.0)) / z);
+}
+
+size_t hll_size(struct hll const * h)
+{
+    if (h->registers != NULL)
+        return h->num_registers * sizeof(*h->registers);
+
+    return h->sparse_cap * sizeof(*h->sparse);
+}
+
+void hll_dump_stats(struct hll const * h)
+{
+    printf("precision: %d\n", h->precision);
+    printf("representation: %s\n", h->registers != NULL ? "dense" : "sparse");
+    printf("size: %zu\n", hll_size(h));
+    printf("estimated count: %lu\n", hll_count(h));
+}
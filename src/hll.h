@@ -0,0 +1,37 @@
+#ifndef HYPERLOGLOG_HEADER
+#define HYPERLOGLOG_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* HyperLogLog distinct count estimator.
+ *
+ * Uses 2^precision registers, for a standard error of about
+ * 1.04 / sqrt(2^precision): 1.6% with the default precision of 12.
+ * Estimators start sparse, only storing the registers set, and switch to
+ * one byte per register once that gets smaller.
+ *
+ * An estimator is not thread-safe: count with one per thread, and merge */
+struct hll;
+
+/* precision is within [4, 18], or <= 0 for the default */
+struct hll * hll_create(int precision);
+void hll_destroy(struct hll * h);
+
+void hll_add(struct hll * h, void * key, size_t keylen);
+/* add a key from its 64-bit hash. Keys added with hll_add() are hashed
+ * with hll_hash(), hashing them ahead counts them as the same keys */
+void hll_add_hash(struct hll * h, uint64_t hash);
+uint64_t hll_hash(void * key, size_t keylen);
+
+uint64_t hll_count(struct hll const * h);
+
+/* add src keys to dst, both must have the same precision */
+int hll_merge(struct hll * dst, struct hll const * src);
+
+/* memory used by the registers, in bytes */
+size_t hll_size(struct hll const * h);
+
+void hll_dump_stats(struct hll const * h);
+
+#endif /* HYPERLOGLOG_HEADER */
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE /* memfd_create() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "psht.h"
+
+#define PSHT_MAGIC 0x70736874 /* "psht" */
+#define PSHT_VERSION 1
+
+#define DEFAULT_NUM_LINES 100
+
+/* allocator size classes: blocks of 1 << (class + MIN_BLOCK_SHIFT) bytes */
+#define MIN_BLOCK_SHIFT 5
+#define NUM_CLASSES 40
+
+/* every reference in the region is an offset from its start, 0 is NULL */
+struct psht_node {
+    uint64_t next;
+    uint32_t hash;
+    uint32_t keylen;
+    uint64_t valuelen;
+    uint8_t data[]; /* key, then value */
+};
+
+struct psht_line {
+    pthread_mutex_t lock;
+    uint32_t len;
+    uint64_t nodes;
+};
+
+/* allocated blocks header the block class, free blocks the next free one */
+struct psht_block {
+    uint64_t hdr;
+    uint8_t data[];
+};
+
+struct psht_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mem_size;
+    uint32_t size;
+    uint64_t lines;
+
+    /* allocator */
+    pthread_mutex_t alloc_lock;
+    uint64_t heap;
+    uint64_t free_lists[NUM_CLASSES];
+
+    /* stats */
+    uint64_t cpt_lookup;
+    uint64_t cpt_insert;
+    uint64_t cpt_remove;
+    uint64_t cpt_collisions;
+    uint64_t cpt_alloc_fail;
+    uint64_t cpt_owner_dead;
+};
+
+/* process local handle */
+struct psht {
+    int fd;
+    size_t mem_size;
+    union {
+        struct psht_header * hdr;
+        uint8_t * base;
+    } u;
+};
+
+#define PSHT_PTR(h, off) ((void *) ((h)->u.base + (off)))
+
+static inline
+struct psht_line * psht_line(struct psht * h, uint32_t hash)
+{
+    struct psht_line * lines = PSHT_PTR(h, h->u.hdr->lines);
+
+    return &lines[hash % h->u.hdr->size];
+}
+
+static void
+line_recover(struct psht * h, struct psht_line * line)
+{
+    uint32_t len;
+    uint64_t off;
+    struct psht_node * node;
+
+    /* links are always updated with a single store: the chain is sane.
+     * Only the length may be off, and a node may have leaked */
+    len = 0;
+    for (off = line->nodes ; off != 0 ; off = node->next) {
+        node = PSHT_PTR(h, off);
+        len++;
+    }
+
+    line->len = len;
+}
+
+/* lock a robust mutex, repair the line it protects if its owner died */
+static int
+psht_mutex_lock(struct psht * h, pthread_mutex_t * mutex,
+        struct psht_line * line)
+{
+    int rv;
+
+    rv = pthread_mutex_lock(mutex);
+    if (unlikely(rv == EOWNERDEAD)) {
+        if (line != NULL)
+            line_recover(h, line);
+
+        atomic_incr(h->u.hdr->cpt_owner_dead);
+        rv = pthread_mutex_consistent(mutex);
+
+        /* callers only unlock what they locked */
+        if (unlikely(rv != 0))
+            pthread_mutex_unlock(mutex);
+    }
+
+    return rv;
+}
+
+static int
+psht_mutex_init(pthread_mutex_t * mutex)
+{
+    int rv;
+    pthread_mutexattr_t attr;
+
+    rv = pthread_mutexattr_init(&attr);
+    if (rv != 0)
+        return rv;
+
+    rv = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (rv == 0)
+        rv = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    if (rv == 0)
+        rv = pthread_mutex_init(mutex, &attr);
+
+    pthread_mutexattr_destroy(&attr);
+
+    return rv;
+}
+
+static inline
+int block_class(size_t size)
+{
+    int c;
+
+    for (c = 0 ; c < NUM_CLASSES ; c++) {
+        if (size <= ((size_t) 1 << (c + MIN_BLOCK_SHIFT)))
+            return c;
+    }
+
+    return -1;
+}
+
+/* return the offset of size bytes in the region, 0 if full */
+static uint64_t
+psht_alloc(struct psht * h, size_t size)
+{
+    int c;
+    uint64_t off;
+    uint64_t block_size;
+    struct psht_block * block;
+    struct psht_header * hdr = h->u.hdr;
+
+    c = block_class(size + sizeof(*block));
+    if (unlikely(c < 0))
+        return 0;
+
+    if (psht_mutex_lock(h, &hdr->alloc_lock, NULL) != 0)
+        return 0;
+
+    off = hdr->free_lists[c];
+    if (off != 0) {
+        block = PSHT_PTR(h, off);
+        hdr->free_lists[c] = block->hdr;
+    } else {
+        block_size = (uint64_t) 1 << (c + MIN_BLOCK_SHIFT);
+        if (hdr->heap + block_size <= hdr->mem_size) {
+            off = hdr->heap;
+            hdr->heap += block_size;
+        }
+    }
+
+    pthread_mutex_unlock(&hdr->alloc_lock);
+
+    if (unlikely(off == 0)) {
+        atomic_incr(hdr->cpt_alloc_fail);
+        return 0;
+    }
+
+    block = PSHT_PTR(h, off);
+    block->hdr = c;
+
+    return off + offsetof(struct psht_block, data);
+}
+
+static void
+psht_free(struct psht * h, uint64_t off)
+{
+    int c;
+    struct psht_block * block;
+    struct psht_header * hdr = h->u.hdr;
+
+    off -= offsetof(struct psht_block, data);
+    block = PSHT_PTR(h, off);
+    c = block->hdr;
+
+    if (psht_mutex_lock(h, &hdr->alloc_lock, NULL) != 0)
+        return; /* leak */
+
+    block->hdr = hdr->free_lists[c];
+    hdr->free_lists[c] = off;
+
+    pthread_mutex_unlock(&hdr->alloc_lock);
+}
+
+static struct psht *
+psht_map(int fd, size_t mem_size)
+{
+    void * base;
+    struct psht * h;
+
+    h = malloc(sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    base = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(h);
+        return NULL;
+    }
+
+    *h = (struct psht) {
+        .fd = fd,
+        .mem_size = mem_size,
+        .u.base = base,
+    };
+
+    return h;
+}
+
+static int
+psht_format(struct psht * h, int size)
+{
+    int i;
+    uint64_t heap;
+    struct psht_line * lines;
+    struct psht_header * hdr = h->u.hdr;
+
+    heap = (sizeof(*hdr) + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+    lines = PSHT_PTR(h, heap);
+    heap += size * sizeof(*lines);
+    heap = (heap + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+    if (heap >= h->mem_size)
+        return -1;
+
+    memset(hdr, 0, sizeof(*hdr));
+    if (psht_mutex_init(&hdr->alloc_lock) != 0)
+        return -1;
+
+    for (i = 0 ; i < size ; i++) {
+        memset(&lines[i], 0, sizeof(lines[i]));
+        if (psht_mutex_init(&lines[i].lock) != 0)
+            return -1;
+    }
+
+    hdr->version = PSHT_VERSION;
+    hdr->mem_size = h->mem_size;
+    hdr->size = size;
+    hdr->lines = (uint8_t *) lines - h->u.base;
+    hdr->heap = heap;
+
+    /* the region is only valid once the magic is set */
+    __atomic_store_n(&hdr->magic, PSHT_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+struct psht * psht_create(char const * name, int size, size_t mem_size)
+{
+    int fd;
+    struct psht * h;
+
+    if (size <= 0)
+        size = DEFAULT_NUM_LINES;
+
+    if (name == NULL)
+        fd = memfd_create("psht", MFD_CLOEXEC);
+    else
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, mem_size) != 0)
+        goto err;
+
+    h = psht_map(fd, mem_size);
+    if (h == NULL)
+        goto err;
+
+    if (psht_format(h, size) != 0) {
+        psht_close(h);
+        if (name != NULL)
+            shm_unlink(name);
+
+        return NULL;
+    }
+
+    return h;
+
+err:
+    close(fd);
+    if (name != NULL)
+        shm_unlink(name);
+
+    return NULL;
+}
+
+struct psht * psht_open_fd(int fd)
+{
+    struct stat st;
+    struct psht * h;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*h->u.hdr))
+        return NULL;
+
+    h = psht_map(fd, st.st_size);
+    if (h == NULL)
+        return NULL;
+
+    if (__atomic_load_n(&h->u.hdr->magic, __ATOMIC_ACQUIRE) != PSHT_MAGIC
+       || h->u.hdr->version != PSHT_VERSION
+       || h->u.hdr->mem_size != h->mem_size) {
+        munmap(h->u.base, h->mem_size);
+        free(h);
+        return NULL;
+    }
+
+    return h;
+}
+
+struct psht * psht_open(char const * name)
+{
+    int fd;
+    struct psht * h;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    h = psht_open_fd(fd);
+    if (h == NULL)
+        close(fd);
+
+    return h;
+}
+
+void psht_close(struct psht * h)
+{
+    if (h != NULL) {
+        munmap(h->u.base, h->mem_size);
+        close(h->fd);
+        free(h);
+    }
+}
+
+int psht_unlink(char const * name)
+{
+    return shm_unlink(name);
+}
+
+int psht_fd(struct psht const * h)
+{
+    return h->fd;
+}
+
+/* expects line to be locked */
+static struct psht_node *
+line_lookup(struct psht * h, struct psht_line * line, uint32_t hash,
+        void const * key, size_t keylen, uint64_t ** link)
+{
+    uint64_t * next;
+    struct psht_node * node;
+
+    for (next = &line->nodes ; *next != 0 ; next = &node->next) {
+        node = PSHT_PTR(h, *next);
+        if (node->hash == hash
+           && node->keylen == keylen
+           && memcmp(node->data, key, keylen) == 0) {
+            if (link != NULL)
+                *link = next;
+
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+int psht_insert(struct psht * h, void const * key, size_t keylen,
+        void const * value, size_t valuelen)
+{
+    int collision;
+    uint64_t off;
+    uint32_t hash;
+    struct psht_line * line;
+    struct psht_node * node;
+
+    if (unlikely(key == NULL || keylen == 0 || keylen > UINT32_MAX))
+        return -1;
+
+    /* allocate unlocked: the allocator and line locks are never nested */
+    off = psht_alloc(h, sizeof(*node) + keylen + valuelen);
+    if (unlikely(off == 0))
+        return -1;
+
+    hash = oat_hash(VOIDPTR(key), keylen);
+    node = PSHT_PTR(h, off);
+    *node = (struct psht_node) {
+        .hash = hash,
+        .keylen = keylen,
+        .valuelen = valuelen,
+    };
+    memcpy(node->data, key, keylen);
+    memcpy(node->data + keylen, value, valuelen);
+
+    line = psht_line(h, hash);
+    if (psht_mutex_lock(h, &line->lock, line) != 0)
+        goto err;
+
+    if (line_lookup(h, line, hash, key, keylen, NULL) != NULL) {
+        pthread_mutex_unlock(&line->lock);
+        goto err;
+    }
+
+    collision = (line->nodes != 0);
+    node->next = line->nodes;
+    line->nodes = off;
+    line->len++;
+
+    pthread_mutex_unlock(&line->lock);
+
+    atomic_incr(h->u.hdr->cpt_insert);
+    if (collision)
+        atomic_incr(h->u.hdr->cpt_collisions);
+
+    return 0;
+
+err:
+    psht_free(h, off);
+    return -1;
+}
+
+int psht_lookup(struct psht * h, void const * key, size_t keylen,
+        void * value, size_t * valuelen)
+{
+    uint32_t hash;
+    struct psht_line * line;
+    struct psht_node * node;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    atomic_incr(h->u.hdr->cpt_lookup);
+
+    hash = oat_hash(VOIDPTR(key), keylen);
+    line = psht_line(h, hash);
+    if (psht_mutex_lock(h, &line->lock, line) != 0)
+        return -1;
+
+    node = line_lookup(h, line, hash, key, keylen, NULL);
+    if (node != NULL && valuelen != NULL) {
+        memcpy(value, node->data + node->keylen, MIN(*valuelen,
+                    node->valuelen));
+        *valuelen = node->valuelen;
+    }
+
+    pthread_mutex_unlock(&line->lock);
+
+    return node != NULL ? 0 : -1;
+}
+
+int psht_remove(struct psht * h, void const * key, size_t keylen)
+{
+    uint64_t off;
+    uint64_t * link;
+    uint32_t hash;
+    struct psht_line * line;
+    struct psht_node * node;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    hash = oat_hash(VOIDPTR(key), keylen);
+    line = psht_line(h, hash);
+    if (psht_mutex_lock(h, &line->lock, line) != 0)
+        return -1;
+
+    off = 0;
+    node = line_lookup(h, line, hash, key, keylen, &link);
+    if (node != NULL) {
+        off = *link;
+        *link = node->next;
+        line->len--;
+    }
+
+    pthread_mutex_unlock(&line->lock);
+
+    if (off == 0)
+        return -1;
+
+    psht_free(h, off);
+    atomic_incr(h->u.hdr->cpt_remove);
+
+    return 0;
+}
+
+void psht_dump_stats(struct psht const * h)
+{
+    uint32_t i;
+    uint64_t num_nodes = 0;
+    struct psht_header const * hdr = h->u.hdr;
+    struct psht_line const * lines = PSHT_PTR(h, hdr->lines);
+
+    for (i = 0 ; i < hdr->size ; i++)
+        num_nodes += lines[i].len;
+
+    printf("number of nodes: %lu\n", num_nodes);
+    printf("heap usage: %lu/%lu\n", hdr->heap, hdr->mem_size);
+    printf("lookups: %lu\n", hdr->cpt_lookup);
+    printf("inserts: %lu\n", hdr->cpt_insert);
+    printf("removes: %lu\n", hdr->cpt_remove);
+    printf("collisions: %lu\n", hdr->cpt_collisions);
+    printf("allocation failures: %lu\n", hdr->cpt_alloc_fail);
+    printf("dead lock owners: %lu\n", hdr->cpt_owner_dead);
+}
@@ -0,0 +1,34 @@
+#ifndef PROCESS_SHARED_HASHTABLE_HEADER
+#define PROCESS_SHARED_HASHTABLE_HEADER
+
+#include <stddef.h>
+
+/* simple table of linked-lists living in a shared memory region.
+ *
+ * Nodes are referenced by their offset in the region, so that each process
+ * can map it anywhere. The number of lines and the region size are fixed at
+ * creation: keys and values are copied into the region.
+ * Locks are robust: a process dying while holding one does not block the
+ * others, the next owner repairs what it protected */
+struct psht;
+
+/* name is a shm_open() name, or NULL for an anonymous memfd region which
+ * can be shared through psht_fd() (fork, SCM_RIGHTS) */
+struct psht * psht_create(char const * name, int size, size_t mem_size);
+struct psht * psht_open(char const * name);
+struct psht * psht_open_fd(int fd);
+void psht_close(struct psht * h);
+int psht_unlink(char const * name);
+int psht_fd(struct psht const * h);
+
+/* fails if the key is already present, or if the region is full */
+int psht_insert(struct psht * h, void const * key, size_t keylen,
+        void const * value, size_t valuelen);
+/* copy at most *valuelen bytes of the value, and set *valuelen to its size */
+int psht_lookup(struct psht * h, void const * key, size_t keylen,
+        void * value, size_t * valuelen);
+int psht_remove(struct psht * h, void const * key, size_t keylen);
+
+void psht_dump_stats(struct psht const * h);
+
+#endif /* PROCESS_SHARED_HASHTABLE_HEADER */
@@ -1,20 +1,74 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MADV_DONTNEED */
 
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "sht.h"
 
 #define DEFAULT_NUM_LINES 100
 
+/* chains longer than this (and than twice max_line_depth, past which the
+ * table would have grown if it could) are turned into a sorted index so
+ * that the line search stays logarithmic when the table cannot grow.
+ * The index is dropped when the line shrinks back under UNTREEIFY_DEPTH */
+#define TREEIFY_MIN_DEPTH 8
+#define UNTREEIFY_DEPTH 6
+
+/* number of nodes a SHT_F_SMALL table holds before allocating its lines */
+#define SMALL_NUM_NODES 8
+
+/* number of reader threads a SHT_F_SWMR table can register */
+#define SWMR_MAX_READERS 64
+
+/* number of deferred frees accumulated before trying to reclaim them */
+#define SWMR_RECLAIM_BATCH 64
+
+/* hashes are 32-bit: more lines would stay empty */
+#define MAX_NUM_LINES ((uint64_t) 1 << 32)
+
+/* default gc budget of each operation, while migrating nodes */
+#define GC_MIN_PROBES 4
+#define GC_MAX_PROBES 256
+
+/* records buffered by each thread before writing them to the trace */
+#define TRACE_BUF_RECORDS 4096
+
+/* SHT_F_SLAB nodes and their key share a slot of a slab. Slabs are aligned
+ * on their size, so that a slot finds the slab header. Slot sizes are
+ * powers of 2, one class each: larger nodes are allocated on their own */
+#define SLAB_SIZE ((size_t) 1 << 16)
+#define SLAB_MIN_SLOT 64
+#define SLAB_NUM_CLASSES 4
+#define SLAB_MAX_SLOT (SLAB_MIN_SLOT << (SLAB_NUM_CLASSES - 1))
+#define SLAB_MAX_SLOTS (SLAB_SIZE / SLAB_MIN_SLOT)
+
+/* compaction evacuates the slabs at most 1 / SLAB_SPARSE_RATIO full */
+#define SLAB_SPARSE_RATIO 4
+
+/* short on memory, a resize grows the table by less, down to
+ * 1 / MIN_GROWTH_DIV more lines */
+#define MIN_GROWTH_DIV 8
+
+enum node_origin {
+    NODE_MALLOC, /* node and key allocated apart */
+    NODE_SLAB,   /* from a slab slot, key included */
+    NODE_POOL,   /* from the reserve pool, key included */
+    NODE_BATCH,  /* from a write buffer batch, key included */
+};
+
 struct node {
     uint32_t hash;
+    uint32_t origin;
     void * key;
     size_t keylen;
     void * data;
@@ -22,22 +76,164 @@ struct node {
     struct node * next;
 };
 
+/* nodes of a treeified line sorted by (hash, keylen, key) */
+struct line_index {
+    size_t cap;
+    struct node * nodes[];
+};
+
+/* insert published by a thread waiting for a contended line.
+ * Lives on the waiter stack until done is set */
+struct fc_request {
+    struct fc_request * next;
+    struct node * node;
+    int unique;   /* do not insert node if its key is already there */
+    int inserted;
+    void * data;  /* data of the node found or inserted */
+    int done;
+};
+
+/* a line either chains its nodes, or keeps them all in its index */
 struct line {
     pthread_spinlock_t lock;
-    int len;
+    size_t len;
     struct node * nodes;
+    struct line_index * index;
+    struct fc_request * pending; /* flat-combining publication list */
+};
+
+/* one cacheline per reader, so that readers never share a written line */
+struct swmr_reader {
+    uint64_t epoch; /* last quiescent epoch seen, 0 if unused */
+    char pad[CACHELINE_SIZE - sizeof(uint64_t)];
+};
+
+struct swmr_deferred {
+    void * ptr;
+    uint64_t epoch; /* retire epoch */
+};
+
+/* single-writer/multi-reader state.
+ * Everything but the readers array is only written by the writer */
+struct swmr {
+    uint64_t epoch;
+    unsigned seq; /* odd while lines and size are being replaced */
+
+    size_t deferred_len;
+    size_t deferred_cap;
+    struct swmr_deferred * deferred;
+
+    struct swmr_reader readers[SWMR_MAX_READERS];
+};
+
+/* per-thread trace buffer, kept until the table is destroyed */
+struct trace_buf {
+    struct trace_buf * next;
+    pthread_t thread;
+    uint32_t id;
+    uint64_t count; /* operations of the thread, only written by it */
+
+    pthread_spinlock_t lock; /* against the flush of sht_trace_stop() */
+    uint32_t len;
+    struct sht_trace_record records[TRACE_BUF_RECORDS];
+};
+
+struct trace {
+    uint64_t gen; /* tells the traces apart in the threads cache */
+    int active;
+    int fd;
+    int error;
+    uint32_t sample_mask;
+    uint64_t start_ns;
+
+    pthread_mutex_t lock; /* buffer creation and trace writes */
+    uint32_t num_bufs;
+    struct trace_buf * bufs;
+};
+
+enum slab_state {
+    SLAB_ACTIVE,
+    SLAB_EVACUATING, /* its nodes are moved out, nothing is allocated */
+    SLAB_RELEASING,  /* empty, its pages are being given back */
+    SLAB_RELEASED,   /* empty, only the header page is resident */
+};
+
+/* the header, at the start of the slab */
+struct slab {
+    struct slab * next;
+    enum slab_state state;
+    uint32_t cls;
+    uint32_t slot_size;
+    uint32_t first;     /* first slot after the header */
+    uint32_t num_slots;
+    uint32_t used;
+    uint32_t bump;      /* the slots from there on were never allocated */
+    void * free_list;
+    uint64_t used_map[SLAB_MAX_SLOTS / 64];
+};
+
+struct slab_class {
+    pthread_spinlock_t lock;
+    struct slab * slabs;
+    struct slab * current;    /* allocating from */
+    struct slab * evacuating; /* being compacted */
+    uint32_t cursor;          /* next slot of evacuating to move */
+    uint64_t capacity;        /* slots of the slabs not released */
+    uint64_t used;
+    uint64_t num_slabs;
+} CACHE_ALIGNED;
+
+/* shared with the old table during a migration */
+struct slabs {
+    struct sht * owner;
+    int compacting;
+    int sparse;     /* some class is worth compacting */
+    int destroying; /* do not bother releasing anything */
+
+    uint64_t cpt_moved;
+    uint64_t cpt_released;
+    uint64_t mapped; /* bytes of the slabs, without their released pages */
+
+    struct slab_class classes[SLAB_NUM_CLASSES];
+};
+
+/* nodes set aside for when allocations fail, their key inline.
+ * Shared with the old table during a migration */
+struct node_pool {
+    struct sht * owner;
+    pthread_spinlock_t lock;
+    size_t keylen; /* longest key a pool node holds */
+    int target;
+    int len;
+    struct node * nodes; /* linked by next */
 };
 
 struct sht {
     struct sht * old;
+    int flags;
     int do_double_size;
-    int gc_index;
-    int gc_num;
-    int max_line_depth;
+    size_t gc_index;
+    size_t max_line_depth;
+
+    /* gc budget: gc_probes grows from gc_min_probes up to gc_max_probes
+     * as long as inserts outpace the migration */
+    int gc_probes;
+    int gc_min_probes;
+    int gc_max_probes;
+    uint64_t gc_max_ns;
 
     hash_fn hash;
-    struct line * lines;
-    int size;
+    struct line * lines; /* NULL while a small table */
+    size_t size;
+
+    /* small table, protected by global_lock */
+    int small_len;
+    struct node * small[SMALL_NUM_NODES];
+
+    struct swmr * swmr; /* only for SHT_F_SWMR tables */
+    struct trace * trace; /* from the first sht_trace_start() */
+    struct slabs * slabs; /* only for SHT_F_SLAB tables */
+    struct node_pool * pool; /* from sht_set_node_pool() */
 
     volatile int ref;
     pthread_spinlock_t global_lock;
@@ -52,32 +248,373 @@ struct sht {
     uint64_t cpt_collisions;
     uint64_t cpt_double_size;
     uint64_t cpt_double_size_fail;
+    uint64_t cpt_slow_growth;
+    uint64_t cpt_pool_used;
+    uint64_t cpt_treeify;
+    uint64_t cpt_combined;
+    uint64_t cpt_gc_lag;
+    uint64_t cpt_gc_timeout;
 };
 
-/* integer sqare root */
-#define ISQRRT_NEXT(n, i)  (((n) + (i) / (n)) >> 1)
+/* stats are only shared between threads when the table is */
+#define stat_incr(h, cpt) \
+    do { \
+        if ((h)->flags & SHT_F_NOSYNC) \
+            (h)->cpt++; \
+        else \
+            atomic_incr((h)->cpt); \
+    } while (0)
+
+#define stat_get(h, cpt) \
+    (((h)->flags & SHT_F_NOSYNC) ? (h)->cpt \
+        : __atomic_load_n(&(h)->cpt, __ATOMIC_RELAXED))
+
+/*
+ * Node slabs (SHT_F_SLAB)
+ *
+ * Each class allocates from its current slab, then from the fullest one,
+ * so that the sparse slabs drain. Slabs left empty give their pages back
+ * with madvise(), and are reused first. slabs_compact() moves the nodes
+ * still pinning the sparsest slabs.
+ */
+
+static inline
+struct slab * slab_of(void const * ptr)
+{
+    return (struct slab *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static inline
+void * slab_slot(struct slab const * slab, uint32_t i)
+{
+    return (char *) slab + (size_t) i * slab->slot_size;
+}
+
+static inline
+int slab_class_of(size_t size)
+{
+    int cls;
+
+    for (cls = 0 ; (size_t) SLAB_MIN_SLOT << cls < size ; cls++)
+        ;
+
+    return cls;
+}
+
+static struct slabs *
+slabs_create(struct sht * h)
+{
+    int cls;
+    struct slabs * s;
+
+    s = h->alloc(sizeof(*s));
+    if (s == NULL)
+        return NULL;
+
+    memset(s, 0, sizeof(*s));
+    s->owner = h;
+    for (cls = 0 ; cls < SLAB_NUM_CLASSES ; cls++)
+        pthread_spin_init(&s->classes[cls].lock, PTHREAD_PROCESS_PRIVATE);
+
+    return s;
+}
+
+static void
+slabs_destroy(free_fn _free, struct slabs * s)
+{
+    int cls;
+    struct slab * slab, * next;
+
+    for (cls = 0 ; cls < SLAB_NUM_CLASSES ; cls++) {
+        for (slab = s->classes[cls].slabs ; slab != NULL ; slab = next) {
+            next = slab->next;
+            munmap(slab, SLAB_SIZE);
+        }
+
+        pthread_spin_destroy(&s->classes[cls].lock);
+    }
+
+    _free(s);
+}
+
+/* map SLAB_SIZE bytes aligned on their size */
+static struct slab *
+slab_map(void)
+{
+    char * mem, * slab;
+    size_t head, tail;
+
+    mem = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    slab = (char *) slab_of(mem + SLAB_SIZE - 1);
+    head = slab - mem;
+    tail = SLAB_SIZE - head;
+    if (head > 0)
+        munmap(mem, head);
+
+    if (tail > 0)
+        munmap(slab + SLAB_SIZE, tail);
+
+    return (struct slab *) slab;
+}
+
+/* expects the class to be locked */
+static void
+slab_reset(struct slab_class * c, struct slab * slab)
+{
+    slab->state = SLAB_ACTIVE;
+    slab->used = 0;
+    slab->bump = slab->first;
+    slab->free_list = NULL;
+    memset(slab->used_map, 0, sizeof(slab->used_map));
+    c->capacity += slab->num_slots - slab->first;
+}
+
+/* expects the class to be locked.
+ * The fullest slab with a free slot, else a released one */
+static struct slab *
+slab_pick(struct slabs * s, struct slab_class * c)
+{
+    struct slab * slab, * best, * released;
+
+    best = released = NULL;
+    for (slab = c->slabs ; slab != NULL ; slab = slab->next) {
+        if (slab->state == SLAB_RELEASED) {
+            released = slab;
+        } else if (slab->state == SLAB_ACTIVE
+                && slab->used < slab->num_slots - slab->first
+                && (best == NULL || slab->used > best->used)) {
+            best = slab;
+        }
+    }
+
+    if (best == NULL && released != NULL) {
+        slab_reset(c, released);
+        __atomic_fetch_add(&s->mapped, SLAB_SIZE - PAGE_SIZE,
+                __ATOMIC_RELAXED);
+        best = released;
+    }
+
+    return best;
+}
+
+static void *
+slab_alloc(struct slabs * s, size_t size)
+{
+    uint32_t i;
+    void * ptr;
+    int cls = slab_class_of(size);
+    struct slab_class * c = &s->classes[cls];
+    struct slab * slab;
+
+    pthread_spin_lock(&c->lock);
+    slab = c->current;
+    if (slab == NULL || slab->state != SLAB_ACTIVE
+            || slab->used == slab->num_slots - slab->first) {
+        slab = slab_pick(s, c);
+        if (slab == NULL) {
+            /* do not map under the lock */
+            pthread_spin_unlock(&c->lock);
+            slab = slab_map();
+            if (unlikely(slab == NULL))
+                return NULL;
+
+            slab->cls = cls;
+            slab->slot_size = SLAB_MIN_SLOT << cls;
+            slab->num_slots = SLAB_SIZE / slab->slot_size;
+            slab->first = (sizeof(*slab) + slab->slot_size - 1)
+                / slab->slot_size;
+
+            __atomic_fetch_add(&s->mapped, SLAB_SIZE, __ATOMIC_RELAXED);
+
+            pthread_spin_lock(&c->lock);
+            slab_reset(c, slab);
+            slab->next = c->slabs;
+            c->slabs = slab;
+            c->num_slabs++;
+        }
+
+        c->current = slab;
+    }
+
+    if (slab->free_list != NULL) {
+        ptr = slab->free_list;
+        slab->free_list = *(void **) ptr;
+    } else {
+        ptr = slab_slot(slab, slab->bump++);
+    }
+
+    i = ((char *) ptr - (char *) slab) / slab->slot_size;
+    slab->used_map[i / 64] |= (uint64_t) 1 << (i % 64);
+    slab->used++;
+    c->used++;
+    pthread_spin_unlock(&c->lock);
+
+    return ptr;
+}
+
+static void
+slab_free(struct slabs * s, void * ptr)
+{
+    uint32_t i;
+    struct slab * slab = slab_of(ptr);
+    struct slab_class * c = &s->classes[slab->cls];
+    int release;
+
+    pthread_spin_lock(&c->lock);
+    i = ((char *) ptr - (char *) slab) / slab->slot_size;
+    slab->used_map[i / 64] &= ~((uint64_t) 1 << (i % 64));
+    *(void **) ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->used--;
+    c->used--;
+
+    release = (slab->used == 0 && slab != c->current && !s->destroying);
+    if (release) {
+        /* nothing is allocated from it until its pages are gone */
+        slab->state = SLAB_RELEASING;
+        c->capacity -= slab->num_slots - slab->first;
+        if (c->evacuating == slab)
+            c->evacuating = NULL;
+    }
+
+    /* only wake the compaction up when a slab turns sparse */
+    if (slab->used * SLAB_SPARSE_RATIO <= slab->num_slots - slab->first
+            && (slab->used + 1) * SLAB_SPARSE_RATIO
+                > slab->num_slots - slab->first
+            && c->num_slabs > 1)
+        __atomic_store_n(&s->sparse, 1, __ATOMIC_RELAXED);
+
+    pthread_spin_unlock(&c->lock);
+
+    if (release) {
+        madvise((char *) slab + PAGE_SIZE, SLAB_SIZE - PAGE_SIZE,
+                MADV_DONTNEED);
+        __atomic_fetch_sub(&s->mapped, SLAB_SIZE - PAGE_SIZE,
+                __ATOMIC_RELAXED);
+
+        pthread_spin_lock(&c->lock);
+        slab->state = SLAB_RELEASED;
+        pthread_spin_unlock(&c->lock);
+        atomic_incr(s->cpt_released);
+    }
+}
+
+/*
+ * Reserve node pool
+ *
+ * Nodes allocated ahead, for the inserts whose allocations fail: the table
+ * keeps accepting writes through a memory spike, as long as the pool lasts.
+ * Nodes removed go back to the pool, and sht_gc() refills it.
+ */
+
+static struct node *
+pool_get(struct node_pool * pool, size_t keylen)
+{
+    struct node * b;
+
+    if (pool == NULL || keylen > pool->keylen)
+        return NULL;
+
+    pthread_spin_lock(&pool->lock);
+    b = pool->nodes;
+    if (b != NULL) {
+        pool->nodes = b->next;
+        pool->len--;
+    }
+    pthread_spin_unlock(&pool->lock);
+
+    return b;
+}
+
+static void
+pool_put(struct sht * h, struct node_pool * pool, struct node * b)
+{
+    pthread_spin_lock(&pool->lock);
+    if (pool->len < pool->target) {
+        b->next = pool->nodes;
+        pool->nodes = b;
+        pool->len++;
+        b = NULL;
+    }
+    pthread_spin_unlock(&pool->lock);
+
+    h->free(b);
+}
 
-static inline uint32_t
-isqrt(uint64_t number)
+static int
+pool_refill(struct sht * h, struct node_pool * pool)
 {
-    uint64_t n, n1;
+    int missing;
+    struct node * b;
+
+    for (;;) {
+        pthread_spin_lock(&pool->lock);
+        missing = pool->target - pool->len;
+        pthread_spin_unlock(&pool->lock);
 
-    if (unlikely(number == UINT64_MAX))
-        return UINT32_MAX;
+        if (missing <= 0)
+            return 0;
 
-    n = 1;
-    n1 = ISQRRT_NEXT(n, number);
+        b = h->alloc(sizeof(*b) + pool->keylen);
+        if (b == NULL)
+            return -1;
 
-    while (abs((signed)n1 - (signed)n) > 1) {
-        n = n1;
-        n1 = ISQRRT_NEXT(n, number);
+        pool_put(h, pool, b);
     }
+}
+
+static void
+pool_destroy(struct sht * h, struct node_pool * pool)
+{
+    struct node * b;
 
-    while (n1 * n1 > number) {
-        n1--;
+    while ((b = pool->nodes) != NULL) {
+        pool->nodes = b->next;
+        h->free(b);
     }
 
-    return (uint32_t) n1;
+    pthread_spin_destroy(&pool->lock);
+    h->free(pool);
+}
+
+/* the nodes of a write buffer flush, allocated together and followed by
+ * their keys. The block is freed along with its last node */
+struct node_batch {
+    size_t refs;
+};
+
+struct batch_node {
+    struct node_batch * batch;
+    struct node node;
+};
+
+/* a batch node and its key, up to the next one */
+static inline size_t
+batch_node_size(size_t keylen)
+{
+    size_t size = sizeof(struct batch_node) + keylen;
+
+    return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static void
+batch_node_free(struct sht * h, struct node * b)
+{
+    size_t refs;
+    struct batch_node * bn;
+
+    bn = (struct batch_node *) ((char *) b - offsetof(struct batch_node, node));
+    if (h->flags & SHT_F_NOSYNC)
+        refs = --bn->batch->refs;
+    else
+        refs = __atomic_sub_fetch(&bn->batch->refs, 1, __ATOMIC_ACQ_REL);
+
+    if (refs == 0)
+        h->free(bn->batch);
 }
 
 static struct node *
@@ -85,26 +622,47 @@ node_create(struct sht * h, void * key, size_t keylen, void * data)
 {
     struct node * b;
     void * key_cpy;
+    enum node_origin origin;
 
     assert(h != NULL);
 
     if (unlikely(key == NULL || keylen == 0))
         return NULL;
 
-    b = h->alloc(sizeof(*b));
-    if (unlikely(b == NULL))
-        return NULL;
+    b = NULL;
+    key_cpy = NULL;
+    if (h->slabs != NULL && keylen <= SLAB_MAX_SLOT - sizeof(*b)) {
+        origin = NODE_SLAB;
+        b = slab_alloc(h->slabs, sizeof(*b) + keylen);
+        if (likely(b != NULL))
+            key_cpy = b + 1;
+    } else {
+        origin = NODE_MALLOC;
+        b = h->alloc(sizeof(*b));
+        if (likely(b != NULL)) {
+            key_cpy = h->alloc(keylen);
+            if (unlikely(key_cpy == NULL)) {
+                h->free(b);
+                b = NULL;
+            }
+        }
+    }
 
-    key_cpy = h->alloc(keylen);
-    if (unlikely(key_cpy == NULL)) {
-        h->free(b);
-        return NULL;
+    if (unlikely(b == NULL)) {
+        origin = NODE_POOL;
+        b = pool_get(__atomic_load_n(&h->pool, __ATOMIC_ACQUIRE), keylen);
+        if (b == NULL)
+            return NULL;
+
+        key_cpy = b + 1;
+        stat_incr(h, cpt_pool_used);
     }
 
     memcpy(key_cpy, key, keylen);
 
     *b = (struct node) {
         .hash = h->hash(key, keylen),
+        .origin = origin,
         .key = key_cpy,
         .keylen = keylen,
         .data = data,
@@ -114,12 +672,161 @@ node_create(struct sht * h, void * key, size_t keylen, void * data)
 }
 
 static void
-node_destroy(free_fn _free, struct node * b)
+node_destroy(struct sht * h, struct node * b)
 {
-    if (b != NULL) {
-        _free(b->key);
-        _free(b);
+    if (b == NULL)
+        return;
+
+    switch (b->origin) {
+    case NODE_SLAB:
+        slab_free(h->slabs, b);
+        break;
+    case NODE_POOL:
+        pool_put(h, h->pool, b);
+        break;
+    case NODE_BATCH:
+        batch_node_free(h, b);
+        break;
+    default:
+        h->free(b->key);
+        h->free(b);
+        break;
+    }
+}
+
+/* total order on the nodes of a line: full hash first, then the key */
+static inline
+int node_cmp(struct node const * node, uint32_t hash, void const * key,
+        size_t keylen)
+{
+    if (node->hash != hash)
+        return node->hash < hash ? -1 : 1;
+
+    if (node->keylen != keylen)
+        return node->keylen < keylen ? -1 : 1;
+
+    return memcmp(node->key, key, keylen);
+}
+
+static int
+node_ptr_cmp(void const * a, void const * b)
+{
+    struct node const * na = *(struct node * const *) a;
+    struct node const * nb = *(struct node * const *) b;
+
+    return node_cmp(na, nb->hash, nb->key, nb->keylen);
+}
+
+/* position of the first indexed node which is not lower than key */
+static inline
+size_t index_lower_bound(struct line const * line, uint32_t hash,
+        void const * key, size_t keylen)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = line->len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (node_cmp(line->index->nodes[mid], hash, key, keylen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static inline
+size_t treeify_depth(struct sht const * h)
+{
+    return MAX(2 * h->max_line_depth, TREEIFY_MIN_DEPTH);
+}
+
+/* a long line grows the table, unless it is treeified already or the table
+ * is not even loaded: its keys collide, and more lines would not split them */
+static inline
+int line_too_long(struct sht const * h, struct line const * line)
+{
+    uint64_t num_entries;
+
+    if (likely(line->len <= h->max_line_depth) || line->index != NULL)
+        return 0;
+
+    num_entries = stat_get(h, cpt_insert) - stat_get(h, cpt_remove);
+
+    return num_entries >= h->size;
+}
+
+/* expects line to be locked */
+static void
+line_treeify(struct sht * h, struct line * line)
+{
+    size_t i, cap;
+    struct node * node;
+    struct line_index * index;
+
+    cap = 2 * line->len;
+    index = h->alloc(sizeof(*index) + cap * sizeof(*index->nodes));
+    if (unlikely(index == NULL))
+        return; /* keep on chaining, retry on next insert */
+
+    index->cap = cap;
+    i = 0;
+    for (node = line->nodes ; node != NULL ; node = node->next)
+        index->nodes[i++] = node;
+
+    qsort(index->nodes, line->len, sizeof(*index->nodes), node_ptr_cmp);
+
+    line->index = index;
+    line->nodes = NULL;
+    stat_incr(h, cpt_treeify);
+}
+
+/* expects line to be locked */
+static void
+line_untreeify(free_fn _free, struct line * line)
+{
+    size_t i;
+    struct node * node;
+
+    for (i = 0 ; i < line->len ; i++) {
+        node = line->index->nodes[i];
+        node->next = line->nodes;
+        line->nodes = node;
+    }
+
+    _free(line->index);
+    line->index = NULL;
+}
+
+/* expects line to be locked and treeified */
+static int
+index_insert(struct sht * h, struct line * line, struct node * node)
+{
+    size_t pos, cap;
+    struct line_index * index;
+
+    index = line->index;
+    if (unlikely(line->len == index->cap)) {
+        cap = 2 * index->cap;
+        index = h->alloc(sizeof(*index) + cap * sizeof(*index->nodes));
+        if (unlikely(index == NULL))
+            return -1;
+
+        index->cap = cap;
+        memcpy(index->nodes, line->index->nodes,
+                line->len * sizeof(*index->nodes));
+        h->free(line->index);
+        line->index = index;
     }
+
+    pos = index_lower_bound(line, node->hash, node->key, node->keylen);
+    memmove(&index->nodes[pos + 1], &index->nodes[pos],
+            (line->len - pos) * sizeof(*index->nodes));
+    index->nodes[pos] = node;
+
+    return 0;
 }
 
 static void
@@ -130,17 +837,20 @@ line_init(struct line * line)
 }
 
 static void
-line_deinit(free_fn _free, struct line * line)
+line_deinit(struct sht * h, struct line * line)
 {
     struct node * b, * tmp;
 
     assert(line != NULL);
 
     pthread_spin_lock(&line->lock);
+    if (line->index != NULL)
+        line_untreeify(h->free, line);
+
     b = line->nodes;
     while (b != NULL) {
         tmp = b->next;
-        node_destroy(_free, b);
+        node_destroy(h, b);
         b = tmp;
     }
 
@@ -148,23 +858,49 @@ line_deinit(free_fn _free, struct line * line)
     pthread_spin_destroy(&line->lock);
 }
 
+/* expects line to be locked */
 static void
-line_insert(struct line * line, struct node * node)
+line_insert(struct sht * h, struct line * line, struct node * node)
 {
+    if (line->index != NULL) {
+        if (likely(index_insert(h, line, node) == 0)) {
+            line->len++;
+            return;
+        }
+
+        /* cannot grow the index: fallback to the chain */
+        line_untreeify(h->free, line);
+    }
+
     node->next = line->nodes;
     line->nodes = node;
 
     line->len++;
+
+    if (unlikely(line->len > treeify_depth(h)))
+        line_treeify(h, line);
 }
 
 /* expects line to be locked */
 static inline
-void * line_lookup(struct line * line, void * key, size_t keylen)
+void * line_lookup(struct line * line, uint32_t hash, void * key,
+        size_t keylen)
 {
+    size_t pos;
     struct node * node;
 
+    if (unlikely(line->index != NULL)) {
+        pos = index_lower_bound(line, hash, key, keylen);
+        if (pos < line->len
+           && node_cmp(line->index->nodes[pos], hash, key, keylen) == 0)
+            return line->index->nodes[pos]->data;
+
+        return NULL;
+    }
+
     for (node = line->nodes ; node != NULL ; node = node->next) {
-        if (node->keylen == keylen
+        if (node->hash == hash
+           && node->keylen == keylen
            && memcmp(node->key, key, keylen) == 0) {
             return node->data;
         }
@@ -173,263 +909,2115 @@ void * line_lookup(struct line * line, void * key, size_t keylen)
     return NULL;
 }
 
-void sht_destroy(struct sht * h)
+/* expects line to be locked
+ * unlink the node matching key and return it, NULL if not found */
+static struct node *
+line_remove(struct sht * h, struct line * line, uint32_t hash, void * key,
+        size_t keylen)
 {
-    int i;
+    size_t pos;
+    struct node * node, * prev;
+    struct line_index * index;
 
-    if (h != NULL) {
-        for (i = 0 ; i < h->size ; i++) {
-            line_deinit(h->free, &h->lines[i]);
+    if (unlikely(line->index != NULL)) {
+        index = line->index;
+        pos = index_lower_bound(line, hash, key, keylen);
+        if (pos >= line->len
+           || node_cmp(index->nodes[pos], hash, key, keylen) != 0)
+            return NULL;
+
+        node = index->nodes[pos];
+        memmove(&index->nodes[pos], &index->nodes[pos + 1],
+                (line->len - pos - 1) * sizeof(*index->nodes));
+        line->len--;
+
+        if (line->len <= UNTREEIFY_DEPTH)
+            line_untreeify(h->free, line);
+
+        return node;
+    }
+
+    prev = NULL;
+    for (node = line->nodes ; node != NULL ; node = node->next) {
+        if (node->hash == hash
+           && node->keylen == keylen
+           && memcmp(node->key, key, keylen) == 0) {
+            if (prev == NULL)
+                line->nodes = node->next;
+            else
+                prev->next = node->next;
+
+            line->len--;
+            return node;
         }
 
-        pthread_spin_destroy(&h->global_lock);
-        h->free(h->lines);
-        h->free(h);
+        prev = node;
     }
+
+    return NULL;
 }
 
-struct sht * sht_create_custom(int size, alloc_fn _alloc, free_fn _free,
-        hash_fn _hash)
+/* expects line to be locked
+ * unlink any node from the line, NULL if empty */
+static struct node *
+line_pop(free_fn _free, struct line * line)
 {
-    int i;
-    struct line * lines;
+    struct node * node;
+
+    if (line->len == 0)
+        return NULL;
+
+    if (unlikely(line->index != NULL)) {
+        node = line->index->nodes[--line->len];
+        if (line->len == 0) {
+            _free(line->index);
+            line->index = NULL;
+        }
+
+        return node;
+    }
+
+    node = line->nodes;
+    line->nodes = node->next;
+    line->len--;
+
+    return node;
+}
+
+/* expects line to be locked
+ * the pointer linking node in the line, NULL if it is not there */
+static struct node **
+line_link(struct line * line, struct node const * node)
+{
+    size_t i;
+    struct node ** link;
+
+    if (unlikely(line->index != NULL)) {
+        for (i = 0 ; i < line->len ; i++) {
+            if (line->index->nodes[i] == node)
+                return &line->index->nodes[i];
+        }
+
+        return NULL;
+    }
+
+    for (link = &line->nodes ; *link != NULL ; link = &(*link)->next) {
+        if (*link == node)
+            return link;
+    }
+
+    return NULL;
+}
+
+/* move node to another slot, if it is linked in a line of h or of the
+ * table it migrates from. Nodes which are not linked yet, or not anymore,
+ * are left alone. Return 1 if the node was moved */
+static int
+slab_relocate(struct sht * h, struct node * node)
+{
+    uint32_t hash;
+    struct sht * t;
+    struct line * line;
+    struct node ** link, * copy;
+
+    /* node may be freed meanwhile: only trust it once found in its line */
+    hash = __atomic_load_n(&node->hash, __ATOMIC_RELAXED);
+    for (t = h ; t != NULL ; t = t->old) {
+        line = &t->lines[hash % t->size];
+        pthread_spin_lock(&line->lock);
+        link = line_link(line, node);
+        if (link == NULL) {
+            pthread_spin_unlock(&line->lock);
+            continue;
+        }
+
+        copy = slab_alloc(h->slabs, sizeof(*node) + node->keylen);
+        if (likely(copy != NULL)) {
+            memcpy(copy, node, sizeof(*node) + node->keylen);
+            copy->key = copy + 1;
+            *link = copy;
+        }
+
+        pthread_spin_unlock(&line->lock);
+
+        if (unlikely(copy == NULL))
+            return 0;
+
+        slab_free(h->slabs, node);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* expects the class to be locked.
+ * The emptiest sparse slab, provided the other slabs can take its nodes */
+static struct slab *
+slab_pick_sparse(struct slab_class * c)
+{
+    uint64_t room;
+    struct slab * slab, * best;
+
+    best = NULL;
+    for (slab = c->slabs ; slab != NULL ; slab = slab->next) {
+        if (slab->state != SLAB_ACTIVE || slab->used == 0
+                || slab->used * SLAB_SPARSE_RATIO
+                    > slab->num_slots - slab->first)
+            continue;
+
+        room = (c->capacity - c->used)
+            - (slab->num_slots - slab->first - slab->used);
+        if (room >= slab->used && (best == NULL || slab->used < best->used))
+            best = slab;
+    }
+
+    return best;
+}
+
+/* incremental compaction: move at most max_moves nodes out of the sparse
+ * slabs, and return how many were moved. The slabs are released by the
+ * last slab_free() of their nodes. Expects the lines to be stable: the
+ * caller holds a reference on synchronized tables */
+static int
+slabs_compact(struct sht * h, int max_moves)
+{
+    int cls, n, moved, found;
+    uint32_t i;
+    struct node * node;
+    struct slab * slab;
+    struct slab_class * c;
+    struct slabs * s = h->slabs;
+
+    if (__atomic_exchange_n(&s->compacting, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    n = moved = found = 0;
+    for (cls = 0 ; cls < SLAB_NUM_CLASSES && n < max_moves ; cls++) {
+        c = &s->classes[cls];
+        while (n < max_moves) {
+            pthread_spin_lock(&c->lock);
+            slab = c->evacuating;
+            if (slab == NULL) {
+                slab = slab_pick_sparse(c);
+                if (slab == NULL) {
+                    pthread_spin_unlock(&c->lock);
+                    break;
+                }
+
+                slab->state = SLAB_EVACUATING;
+                if (c->current == slab)
+                    c->current = NULL;
+
+                c->evacuating = slab;
+                c->cursor = slab->first;
+            }
+
+            found = 1;
+            for (i = c->cursor ; i < slab->num_slots ; i++) {
+                if (slab->used_map[i / 64] & ((uint64_t) 1 << (i % 64)))
+                    break;
+            }
+
+            if (i == slab->num_slots) {
+                /* whatever is left is being linked or unlinked */
+                slab->state = SLAB_ACTIVE;
+                c->evacuating = NULL;
+                pthread_spin_unlock(&c->lock);
+                break;
+            }
+
+            c->cursor = i + 1;
+            node = slab_slot(slab, i);
+            pthread_spin_unlock(&c->lock);
+
+            moved += slab_relocate(h, node);
+            n++;
+        }
+    }
+
+    if (!found)
+        __atomic_store_n(&s->sparse, 0, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&s->cpt_moved, moved, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->compacting, 0, __ATOMIC_RELEASE);
+
+    return moved;
+}
+
+/* free the deferred pointers no registered reader can still see */
+static int
+swmr_reclaim(struct sht * h)
+{
+    size_t i, j;
+    uint64_t epoch, min;
+    struct swmr * swmr = h->swmr;
+
+    /* order the unlinks before reading the readers state,
+     * pairs with the CAS in sht_reader_register() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    min = UINT64_MAX;
+    for (i = 0 ; i < SWMR_MAX_READERS ; i++) {
+        epoch = __atomic_load_n(&swmr->readers[i].epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < min)
+            min = epoch;
+    }
+
+    for (i = 0, j = 0 ; i < swmr->deferred_len ; i++) {
+        if (swmr->deferred[i].epoch < min)
+            h->free(swmr->deferred[i].ptr);
+        else
+            swmr->deferred[j++] = swmr->deferred[i];
+    }
+
+    swmr->deferred_len = j;
+
+    return i - j;
+}
+
+/* wait for every registered reader to go through a quiescent state */
+static void
+swmr_synchronize(struct sht * h)
+{
+    int i;
+    uint64_t target, epoch;
+    struct swmr * swmr = h->swmr;
+
+    target = swmr->epoch + 1;
+    __atomic_store_n(&swmr->epoch, target, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (i = 0 ; i < SWMR_MAX_READERS ; i++) {
+        do {
+            epoch = __atomic_load_n(&swmr->readers[i].epoch,
+                    __ATOMIC_ACQUIRE);
+        } while (epoch != 0 && epoch < target);
+    }
+}
+
+/* free ptr once no reader can hold a reference to it */
+static void
+swmr_defer(struct sht * h, void * ptr)
+{
+    size_t cap;
+    struct swmr_deferred * deferred;
+    struct swmr * swmr = h->swmr;
+
+    if (unlikely(swmr->deferred_len == swmr->deferred_cap)) {
+        cap = MAX(2 * swmr->deferred_cap, SWMR_RECLAIM_BATCH);
+        deferred = h->alloc(cap * sizeof(*deferred));
+        if (unlikely(deferred == NULL)) {
+            /* no room to defer: wait for the readers instead */
+            swmr_synchronize(h);
+            swmr_reclaim(h);
+            h->free(ptr);
+            return;
+        }
+
+        if (swmr->deferred != NULL) {
+            memcpy(deferred, swmr->deferred,
+                    swmr->deferred_len * sizeof(*deferred));
+            h->free(swmr->deferred);
+        }
+
+        swmr->deferred = deferred;
+        swmr->deferred_cap = cap;
+    }
+
+    swmr->deferred[swmr->deferred_len++] = (struct swmr_deferred) {
+        .ptr = ptr,
+        .epoch = swmr->epoch,
+    };
+    __atomic_store_n(&swmr->epoch, swmr->epoch + 1, __ATOMIC_RELEASE);
+}
+
+static void
+swmr_destroy(struct sht * h)
+{
+    size_t i;
+    struct swmr * swmr = h->swmr;
+
+    for (i = 0 ; i < swmr->deferred_len ; i++)
+        h->free(swmr->deferred[i].ptr);
+
+    h->free(swmr->deferred);
+    h->free(swmr);
+}
+
+/*
+ * operation traces
+ */
+
+static uint64_t trace_gen;
+
+/* buffer of the last trace this thread recorded an operation in */
+static __thread struct {
+    uint64_t gen;
+    struct trace_buf * buf;
+} trace_cache;
+
+static inline
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+write_all(int fd, void const * data, size_t len)
+{
+    ssize_t n;
+    char const * p = data;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* called with the buffer locked */
+static void
+trace_flush(struct trace * t, struct trace_buf * buf)
+{
+    struct sht_trace_block block;
+
+    if (buf->len == 0)
+        return;
+
+    block.thread = buf->id;
+    block.num_records = buf->len;
+
+    pthread_mutex_lock(&t->lock);
+    if (write_all(t->fd, &block, sizeof(block)) != 0
+            || write_all(t->fd, buf->records,
+                buf->len * sizeof(buf->records[0])) != 0)
+        t->error = 1;
+
+    pthread_mutex_unlock(&t->lock);
+    buf->len = 0;
+}
+
+static struct trace_buf *
+trace_buf_get(struct sht * h, struct trace * t)
+{
+    struct trace_buf * buf;
+    pthread_t self = pthread_self();
+
+    if (likely(trace_cache.gen == t->gen))
+        return trace_cache.buf;
+
+    /* the thread may have traced this table before another one */
+    pthread_mutex_lock(&t->lock);
+    for (buf = t->bufs ; buf != NULL ; buf = buf->next) {
+        if (pthread_equal(buf->thread, self))
+            break;
+    }
+
+    if (buf == NULL) {
+        buf = h->alloc(sizeof(*buf));
+        if (buf != NULL) {
+            buf->thread = self;
+            buf->id = t->num_bufs++;
+            buf->count = 0;
+            buf->len = 0;
+            pthread_spin_init(&buf->lock, PTHREAD_PROCESS_PRIVATE);
+
+            /* sht_trace_stop() walks the list without the trace lock */
+            buf->next = t->bufs;
+            __atomic_store_n(&t->bufs, buf, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (buf != NULL) {
+        trace_cache.gen = t->gen;
+        trace_cache.buf = buf;
+    }
+
+    return buf;
+}
+
+static void
+trace_record(struct sht * h, struct trace * t, enum sht_trace_op op,
+        void * key, size_t keylen)
+{
+    struct trace_buf * buf;
+    struct sht_trace_record * r;
+
+    buf = trace_buf_get(h, t);
+    if (unlikely(buf == NULL))
+        return;
+
+    if ((buf->count++ & t->sample_mask) != 0)
+        return;
+
+    pthread_spin_lock(&buf->lock);
+    if (likely(__atomic_load_n(&t->active, __ATOMIC_ACQUIRE))) {
+        r = &buf->records[buf->len++];
+        r->ns = now_ns() - t->start_ns;
+        r->hash = h->hash(key, keylen);
+        r->keylen_op = MIN(keylen, SHT_TRACE_MAX_KEYLEN) << 8 | op;
+
+        if (buf->len == TRACE_BUF_RECORDS)
+            trace_flush(t, buf);
+    }
+
+    pthread_spin_unlock(&buf->lock);
+}
+
+static ALWAYS_INLINE
+void trace_op(struct sht * h, enum sht_trace_op op, void * key,
+        size_t keylen)
+{
+    struct trace * t;
+
+    /* a table confined to a thread is traced from that thread */
+    if (h->flags & SHT_F_NOSYNC) {
+        t = h->trace;
+        if (unlikely(t != NULL && t->active))
+            trace_record(h, t, op, key, keylen);
+
+        return;
+    }
+
+    t = __atomic_load_n(&h->trace, __ATOMIC_ACQUIRE);
+    if (unlikely(t != NULL && __atomic_load_n(&t->active, __ATOMIC_RELAXED)))
+        trace_record(h, t, op, key, keylen);
+}
+
+int sht_trace_start(struct sht * h, int fd, int sample_rate)
+{
+    struct trace * t;
+    struct sht_trace_header hdr;
+
+    if (fd < 0 || sample_rate <= 0 || (sample_rate & (sample_rate - 1)))
+        return -1;
+
+    t = h->trace;
+    if (t == NULL) {
+        t = h->alloc(sizeof(*t));
+        if (t == NULL)
+            return -1;
+
+        memset(t, 0, sizeof(*t));
+        t->gen = atomic_incr(trace_gen) + 1;
+        pthread_mutex_init(&t->lock, NULL);
+    } else if (t->active) {
+        return -1;
+    }
+
+    hdr = (struct sht_trace_header) {
+        .magic = SHT_TRACE_MAGIC,
+        .version = SHT_TRACE_VERSION,
+        .sample_rate = sample_rate,
+        .record_size = sizeof(struct sht_trace_record),
+    };
+    if (write_all(fd, &hdr, sizeof(hdr)) != 0) {
+        if (h->trace == NULL) {
+            pthread_mutex_destroy(&t->lock);
+            h->free(t);
+        }
+
+        return -1;
+    }
+
+    t->fd = fd;
+    t->error = 0;
+    t->sample_mask = sample_rate - 1;
+    t->start_ns = now_ns();
+    __atomic_store_n(&t->active, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->trace, t, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int sht_trace_stop(struct sht * h)
+{
+    struct trace_buf * buf;
+    struct trace * t = h->trace;
+
+    if (t == NULL || !t->active)
+        return -1;
+
+    __atomic_store_n(&t->active, 0, __ATOMIC_RELEASE);
+
+    /* recorders check the trace is active with their buffer locked */
+    buf = __atomic_load_n(&t->bufs, __ATOMIC_ACQUIRE);
+    for ( ; buf != NULL ; buf = buf->next) {
+        pthread_spin_lock(&buf->lock);
+        trace_flush(t, buf);
+        pthread_spin_unlock(&buf->lock);
+    }
+
+    return t->error ? -1 : 0;
+}
+
+static void
+trace_destroy(struct sht * h)
+{
+    struct trace_buf * buf, * next;
+    struct trace * t = h->trace;
+
+    if (t->active)
+        sht_trace_stop(h);
+
+    for (buf = t->bufs ; buf != NULL ; buf = next) {
+        next = buf->next;
+        pthread_spin_destroy(&buf->lock);
+        h->free(buf);
+    }
+
+    pthread_mutex_destroy(&t->lock);
+    h->free(t);
+}
+
+void sht_destroy(struct sht * h)
+{
+    int i;
+    size_t l;
+
+    if (h != NULL) {
+        if (h->slabs != NULL && h->slabs->owner == h)
+            h->slabs->destroying = 1;
+
+        /* nodes not migrated yet */
+        sht_destroy(h->old);
+
+        if (h->trace != NULL)
+            trace_destroy(h);
+
+        if (h->swmr != NULL)
+            swmr_destroy(h);
+
+        for (i = 0 ; i < h->small_len ; i++)
+            node_destroy(h, h->small[i]);
+
+        for (l = 0 ; h->lines != NULL && l < h->size ; l++) {
+            line_deinit(h, &h->lines[l]);
+        }
+
+        /* old tables share the slabs of the table they migrate to */
+        if (h->slabs != NULL && h->slabs->owner == h)
+            slabs_destroy(h->free, h->slabs);
+
+        if (h->pool != NULL && h->pool->owner == h)
+            pool_destroy(h, h->pool);
+
+        pthread_spin_destroy(&h->global_lock);
+        h->free(h->lines);
+        h->free(h);
+    }
+}
+
+static struct line *
+lines_create(alloc_fn _alloc, size_t size)
+{
+    size_t i;
+    struct line * lines;
+
+    if (size > SIZE_MAX / sizeof(*lines))
+        return NULL;
+
+    lines = _alloc(size * sizeof(*lines));
+    if (lines == NULL)
+        return NULL;
+
+    for (i = 0 ; i < size ; i++) {
+        line_init(&lines[i]);
+    }
+
+    return lines;
+}
+
+/* lines for a table growing to *new_size lines. When they cannot be
+ * allocated, halve the growth until it would be less than
+ * 1 / MIN_GROWTH_DIV of the table: growing by less is better than
+ * letting the lines get longer. Update *new_size to the lines allocated */
+static struct line *
+lines_create_grow(struct sht * h, size_t * new_size)
+{
+    size_t size = *new_size;
+    struct line * lines;
+
+    for (;;) {
+        lines = lines_create(h->alloc, size);
+        if (likely(lines != NULL) || size <= h->size
+                || size - h->size <= h->size / MIN_GROWTH_DIV)
+            break;
+
+        size = h->size + (size - h->size) / 2;
+    }
+
+    if (lines != NULL && size != *new_size) {
+        stat_incr(h, cpt_slow_growth);
+        *new_size = size;
+    }
+
+    return lines;
+}
+
+struct sht * sht_create_ext(int64_t size, int flags, alloc_fn _alloc,
+        free_fn _free, hash_fn _hash)
+{
+    struct line * lines;
+    struct swmr * swmr;
+    struct sht * h;
+
+    /* small tables readers need the global lock,
+     * and SHT_F_NOSYNC tables are not shared at all.
+     * Lock-free readers would not see the nodes move out of their slab */
+    if ((flags & SHT_F_SWMR)
+            && (flags & (SHT_F_SMALL | SHT_F_NOSYNC | SHT_F_SLAB)))
+        return NULL;
+
+    if (_alloc == NULL)
+        _alloc = malloc;
+
+    if (_free == NULL)
+        _free = free;
+
+    if (_hash == NULL)
+        _hash = oat_hash;
+
+    if (size <= 0)
+        size = DEFAULT_NUM_LINES;
+
+    if ((uint64_t) size > MAX_NUM_LINES)
+        size = MAX_NUM_LINES;
+
+    if ((uint64_t) size > SIZE_MAX / sizeof(*lines))
+        return NULL;
+
+    h = _alloc(sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    /* small tables allocate their lines once they outgrow SMALL_NUM_NODES */
+    lines = NULL;
+    if (!(flags & SHT_F_SMALL)) {
+        lines = lines_create(_alloc, size);
+        if (lines == NULL) {
+            _free(h);
+            return NULL;
+        }
+    }
+
+    swmr = NULL;
+    if (flags & SHT_F_SWMR) {
+        swmr = _alloc(sizeof(*swmr));
+        if (swmr == NULL) {
+            _free(lines);
+            _free(h);
+            return NULL;
+        }
+
+        memset(swmr, 0, sizeof(*swmr));
+        swmr->epoch = 1;
+    }
+
+    *h = (struct sht) {
+        .flags = flags,
+        .gc_probes = GC_MIN_PROBES,
+        .gc_min_probes = GC_MIN_PROBES,
+        .gc_max_probes = GC_MAX_PROBES,
+        .do_double_size = 1,
+        .max_line_depth = isqrt(size),
+        .hash = _hash,
+        .lines = lines,
+        .size = size,
+        .alloc = _alloc,
+        .free = _free,
+        .swmr = swmr,
+    };
+    pthread_spin_init(&h->global_lock, PTHREAD_PROCESS_PRIVATE);
+
+    if (flags & SHT_F_SLAB) {
+        h->slabs = slabs_create(h);
+        if (h->slabs == NULL) {
+            sht_destroy(h);
+            return NULL;
+        }
+    }
+
+    return h;
+}
+
+struct sht * sht_create_custom(int64_t size, alloc_fn _alloc, free_fn _free,
+        hash_fn _hash)
+{
+    return sht_create_ext(size, 0, _alloc, _free, _hash);
+}
+
+static ALWAYS_INLINE
+void sht_ref(struct sht * h)
+{
+    pthread_spin_lock(&h->global_lock);
+    atomic_incr(h->ref);
+    pthread_spin_unlock(&h->global_lock);
+}
+
+/* same as sht_ref(), unless the table is still small.
+ * return 1 and keep global_lock held in that case */
+static ALWAYS_INLINE
+int sht_ref_or_small(struct sht * h)
+{
+    pthread_spin_lock(&h->global_lock);
+    if (unlikely(h->lines == NULL))
+        return 1;
+
+    atomic_incr(h->ref);
+    pthread_spin_unlock(&h->global_lock);
+
+    return 0;
+}
+
+/* expects global_lock to be held */
+static int
+small_find(struct sht const * h, uint32_t hash, void * key, size_t keylen)
+{
+    int i;
+    struct node * node;
+
+    for (i = 0 ; i < h->small_len ; i++) {
+        node = h->small[i];
+        if (node->hash == hash
+           && node->keylen == keylen
+           && memcmp(node->key, key, keylen) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* expects global_lock to be held
+ * move the small array nodes into newly allocated lines */
+static int
+small_promote(struct sht * h)
+{
+    int i;
+    struct line * lines;
+    struct node * node;
+
+    lines = lines_create(h->alloc, h->size);
+    if (unlikely(lines == NULL)) {
+        /* sized by sht_reserve(): start smaller, the table grows later */
+        if (h->size <= DEFAULT_NUM_LINES)
+            return -1;
+
+        lines = lines_create(h->alloc, DEFAULT_NUM_LINES);
+        if (unlikely(lines == NULL))
+            return -1;
+
+        h->size = DEFAULT_NUM_LINES;
+        h->max_line_depth = isqrt(h->size);
+    }
+
+    /* lines are not visible yet, no need to lock them */
+    for (i = 0 ; i < h->small_len ; i++) {
+        node = h->small[i];
+        line_insert(h, &lines[node->hash % h->size], node);
+    }
+
+    /* every operation checks lines under global_lock */
+    h->small_len = 0;
+    h->lines = lines;
+
+    return 0;
+}
+
+/* expects global_lock to be held */
+static int
+small_insert(struct sht * h, struct node * node)
+{
+    int collision;
+
+    collision = (h->small_len > 0);
+    if (h->small_len < SMALL_NUM_NODES) {
+        h->small[h->small_len++] = node;
+    } else {
+        if (unlikely(small_promote(h) != 0))
+            return -1;
+
+        line_insert(h, &h->lines[node->hash % h->size], node);
+    }
+
+    stat_incr(h, cpt_insert);
+    if (collision)
+        stat_incr(h, cpt_collisions);
+
+    return 0;
+}
+
+/* expects global_lock to be held */
+static void *
+small_lookup_insert(struct sht * h, void * key, size_t keylen, void * value)
+{
+    int i;
+    uint32_t hash;
+    struct node * node;
+
+    hash = h->hash(key, keylen);
+    i = small_find(h, hash, key, keylen);
+    if (i >= 0)
+        return h->small[i]->data;
+
+    node = node_create(h, key, keylen, value);
+    if (unlikely(node == NULL))
+        return NULL;
+
+    if (unlikely(small_insert(h, node) != 0)) {
+        node_destroy(h, node);
+        return NULL;
+    }
+
+    return value;
+}
+
+/* expects global_lock to be held */
+static struct node *
+small_remove(struct sht * h, uint32_t hash, void * key, size_t keylen)
+{
+    int i;
+    struct node * node;
+
+    i = small_find(h, hash, key, keylen);
+    if (i < 0)
+        return NULL;
+
+    node = h->small[i];
+    h->small[i] = h->small[--h->small_len];
+
+    return node;
+}
+
+/*
+ * Single writer, multiple readers (SHT_F_SWMR)
+ *
+ * The writer never locks: it links nodes with release stores, and retires
+ * what it unlinks with swmr_defer(). Readers never lock nor write the table,
+ * they only announce their quiescent states in their own swmr_reader.
+ * Double-size rehashes copies of the nodes, so that readers still walking
+ * the old lines see them unchanged.
+ */
+
+static inline
+void swmr_line_insert(struct line * line, struct node * node)
+{
+    node->next = line->nodes;
+    __atomic_store_n(&line->nodes, node, __ATOMIC_RELEASE);
+    line->len++;
+}
+
+/* writer side, unlink the node matching key and return it */
+static struct node *
+swmr_line_remove(struct line * line, uint32_t hash, void * key,
+        size_t keylen)
+{
+    struct node * node, ** link;
+
+    for (link = &line->nodes ; *link != NULL ; link = &(*link)->next) {
+        node = *link;
+        if (node->hash == hash
+           && node->keylen == keylen
+           && memcmp(node->key, key, keylen) == 0) {
+            __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+            line->len--;
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/* reader side */
+static inline
+void * swmr_line_lookup(struct line * line, uint32_t hash, void * key,
+        size_t keylen)
+{
+    struct node * node;
+
+    node = __atomic_load_n(&line->nodes, __ATOMIC_ACQUIRE);
+    while (node != NULL) {
+        if (node->hash == hash
+           && node->keylen == keylen
+           && memcmp(node->key, key, keylen) == 0) {
+            return node->data;
+        }
+
+        node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+/* reader side, consistent view of the lines array and its size */
+static ALWAYS_INLINE
+struct line * swmr_lines(struct sht const * h, size_t * size)
+{
+    unsigned seq;
+    struct line * lines;
+
+    do {
+        seq = __atomic_load_n(&h->swmr->seq, __ATOMIC_ACQUIRE);
+        lines = __atomic_load_n(&h->lines, __ATOMIC_RELAXED);
+        *size = __atomic_load_n(&h->size, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1)
+            || seq != __atomic_load_n(&h->swmr->seq, __ATOMIC_RELAXED));
+
+    return lines;
+}
+
+static int
+swmr_resize(struct sht * h, size_t new_size)
+{
+    size_t i, old_size;
+    struct line * new_lines, * old_lines;
+    struct node * node, * copy;
+    struct swmr * swmr = h->swmr;
+
+    new_lines = lines_create_grow(h, &new_size);
+    if (unlikely(new_lines == NULL))
+        goto err;
+
+    for (i = 0 ; i < h->size ; i++) {
+        for (node = h->lines[i].nodes ; node != NULL ; node = node->next) {
+            copy = h->alloc(sizeof(*copy));
+            if (unlikely(copy == NULL))
+                goto err_copy;
+
+            *copy = *node;
+            swmr_line_insert(&new_lines[copy->hash % new_size], copy);
+        }
+    }
+
+    old_lines = h->lines;
+    old_size = h->size;
+
+    __atomic_store_n(&swmr->seq, swmr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&h->lines, new_lines, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->size, new_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&swmr->seq, swmr->seq + 1, __ATOMIC_RELEASE);
+    h->max_line_depth = isqrt(new_size);
+    h->cpt_double_size++;
+
+    /* copies own the keys now, only retire the old nodes themselves */
+    for (i = 0 ; i < old_size ; i++) {
+        for (node = old_lines[i].nodes ; node != NULL ; node = node->next)
+            swmr_defer(h, node);
+    }
+
+    swmr_defer(h, old_lines);
+
+    return 0;
+
+err_copy:
+    for (i = 0 ; i < new_size ; i++) {
+        while (new_lines[i].nodes != NULL) {
+            node = new_lines[i].nodes;
+            new_lines[i].nodes = node->next;
+            h->free(node);
+        }
+    }
+
+    h->free(new_lines);
+err:
+    h->cpt_double_size_fail++;
+    return -1;
+}
+
+static int
+swmr_double_size(struct sht * h)
+{
+    if (unlikely(h->size > MAX_NUM_LINES / 2)) {
+        h->cpt_double_size_fail++;
+        return -1;
+    }
+
+    return swmr_resize(h, h->size * 2);
+}
+
+static void
+swmr_insert(struct sht * h, struct node * node)
+{
+    struct line * line;
+
+    line = &h->lines[node->hash % h->size];
+    if (unlikely(line_too_long(h, line))) {
+        if (likely(swmr_double_size(h) == 0))
+            line = &h->lines[node->hash % h->size];
+    }
+
+    h->cpt_insert++;
+    if (line->len > 0)
+        h->cpt_collisions++;
+
+    swmr_line_insert(line, node);
+}
+
+static void *
+swmr_lookup_insert(struct sht * h, void * key, size_t keylen, void * value)
+{
+    void * ptr;
+    uint32_t hash;
+    struct node * node;
+
+    h->cpt_lookup++;
+    hash = h->hash(key, keylen);
+
+    /* the writer is the only one to modify the lines */
+    ptr = line_lookup(&h->lines[hash % h->size], hash, key, keylen);
+    if (ptr != NULL)
+        return ptr;
+
+    node = node_create(h, key, keylen, value);
+    if (unlikely(node == NULL))
+        return NULL;
+
+    swmr_insert(h, node);
+
+    return value;
+}
+
+static int
+swmr_remove(struct sht * h, void * key, size_t keylen)
+{
+    uint32_t hash;
+    struct node * node;
+
+    hash = h->hash(key, keylen);
+    node = swmr_line_remove(&h->lines[hash % h->size], hash, key, keylen);
+    if (node == NULL)
+        return -1;
+
+    h->cpt_remove++;
+    swmr_defer(h, node->key);
+    swmr_defer(h, node);
+
+    if (h->swmr->deferred_len >= SWMR_RECLAIM_BATCH)
+        swmr_reclaim(h);
+
+    return 0;
+}
+
+int sht_reader_register(struct sht * h)
+{
+    int i;
+    uint64_t unused;
+    struct swmr * swmr = h->swmr;
+
+    if (swmr == NULL)
+        return -1;
+
+    for (i = 0 ; i < SWMR_MAX_READERS ; i++) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&swmr->readers[i].epoch, &unused,
+                    __atomic_load_n(&swmr->epoch, __ATOMIC_ACQUIRE), 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return i;
+    }
+
+    return -1;
+}
+
+void sht_reader_quiescent(struct sht * h, int reader)
+{
+    struct swmr * swmr = h->swmr;
+
+    __atomic_store_n(&swmr->readers[reader].epoch,
+            __atomic_load_n(&swmr->epoch, __ATOMIC_ACQUIRE),
+            __ATOMIC_RELEASE);
+}
+
+void sht_reader_unregister(struct sht * h, int reader)
+{
+    __atomic_store_n(&h->swmr->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unsynchronized tables (SHT_F_NOSYNC)
+ *
+ * Thread-confined tables: no lock, no reference, no atomic stats.
+ * Double-size moves all the nodes at once, there is never an old table.
+ */
+
+static int
+nosync_resize(struct sht * h, size_t new_size)
+{
+    size_t i, old_size;
+    struct line * new_lines, * old_lines;
+    struct node * node;
+
+    new_lines = lines_create_grow(h, &new_size);
+    if (unlikely(new_lines == NULL)) {
+        h->cpt_double_size_fail++;
+        return -1;
+    }
+
+    old_lines = h->lines;
+    old_size = h->size;
+    h->lines = new_lines;
+    h->size = new_size;
+    h->max_line_depth = isqrt(h->size);
+    h->cpt_double_size++;
+
+    for (i = 0 ; i < old_size ; i++) {
+        while ((node = line_pop(h->free, &old_lines[i])) != NULL)
+            line_insert(h, &h->lines[node->hash % h->size], node);
+
+        pthread_spin_destroy(&old_lines[i].lock);
+    }
+
+    h->free(old_lines);
+
+    return 0;
+}
+
+static int
+nosync_double_size(struct sht * h)
+{
+    if (unlikely(h->size > MAX_NUM_LINES / 2)) {
+        h->cpt_double_size_fail++;
+        return -1;
+    }
+
+    return nosync_resize(h, h->size * 2);
+}
+
+static int
+nosync_insert(struct sht * h, struct node * node)
+{
+    struct line * line;
+
+    if (unlikely(h->lines == NULL))
+        return small_insert(h, node);
+
+    line = &h->lines[node->hash % h->size];
+    if (unlikely(line_too_long(h, line))) {
+        if (likely(nosync_double_size(h) == 0))
+            line = &h->lines[node->hash % h->size];
+    }
+
+    h->cpt_insert++;
+    if (line->len > 0)
+        h->cpt_collisions++;
+
+    line_insert(h, line, node);
+
+    return 0;
+}
+
+static void *
+nosync_lookup(struct sht * h, void * key, size_t keylen)
+{
+    int i;
+    uint32_t hash;
+
+    h->cpt_lookup++;
+    hash = h->hash(key, keylen);
+
+    if (unlikely(h->lines == NULL)) {
+        i = small_find(h, hash, key, keylen);
+        return i >= 0 ? h->small[i]->data : NULL;
+    }
+
+    return line_lookup(&h->lines[hash % h->size], hash, key, keylen);
+}
+
+static void *
+nosync_lookup_insert(struct sht * h, void * key, size_t keylen,
+        void * value)
+{
+    void * ptr;
+    struct node * node;
+
+    if (unlikely(h->lines == NULL)) {
+        h->cpt_lookup++;
+        return small_lookup_insert(h, key, keylen, value);
+    }
+
+    ptr = nosync_lookup(h, key, keylen);
+    if (ptr != NULL)
+        return ptr;
+
+    node = node_create(h, key, keylen, value);
+    if (unlikely(node == NULL))
+        return NULL;
+
+    nosync_insert(h, node);
+
+    return value;
+}
+
+static int
+nosync_remove(struct sht * h, void * key, size_t keylen)
+{
+    uint32_t hash;
+    struct node * node;
+
+    hash = h->hash(key, keylen);
+    if (unlikely(h->lines == NULL))
+        node = small_remove(h, hash, key, keylen);
+    else
+        node = line_remove(h, &h->lines[hash % h->size], hash, key, keylen);
+
+    if (node == NULL)
+        return -1;
+
+    h->cpt_remove++;
+    node_destroy(h, node);
+
+    return 0;
+}
+
+/* move to new_size lines, the nodes of the current ones
+ * are migrated incrementally by _sht_gc(). Return 1 if the previous
+ * migration is not over, -1 if the lines could not be allocated */
+static int
+sht_resize(struct sht * h, size_t new_size)
+{
+    int rv, exit;
+    struct sht * old;
+    struct line * new_lines;
+
+    /* make sure we don't try to resize
+     * twice at the same time */
+    exit = 1;
+    if (pthread_spin_trylock(&h->global_lock) == 0) {
+        if (h->do_double_size) {
+            exit = 0;
+            h->do_double_size = 0;
+        }
+
+        pthread_spin_unlock(&h->global_lock);
+    }
+
+    if (exit)
+        return 0;
+
+    /* the previous migration is not over yet */
+    if (unlikely(h->old != NULL)) {
+        rv = 1;
+        goto err;
+    }
+
+    /* prepare */
+    rv = -1;
+    old = h->alloc(sizeof(*old));
+    if (unlikely(old == NULL))
+        goto err;
+
+    new_lines = lines_create_grow(h, &new_size);
+    if (unlikely(new_lines == NULL)) {
+        h->free(old);
+        goto err;
+    }
+
+    /* put on old any new hashtable operation */
+    pthread_spin_lock(&h->global_lock);
+
+    /* wait for any (other) current hashtable transaction to finish */
+    while (h->ref > 1)
+        ;
+
+    *old = *h;
+    old->trace = NULL;
+    h->size = new_size;
+    h->max_line_depth = isqrt(new_size);
+    h->lines = new_lines;
+    h->cpt_double_size++;
+
+    pthread_spin_init(&old->global_lock, PTHREAD_PROCESS_PRIVATE);
+    h->old = old;
+    h->do_double_size = 1;
+
+    /* resume operations */
+    pthread_spin_unlock(&h->global_lock);
+
+    return 0;
+
+err:
+    /* let the next attempt in */
+    pthread_spin_lock(&h->global_lock);
+    h->do_double_size = 1;
+    pthread_spin_unlock(&h->global_lock);
+
+    return rv;
+}
+
+static int
+sht_double_size(struct sht * h)
+{
+    int rv;
+
+    if (unlikely(h->size > MAX_NUM_LINES / 2))
+        return -1;
+
+    rv = sht_resize(h, h->size * 2);
+
+    /* too many resizes too fast: the migration lags behind,
+     * give it a bigger share of each operation */
+    if (rv > 0 && h->gc_probes < h->gc_max_probes) {
+        __atomic_store_n(&h->gc_probes,
+                MIN(h->gc_probes * 2, h->gc_max_probes), __ATOMIC_RELAXED);
+        atomic_incr(h->cpt_gc_lag);
+    }
+
+    return rv;
+}
+
+/* expects line to be locked
+ * flat-combining: apply the inserts published by the threads waiting
+ * for the line, so that they do not have to get the lock one by one */
+static void
+line_combine(struct sht * h, struct line * line)
+{
+    int n, collisions;
+    struct node * node;
+    struct fc_request * req, * next;
+
+    if (likely(__atomic_load_n(&line->pending, __ATOMIC_RELAXED) == NULL))
+        return;
+
+    req = __atomic_exchange_n(&line->pending, NULL, __ATOMIC_ACQUIRE);
+    for (n = 0, collisions = 0 ; req != NULL ; req = next) {
+        /* req is gone as soon as it is done */
+        next = req->next;
+        node = req->node;
+
+        req->data = NULL;
+        if (req->unique)
+            req->data = line_lookup(line, node->hash, node->key,
+                    node->keylen);
+
+        req->inserted = (req->data == NULL);
+        if (req->inserted) {
+            req->data = node->data;
+            collisions += (line->len > 0);
+            line_insert(h, line, node);
+            n++;
+        }
+
+        __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_fetch_add(&h->cpt_insert, n, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&h->cpt_collisions, collisions, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&h->cpt_combined, n, __ATOMIC_SEQ_CST);
+}
+
+/* lock the line to insert req->node. When contended, publish the request
+ * for the lock holder instead, and only combine ourselves if we get the lock
+ * first. Return 0 with the line locked, or 1 once the request is done */
+static int
+line_lock_or_combine(struct sht * h, struct line * line,
+        struct fc_request * req)
+{
+    if (likely(pthread_spin_trylock(&line->lock) == 0))
+        return 0;
+
+    req->done = 0;
+    req->next = __atomic_load_n(&line->pending, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&line->pending, &req->next, req,
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+        if (pthread_spin_trylock(&line->lock) == 0) {
+            line_combine(h, line);
+            pthread_spin_unlock(&line->lock);
+        } else {
+            cpu_relax();
+        }
+    }
+
+    return 1;
+}
+
+static inline
+void sht_insert_node(struct sht * h, struct line * line, struct node * node)
+{
+    int collision;
+    struct fc_request req = {
+        .node = node,
+    };
+
+    if (unlikely(line_lock_or_combine(h, line, &req)))
+        return;
+
+    atomic_incr(h->cpt_insert);
+
+    collision = (line->len > 0);
+    line_insert(h, line, node);
+    line_combine(h, line);
+    pthread_spin_unlock(&line->lock);
+
+    if (collision)
+        atomic_incr(h->cpt_collisions);
+}
+
+/* migrate at most max_gc_num nodes from the old table, each of them and
+ * each line visited counting as a probe. Stop after max_ns if not 0 */
+static
+int _sht_gc(struct sht * h, int max_gc_num, uint64_t max_ns)
+{
+    int n, i;
+    uint64_t deadline;
+    struct line * old_line, * new_line;
+    struct node * node;
+    struct sht * old;
+
+    if (likely(h->old == NULL))
+        return 0;
+
+    if (pthread_spin_trylock(&h->old->global_lock) != 0)
+        return 0;
+
+    deadline = (max_ns != 0) ? now_ns() + max_ns : 0;
+
+    old_line = &h->old->lines[h->old->gc_index];
+    pthread_spin_lock(&old_line->lock);
+    for (i = 0 ; i < max_gc_num ; i++) {
+        /* reading the clock costs a few probes */
+        if (deadline != 0 && (i & 7) == 7 && now_ns() >= deadline) {
+            atomic_incr(h->cpt_gc_timeout);
+            break;
+        }
+
+        node = line_pop(h->free, old_line);
+        if (node == NULL) {
+            h->old->gc_index++;
+            if (h->old->gc_index >= h->old->size)
+                break;
+
+            pthread_spin_unlock(&old_line->lock);
+            old_line = &h->old->lines[h->old->gc_index];
+            pthread_spin_lock(&old_line->lock);
+            continue;
+        }
+
+        new_line = &h->lines[node->hash % h->size];
+        sht_insert_node(h, new_line, node);
+        /* XXX cpt_insert is incr within sht_insert_node(). Keep ? */
+        atomic_decr(h->cpt_insert);
+    }
+
+    n = i;
+
+    pthread_spin_unlock(&old_line->lock);
+
+    if (h->old->gc_index >= h->old->size) {
+        /* put on old any new hashtable operation */
+        pthread_spin_lock(&h->global_lock);
+
+        /* wait for any (other) current hashtable transaction to finish */
+        while (h->ref > 1)
+            ;
+
+        old = h->old;
+        h->old = NULL;
+
+        /* the next migration starts with the minimal budget */
+        h->gc_probes = h->gc_min_probes;
+
+        /* resume operations */
+        pthread_spin_unlock(&h->global_lock);
+
+        /* old is unreachable */
+        pthread_spin_unlock(&old->global_lock);
+        sht_destroy(old);
+    } else {
+        pthread_spin_unlock(&h->old->global_lock);
+    }
+
+    return n;
+}
+
+/* the share of maintenance of each operation: the migration first,
+ * then the compaction of the slabs */
+static ALWAYS_INLINE
+void sht_gc_step(struct sht * h)
+{
+    if (unlikely(h->old != NULL))
+        _sht_gc(h, __atomic_load_n(&h->gc_probes, __ATOMIC_RELAXED),
+                h->gc_max_ns);
+    else if (unlikely(h->slabs != NULL
+                && __atomic_load_n(&h->slabs->sparse, __ATOMIC_RELAXED)))
+        slabs_compact(h, __atomic_load_n(&h->gc_probes, __ATOMIC_RELAXED));
+}
+
+int sht_insert(struct sht * h, void * key, size_t keylen, void * value)
+{
+    int rv;
+    struct node * node;
+    struct line * line;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    trace_op(h, SHT_TRACE_INSERT, key, keylen);
+
+    node = node_create(h, key, keylen, value);
+    if (unlikely(node == NULL))
+        return -1;
+
+    if (h->flags & SHT_F_NOSYNC) {
+        rv = nosync_insert(h, node);
+        goto exit;
+    }
+
+    if (h->swmr != NULL) {
+        swmr_insert(h, node);
+        return 0;
+    }
+
+    if (unlikely(sht_ref_or_small(h))) {
+        rv = small_insert(h, node);
+        pthread_spin_unlock(&h->global_lock);
+        goto exit;
+    }
+
+    sht_gc_step(h);
+
+    line = &h->lines[node->hash % h->size];
+
+    if (unlikely(line_too_long(h, line))) {
+        if (likely(sht_double_size(h) == 0))
+            line = &h->lines[node->hash % h->size];
+    }
+
+    sht_insert_node(h, line, node);
+    atomic_decr(h->ref);
+
+    return 0;
+
+exit:
+    if (unlikely(rv != 0))
+        node_destroy(h, node);
+
+    return rv;
+}
+
+/*
+ * Write buffers
+ *
+ * Keys are copied when appended, and the flush allocates the nodes of the
+ * batch in a single block, outside of any lock. It then sorts them by line,
+ * and links each run of nodes under a single lock of their line.
+ */
+
+/* initial key bytes per entry */
+#define WBUF_KEY_SIZE 16
+
+struct wbuf_entry {
+    size_t line;
+    struct node * node;
+    size_t key; /* offset in keys */
+    size_t keylen;
+    void * data;
+};
+
+struct sht_wbuf {
     struct sht * h;
+    int len;
+    int cap;
+    char * keys;
+    size_t keys_len;
+    size_t keys_cap;
+    struct wbuf_entry entries[];
+};
 
-    if (_alloc == NULL)
-        _alloc = malloc;
+static int
+wbuf_entry_cmp(void const * a, void const * b)
+{
+    struct wbuf_entry const * ea = a;
+    struct wbuf_entry const * eb = b;
 
-    if (_free == NULL)
-        _free = free;
+    return (ea->line > eb->line) - (ea->line < eb->line);
+}
 
-    if (_hash == NULL)
-        _hash = oat_hash;
+struct sht_wbuf * sht_wbuf_create(struct sht * h, int capacity)
+{
+    struct sht_wbuf * b;
 
-    h = _alloc(sizeof(*h));
-    if (h == NULL)
+    if (capacity <= 0)
         return NULL;
 
-    if (size <= 0)
-        size = DEFAULT_NUM_LINES;
+    b = h->alloc(sizeof(*b) + capacity * sizeof(*b->entries));
+    if (b == NULL)
+        return NULL;
 
-    lines = _alloc(size * sizeof(*lines));
-    if (lines == NULL) {
-        _free(h);
+    b->h = h;
+    b->len = 0;
+    b->cap = capacity;
+    b->keys_len = 0;
+    b->keys_cap = (size_t) capacity * WBUF_KEY_SIZE;
+    b->keys = h->alloc(b->keys_cap);
+    if (b->keys == NULL) {
+        h->free(b);
         return NULL;
     }
 
-    for (i = 0 ; i < size ; i++) {
-        line_init(&lines[i]);
+    return b;
+}
+
+void sht_wbuf_destroy(struct sht_wbuf * b)
+{
+    if (b != NULL) {
+        sht_wbuf_flush(b);
+        b->h->free(b->keys);
+        b->h->free(b);
     }
+}
 
-    *h = (struct sht) {
-        .gc_num = 10,
-        .do_double_size = 1,
-        .max_line_depth = isqrt(size),
-        .hash = _hash,
-        .lines = lines,
-        .size = size,
-        .alloc = _alloc,
-        .free = _free,
-    };
-    pthread_spin_init(&h->global_lock, PTHREAD_PROCESS_PRIVATE);
+static int
+wbuf_keys_grow(struct sht_wbuf * b, size_t keylen)
+{
+    char * keys;
+    size_t cap;
 
-    return h;
+    if (keylen > SIZE_MAX / 2 - b->keys_len)
+        return -1;
+
+    cap = MAX(2 * b->keys_cap, b->keys_len + keylen);
+    keys = b->h->alloc(cap);
+    if (keys == NULL)
+        return -1;
+
+    memcpy(keys, b->keys, b->keys_len);
+    b->h->free(b->keys);
+    b->keys = keys;
+    b->keys_cap = cap;
+
+    return 0;
 }
 
-static ALWAYS_INLINE
-void sht_ref(struct sht * h)
+int sht_wbuf_insert(struct sht_wbuf * b, void * key, size_t keylen,
+        void * value)
 {
-    pthread_spin_lock(&h->global_lock);
-    atomic_incr(h->ref);
-    pthread_spin_unlock(&h->global_lock);
+    struct wbuf_entry * e;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    trace_op(b->h, SHT_TRACE_INSERT, key, keylen);
+    if (unlikely(keylen > b->keys_cap - b->keys_len)
+            && wbuf_keys_grow(b, keylen) != 0)
+        return -1;
+
+    e = &b->entries[b->len++];
+    e->key = b->keys_len;
+    e->keylen = keylen;
+    e->data = value;
+    memcpy(b->keys + b->keys_len, key, keylen);
+    b->keys_len += keylen;
+
+    if (b->len == b->cap)
+        return sht_wbuf_flush(b);
+
+    return 0;
 }
 
+/* create the nodes of the n entries of b, in a single block unless nodes
+ * come from slabs already, or are copied by the SHT_F_SWMR resizes.
+ * Drop the entries whose node could not be created, and return how many
+ * are left */
 static int
-sht_double_size(struct sht * h)
+wbuf_nodes_create(struct sht_wbuf * b, int n, int * err)
 {
-    int i, exit;
-    struct sht * old;
-    int new_size;
-    struct line * new_lines;
+    int i, j;
+    size_t size;
+    char * p;
+    struct batch_node * bn;
+    struct node_batch * batch;
+    struct sht * h = b->h;
+    struct wbuf_entry * e = b->entries;
+
+    batch = NULL;
+    if (h->slabs == NULL && h->swmr == NULL) {
+        size = sizeof(*batch);
+        for (i = 0 ; i < n ; i++)
+            size += batch_node_size(e[i].keylen);
+
+        batch = h->alloc(size);
+    }
 
-    /* make sure we don't try to double size
-     * twice at the same time */
-    exit = 1;
-    if (pthread_spin_trylock(&h->global_lock) == 0) {
-        if (h->do_double_size) {
-            exit = 0;
-            h->do_double_size = 0;
+    if (batch == NULL) {
+        for (i = j = 0 ; i < n ; i++) {
+            e[i].node = node_create(h, b->keys + e[i].key, e[i].keylen,
+                    e[i].data);
+            if (unlikely(e[i].node == NULL))
+                *err = -1;
+            else
+                e[j++] = e[i];
         }
 
-        pthread_spin_unlock(&h->global_lock);
+        return j;
     }
 
-    if (exit)
+    batch->refs = n;
+    p = (char *) (batch + 1);
+    for (i = 0 ; i < n ; i++) {
+        bn = (struct batch_node *) p;
+        bn->batch = batch;
+        memcpy(bn + 1, b->keys + e[i].key, e[i].keylen);
+        bn->node = (struct node) {
+            .hash = h->hash(bn + 1, e[i].keylen),
+            .origin = NODE_BATCH,
+            .key = bn + 1,
+            .keylen = e[i].keylen,
+            .data = e[i].data,
+        };
+
+        e[i].node = &bn->node;
+        p += batch_node_size(e[i].keylen);
+    }
+
+    return n;
+}
+
+/* tables not using line locks: one node at a time */
+static int
+wbuf_flush_slow(struct sht * h, struct wbuf_entry * entries, int n)
+{
+    int i, err;
+
+    err = 0;
+    for (i = 0 ; i < n ; i++) {
+        if (h->flags & SHT_F_NOSYNC) {
+            if (likely(nosync_insert(h, entries[i].node) == 0))
+                continue;
+        } else {
+            swmr_insert(h, entries[i].node);
+            continue;
+        }
+
+        node_destroy(h, entries[i].node);
+        err = -1;
+    }
+
+    return err;
+}
+
+int sht_wbuf_flush(struct sht_wbuf * b)
+{
+    int i, j, n, err, collisions;
+    struct line * line;
+    struct sht * h = b->h;
+    struct wbuf_entry * e = b->entries;
+
+    n = b->len;
+    b->len = 0;
+    if (n == 0)
         return 0;
 
-    /* too many doubel sizes too fast */
-    if (unlikely(h->old != NULL))
-        return -1;
+    err = 0;
+    n = wbuf_nodes_create(b, n, &err);
+    b->keys_len = 0;
+    if (n == 0)
+        return err;
 
-    /* prepare */
-    old = h->alloc(sizeof(*old));
-    if (unlikely(old == NULL))
-        return -1;
+    if (h->flags & SHT_F_NOSYNC || h->swmr != NULL) {
+        if (wbuf_flush_slow(h, e, n) != 0)
+            err = -1;
 
-    new_size = h->size * 2;
-    new_lines = h->alloc(new_size * sizeof(*new_lines));
-    if (unlikely(new_lines == NULL)) {
-        h->free(old);
-        return -1;
+        return err;
     }
 
-    for (i = 0 ; i < new_size ; i++)
-        line_init(&new_lines[i]);
+    if (unlikely(sht_ref_or_small(h))) {
+        /* until the small array gets promoted */
+        for (i = 0 ; i < n && h->lines == NULL ; i++) {
+            if (unlikely(small_insert(h, e[i].node) != 0)) {
+                node_destroy(h, e[i].node);
+                err = -1;
+            }
+        }
 
-    /* put on old any new hashtable operation */
-    pthread_spin_lock(&h->global_lock);
+        pthread_spin_unlock(&h->global_lock);
 
-    /* wait for any (other) current hashtable transaction to finish */
-    while (h->ref > 1)
-        ;
+        e += i;
+        n -= i;
+        if (n == 0 || sht_ref_or_small(h))
+            return err;
+    }
 
-    *old = *h;
-    h->size = new_size;
-    h->max_line_depth = isqrt(new_size);
-    h->lines = new_lines;
-    h->cpt_double_size++;
+    sht_gc_step(h);
 
-    pthread_spin_init(&old->global_lock, PTHREAD_PROCESS_PRIVATE);
-    h->old = old;
-    h->do_double_size = 1;
+    /* grow once for the whole batch */
+    for (i = 0 ; i < n ; i++) {
+        if (unlikely(line_too_long(h,
+                        &h->lines[e[i].node->hash % h->size]))) {
+            sht_double_size(h);
+            break;
+        }
+    }
 
-    /* resume operations */
-    pthread_spin_unlock(&h->global_lock);
+    for (i = 0 ; i < n ; i++)
+        e[i].line = e[i].node->hash % h->size;
 
-    return 0;
-}
+    qsort(e, n, sizeof(*e), wbuf_entry_cmp);
 
-static inline
-void sht_insert_node(struct sht * h, struct line * line, struct node * node)
-{
-    void * bak;
+    for (i = 0 ; i < n ; i = j) {
+        line = &h->lines[e[i].line];
+        collisions = 0;
 
-    atomic_incr(h->cpt_insert);
+        pthread_spin_lock(&line->lock);
+        for (j = i ; j < n && e[j].line == e[i].line ; j++) {
+            collisions += (line->len > 0);
+            line_insert(h, line, e[j].node);
+        }
 
-    pthread_spin_lock(&line->lock);
-    bak = line->nodes;
-    line_insert(line, node);
-    pthread_spin_unlock(&line->lock);
+        line_combine(h, line);
+        pthread_spin_unlock(&line->lock);
 
-    if (bak != NULL)
-        atomic_incr(h->cpt_collisions);
+        __atomic_fetch_add(&h->cpt_insert, j - i, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&h->cpt_collisions, collisions, __ATOMIC_SEQ_CST);
+    }
+
+    atomic_decr(h->ref);
+
+    return err;
 }
 
-int sht_insert(struct sht * h, void * key, size_t keylen, void * value)
+/* sht_gc(), without refilling the node pool */
+static int
+gc_collect(struct sht * h, int max_gc_num)
 {
-    struct node * node;
-    struct line * line;
+    int rv;
 
-    if (unlikely(key == NULL || keylen == 0))
-        return -1;
+    if (h->flags & SHT_F_NOSYNC) {
+        if (h->slabs == NULL || h->lines == NULL)
+            return 0;
 
-    node = node_create(h, key, keylen, value);
-    if (unlikely(node == NULL))
-        return -1;
+        return slabs_compact(h, max_gc_num);
+    }
 
-    sht_ref(h);
-    line = &h->lines[node->hash % h->size];
+    if (h->swmr != NULL)
+        return swmr_reclaim(h);
 
-    if (unlikely(line->len > h->max_line_depth)) {
-        if (likely(sht_double_size(h) == 0))
-            line = &h->lines[node->hash % h->size];
+    if (unlikely(sht_ref_or_small(h))) {
+        pthread_spin_unlock(&h->global_lock);
+        return 0;
     }
 
-    sht_insert_node(h, line, node);
+    rv = _sht_gc(h, max_gc_num, 0);
+    if (h->slabs != NULL && rv < max_gc_num)
+        rv += slabs_compact(h, max_gc_num - rv);
+
     atomic_decr(h->ref);
 
+    return rv;
+}
+
+int sht_gc(struct sht * h, int max_gc_num)
+{
+    struct node_pool * pool;
+
+    pool = __atomic_load_n(&h->pool, __ATOMIC_ACQUIRE);
+    if (pool != NULL)
+        pool_refill(h, pool);
+
+    return gc_collect(h, max_gc_num);
+}
+
+int sht_set_gc_budget(struct sht * h, int min_probes, int max_probes,
+        uint64_t max_ns)
+{
+    if (min_probes <= 0 || max_probes < min_probes)
+        return -1;
+
+    pthread_spin_lock(&h->global_lock);
+    h->gc_min_probes = min_probes;
+    h->gc_max_probes = max_probes;
+    h->gc_probes = min_probes;
+    h->gc_max_ns = max_ns;
+    pthread_spin_unlock(&h->global_lock);
+
     return 0;
 }
 
-static
-int _sht_gc(struct sht * h, int max_gc_num)
+int sht_reserve(struct sht * h, size_t num_entries)
 {
-    int n, i;
-    struct line * old_line, * new_line;
-    struct node * node, * tmp;
-    struct sht * old;
+    int rv;
+    size_t size;
 
-    if (likely(h->old == NULL))
-        return 0;
+    /* aim at one node per line */
+    size = MIN(num_entries, MAX_NUM_LINES);
 
-    if (pthread_spin_trylock(&h->old->global_lock) != 0)
-        return 0;
+    if (h->flags & SHT_F_NOSYNC) {
+        if (size <= h->size)
+            return 0;
 
-    old_line = &h->old->lines[h->old->gc_index];
-    pthread_spin_lock(&old_line->lock);
-    for (i = 0 ; i < max_gc_num ; i++) {
-        node = old_line->nodes;
-        if (node == NULL) {
-            h->old->gc_index++;
-            if (h->old->gc_index >= h->old->size)
-                break;
+        if (h->lines == NULL) {
+            h->size = size;
+            h->max_line_depth = isqrt(size);
+            return 0;
+        }
 
-            pthread_spin_unlock(&old_line->lock);
-            old_line = &h->old->lines[h->old->gc_index];
-            pthread_spin_lock(&old_line->lock);
-            continue;
+        return nosync_resize(h, size);
+    }
+
+    if (h->swmr != NULL)
+        return (size > h->size) ? swmr_resize(h, size) : 0;
+
+    for (;;) {
+        if (unlikely(sht_ref_or_small(h))) {
+            /* lines will be allocated with the right size */
+            if (size > h->size) {
+                h->size = size;
+                h->max_line_depth = isqrt(size);
+            }
+
+            pthread_spin_unlock(&h->global_lock);
+            return 0;
         }
 
-        tmp = node->next;
-        new_line = &h->lines[node->hash % h->size];
-        sht_insert_node(h, new_line, node);
-        /* XXX cpt_insert is incr within sht_insert_node(). Keep ? */
-        atomic_decr(h->cpt_insert);
-        old_line->nodes = tmp;
-        old_line->len--;
+        rv = 0;
+        if (h->size >= size) {
+            atomic_decr(h->ref);
+            return 0;
+        }
+
+        /* finish any pending migration before starting this one.
+         * Do not hold the reference while waiting: resizes wait for it.
+         * Another one may start in between, then finish it as well */
+        if (h->old == NULL)
+            rv = sht_resize(h, size);
+        else
+            _sht_gc(h, INT32_MAX, 0);
+
+        atomic_decr(h->ref);
+
+        if (unlikely(rv < 0)) {
+            atomic_incr(h->cpt_double_size_fail);
+            return -1;
+        }
+
+        cpu_relax();
+    }
+}
+
+/* about one line per entry, unless the lines are not even twice as many */
+static size_t
+shrink_size(struct sht const * h)
+{
+    uint64_t num_entries;
+
+    num_entries = __atomic_load_n(&h->cpt_insert, __ATOMIC_RELAXED)
+        - __atomic_load_n(&h->cpt_remove, __ATOMIC_RELAXED);
+    num_entries = MAX(num_entries, DEFAULT_NUM_LINES);
+
+    return (num_entries <= h->size / 2) ? num_entries : h->size;
+}
+
+int sht_shrink(struct sht * h)
+{
+    int rv;
+    size_t size;
+
+    if (h->flags & SHT_F_NOSYNC) {
+        if (h->lines == NULL)
+            return 0;
+
+        size = shrink_size(h);
+        return (size < h->size) ? nosync_resize(h, size) : 0;
     }
 
-    n = i;
+    if (h->swmr != NULL) {
+        size = shrink_size(h);
+        return (size < h->size) ? swmr_resize(h, size) : 0;
+    }
 
-    pthread_spin_unlock(&old_line->lock);
+    if (unlikely(sht_ref_or_small(h))) {
+        pthread_spin_unlock(&h->global_lock);
+        return 0;
+    }
 
-    if (h->old->gc_index >= h->old->size) {
-        /* put on old any new hashtable operation */
-        pthread_spin_lock(&h->global_lock);
+    /* a migration is already shrinking or growing the table */
+    rv = 0;
+    size = shrink_size(h);
+    if (size < h->size && h->old == NULL)
+        rv = sht_resize(h, size);
 
-        /* wait for any (other) current hashtable transaction to finish */
-        while (h->ref > 1)
-            ;
+    atomic_decr(h->ref);
 
-        old = h->old;
-        h->old = NULL;
+    return (rv < 0) ? -1 : 0;
+}
+
+int sht_set_node_pool(struct sht * h, int num_nodes, size_t max_keylen)
+{
+    struct node * b, * extra;
+    struct node_pool * pool, * new_pool;
+
+    /* SHT_F_SWMR resizes copy the nodes, but not their key */
+    if (num_nodes < 0 || max_keylen == 0 || (h->flags & SHT_F_SWMR)
+            || max_keylen > SIZE_MAX - sizeof(struct node))
+        return -1;
+
+    pool = __atomic_load_n(&h->pool, __ATOMIC_ACQUIRE);
+    if (pool == NULL) {
+        new_pool = h->alloc(sizeof(*new_pool));
+        if (new_pool == NULL)
+            return -1;
 
-        /* resume operations */
+        *new_pool = (struct node_pool) {
+            .owner = h,
+            .keylen = max_keylen,
+        };
+        pthread_spin_init(&new_pool->lock, PTHREAD_PROCESS_PRIVATE);
+
+        pthread_spin_lock(&h->global_lock);
+        pool = h->pool;
+        if (pool == NULL) {
+            pool = new_pool;
+            __atomic_store_n(&h->pool, pool, __ATOMIC_RELEASE);
+        }
         pthread_spin_unlock(&h->global_lock);
 
-        /* old is unreachable */
-        pthread_spin_unlock(&old->global_lock);
-        sht_destroy(old);
-    } else {
-        pthread_spin_unlock(&h->old->global_lock);
+        if (pool != new_pool)
+            pool_destroy(h, new_pool);
     }
 
-    return n;
-}
+    /* the nodes already allocated are too short */
+    if (max_keylen > pool->keylen)
+        return -1;
 
-int sht_gc(struct sht * h, int max_gc_num)
-{
-    int rv;
+    /* give back what a smaller pool does not need */
+    extra = NULL;
+    pthread_spin_lock(&pool->lock);
+    pool->target = num_nodes;
+    while (pool->len > pool->target) {
+        b = pool->nodes;
+        pool->nodes = b->next;
+        pool->len--;
+        b->next = extra;
+        extra = b;
+    }
+    pthread_spin_unlock(&pool->lock);
 
-    sht_ref(h);
-    rv = _sht_gc(h, max_gc_num);
-    atomic_decr(h->ref);
+    while ((b = extra) != NULL) {
+        extra = b->next;
+        h->free(b);
+    }
 
-    return rv;
+    return pool_refill(h, pool);
 }
 
 void * sht_lookup(struct sht * h, void * key, size_t keylen)
 {
+    int i;
+    size_t size;
     void * ptr;
     uint32_t hash;
     struct line * line;
@@ -437,23 +3025,41 @@ void * sht_lookup(struct sht * h, void * key, size_t keylen)
     if (unlikely(key == NULL || keylen == 0))
         return NULL;
 
+    trace_op(h, SHT_TRACE_LOOKUP, key, keylen);
+    if (h->flags & SHT_F_NOSYNC)
+        return nosync_lookup(h, key, keylen);
+
     ptr = NULL;
     hash = h->hash(key, keylen);
+
+    /* readers of SHT_F_SWMR tables do not write anything, stats included */
+    if (h->swmr != NULL) {
+        line = swmr_lines(h, &size);
+        return swmr_line_lookup(&line[hash % size], hash, key, keylen);
+    }
+
     atomic_incr(h->cpt_lookup);
-    sht_ref(h);
+    if (unlikely(sht_ref_or_small(h))) {
+        i = small_find(h, hash, key, keylen);
+        if (i >= 0)
+            ptr = h->small[i]->data;
+
+        pthread_spin_unlock(&h->global_lock);
+        return ptr;
+    }
 
-    _sht_gc(h, h->gc_num);
+    sht_gc_step(h);
 
     line = &h->lines[hash % h->size];
 
     pthread_spin_lock(&line->lock);
-    ptr = line_lookup(line, key, keylen);
+    ptr = line_lookup(line, hash, key, keylen);
     pthread_spin_unlock(&line->lock);
 
     if (unlikely(h->old != NULL) && ptr == NULL) {
         line = &h->old->lines[hash % h->old->size];
         pthread_spin_lock(&line->lock);
-        ptr = line_lookup(line, key, keylen);
+        ptr = line_lookup(line, hash, key, keylen);
         pthread_spin_unlock(&line->lock);
     }
 
@@ -468,17 +3074,30 @@ void * sht_lookup_insert(struct sht * h, void * key, size_t keylen,
     int once;
     void * ptr;
     void * bak;
+    int collision;
     struct line * line;
     struct node * new_node;
+    struct fc_request req;
     uint32_t hash;
 
     if (unlikely(key == NULL || keylen == 0))
         return NULL;
 
-    sht_ref(h);
+    trace_op(h, SHT_TRACE_LOOKUP_INSERT, key, keylen);
+    if (h->flags & SHT_F_NOSYNC)
+        return nosync_lookup_insert(h, key, keylen, value);
+
+    if (h->swmr != NULL)
+        return swmr_lookup_insert(h, key, keylen, value);
+
     atomic_incr(h->cpt_lookup);
+    if (unlikely(sht_ref_or_small(h))) {
+        ptr = small_lookup_insert(h, key, keylen, value);
+        pthread_spin_unlock(&h->global_lock);
+        return ptr;
+    }
 
-    _sht_gc(h, h->gc_num);
+    sht_gc_step(h);
 
     once = 1;
     new_node = NULL;
@@ -487,7 +3106,7 @@ void * sht_lookup_insert(struct sht * h, void * key, size_t keylen,
 
     /* deal with double-size */
     line = &h->lines[hash % h->size];
-    if (unlikely(line->len > h->max_line_depth)) {
+    if (unlikely(line_too_long(h, line))) {
         if (unlikely(sht_double_size(h) != 0))
             atomic_incr(h->cpt_double_size_fail);
     }
@@ -496,7 +3115,7 @@ void * sht_lookup_insert(struct sht * h, void * key, size_t keylen,
     if (unlikely(ptr == NULL && h->old != NULL)) {
         line = &h->old->lines[hash % h->old->size];
         pthread_spin_lock(&line->lock);
-        ptr = line_lookup(line, key, keylen);
+        ptr = line_lookup(line, hash, key, keylen);
         pthread_spin_unlock(&line->lock);
     }
 
@@ -507,12 +3126,12 @@ void * sht_lookup_insert(struct sht * h, void * key, size_t keylen,
     line = &h->lines[hash % h->size];
     pthread_spin_lock(&line->lock);
 lookup_insert:
-    ptr = line_lookup(line, key, keylen);
+    ptr = line_lookup(line, hash, key, keylen);
 
     if (ptr != NULL) {
         pthread_spin_unlock(&line->lock);
         if (new_node != NULL)
-            node_destroy(h->free, new_node);
+            node_destroy(h, new_node);
 
         goto exit;
     }
@@ -530,19 +3149,30 @@ lookup_insert:
             goto exit;
 
         once = 0;
-        pthread_spin_lock(&line->lock);
+        req = (struct fc_request) {
+            .node = new_node,
+            .unique = 1,
+        };
+        if (unlikely(line_lock_or_combine(h, line, &req))) {
+            ptr = req.data;
+            if (!req.inserted)
+                node_destroy(h, new_node);
 
-        if (unlikely(line->nodes != bak)) {
-            bak = line->nodes;
-            goto lookup_insert; /* keep line locked */
+            goto exit;
         }
+
+        /* a treeified line has no chain head to compare against */
+        if (unlikely(line->nodes != bak || line->index != NULL))
+            goto lookup_insert; /* keep line locked */
     }
 
     assert(new_node != NULL);
 
     atomic_incr(h->cpt_insert);
-    line_insert(line, new_node);
-    if (bak != NULL)
+    collision = (line->len > 0);
+    line_insert(h, line, new_node);
+    line_combine(h, line);
+    if (collision)
         atomic_incr(h->cpt_collisions);
 
     pthread_spin_unlock(&line->lock);
@@ -556,83 +3186,540 @@ exit:
 
 int sht_remove(struct sht * h, void * key, size_t keylen)
 {
-    int rv;
     uint32_t hash;
     struct line * line;
-    struct node * node, * prev;
+    struct node * node;
 
-    sht_ref(h);
-    _sht_gc(h, h->gc_num);
+    trace_op(h, SHT_TRACE_REMOVE, key, keylen);
+    if (h->flags & SHT_F_NOSYNC)
+        return nosync_remove(h, key, keylen);
+
+    if (h->swmr != NULL)
+        return swmr_remove(h, key, keylen);
 
-    rv = -1;
     hash = h->hash(key, keylen);
-    line = &h->lines[hash % h->size];
-    prev = NULL;
 
-    pthread_spin_lock(&line->lock);
-    for (node = line->nodes ; node != NULL ; node = node->next) {
-        if (node->keylen == keylen
-           && memcmp(node->key, key, keylen) == 0) {
-            if (prev == NULL)
-                line->nodes = node->next;
-            else
-                prev->next = node->next;
+    if (unlikely(sht_ref_or_small(h))) {
+        node = small_remove(h, hash, key, keylen);
+        pthread_spin_unlock(&h->global_lock);
+        goto exit;
+    }
 
-            node_destroy(h->free, node);
-            atomic_incr(h->cpt_remove);
-            line->len--;
-            rv = 0;
-            break;
-        }
+    sht_gc_step(h);
 
-        prev = node;
-    }
+    line = &h->lines[hash % h->size];
 
+    pthread_spin_lock(&line->lock);
+    node = line_remove(h, line, hash, key, keylen);
     pthread_spin_unlock(&line->lock);
 
-    if (unlikely(rv != 0 && h->old)) {
+    if (unlikely(node == NULL && h->old)) {
         line = &h->old->lines[hash % h->old->size];
-        prev = NULL;
 
         pthread_spin_lock(&line->lock);
-        for (node = line->nodes ; node != NULL ; node = node->next) {
-            if (node->keylen == keylen
-               && memcmp(node->key, key, keylen) == 0) {
-                if (prev == NULL)
-                    line->nodes = node->next;
-                else
-                    prev->next = node->next;
-
-                node_destroy(h->free, node);
-                atomic_incr(h->cpt_remove);
-                line->len--;
-                rv = 0;
-                break;
-            }
-
-            prev = node;
-        }
-
+        node = line_remove(h, line, hash, key, keylen);
         pthread_spin_unlock(&line->lock);
     }
 
     atomic_decr(h->ref);
 
-    return rv;
+exit:
+    if (node == NULL)
+        return -1;
+
+    node_destroy(h, node);
+    atomic_incr(h->cpt_remove);
+
+    return 0;
+}
+
+#define stat_read(h, cpt) __atomic_load_n(&(h)->cpt, __ATOMIC_RELAXED)
+
+void sht_get_stats(struct sht const * h, struct sht_stats * stats)
+{
+    *stats = (struct sht_stats) {
+        .num_lines = stat_read(h, size),
+        .lookups = stat_read(h, cpt_lookup),
+        .inserts = stat_read(h, cpt_insert),
+        .removes = stat_read(h, cpt_remove),
+        .collisions = stat_read(h, cpt_collisions),
+        .double_size = stat_read(h, cpt_double_size),
+        .double_size_fail = stat_read(h, cpt_double_size_fail),
+        .slow_growth = stat_read(h, cpt_slow_growth),
+        .treeified = stat_read(h, cpt_treeify),
+        .combined = stat_read(h, cpt_combined),
+        .gc_lag = stat_read(h, cpt_gc_lag),
+        .gc_timeout = stat_read(h, cpt_gc_timeout),
+        .pool_used = stat_read(h, cpt_pool_used),
+    };
+
+    if (h->slabs != NULL) {
+        stats->slab_moved = stat_read(h->slabs, cpt_moved);
+        stats->slabs_released = stat_read(h->slabs, cpt_released);
+        stats->slab_bytes = stat_read(h->slabs, mapped);
+    }
 }
 
 void sht_dump_stats(struct sht const * h)
 {
-    int i;
-    int num_nodes = 0;
-    for (i = 0 ; i < h->size ; i++)
+    size_t i;
+    uint64_t num_nodes = h->small_len;
+    for (i = 0 ; h->lines != NULL && i < h->size ; i++)
         num_nodes += h->lines[i].len;
 
-    printf("number of nodes: %d\n", num_nodes);
+    printf("number of lines: %zu\n", h->size);
+    printf("number of nodes: %lu\n", num_nodes);
     printf("lookups: %lu\n", h->cpt_lookup);
     printf("inserts: %lu\n", h->cpt_insert);
     printf("removes: %lu\n", h->cpt_remove);
     printf("collisions: %lu\n", h->cpt_collisions);
     printf("double-size: %lu\n", h->cpt_double_size);
     printf("failed double-size: %lu\n", h->cpt_double_size_fail);
+    printf("slowed double-size: %lu\n", h->cpt_slow_growth);
+    printf("treeified lines: %lu\n", h->cpt_treeify);
+    printf("combined inserts: %lu\n", h->cpt_combined);
+    printf("gc budget raises: %lu\n", h->cpt_gc_lag);
+    printf("gc budget timeouts: %lu\n", h->cpt_gc_timeout);
+
+    if (h->slabs != NULL) {
+        for (i = 0 ; i < SLAB_NUM_CLASSES ; i++) {
+            printf("slabs of %d bytes: %lu, %lu/%lu slots used\n",
+                    SLAB_MIN_SLOT << i, h->slabs->classes[i].num_slabs,
+                    h->slabs->classes[i].used,
+                    h->slabs->classes[i].capacity);
+        }
+
+        printf("slab nodes moved: %lu\n", h->slabs->cpt_moved);
+        printf("slabs released: %lu\n", h->slabs->cpt_released);
+        printf("slab bytes: %lu\n", h->slabs->mapped);
+    }
+
+    if (h->pool != NULL) {
+        printf("pool nodes: %d/%d\n", h->pool->len, h->pool->target);
+        printf("pool nodes used: %lu\n", h->cpt_pool_used);
+    }
+}
+
+/*
+ * Memory pressure
+ *
+ * The cgroup v2 memory.events counters tell when the cgroup went over its
+ * high or max limits, and its memory.pressure PSI averages how long its
+ * tasks stalled on memory. Each table watched is then given a chance to
+ * evict entries, before being shrunk and compacted.
+ */
+
+/* PSI thresholds, in % of the time stalled since the last poll */
+#define PRESSURE_SOME_PCT 10
+#define PRESSURE_FULL_PCT 5
+
+#define PRESSURE_BUF_SIZE 1024
+
+struct pressure_table {
+    struct sht * h;
+    sht_evict_fn evict;
+    void * arg;
+};
+
+struct sht_pressure {
+    char events_path[PATH_MAX];
+    char psi_path[PATH_MAX];
+
+    /* last memory.events counters seen */
+    uint64_t events_high;
+    uint64_t events_max;
+
+    /* last PSI total stall times seen, in us, and when */
+    uint64_t psi_some;
+    uint64_t psi_full;
+    uint64_t psi_ns;
+
+    pthread_mutex_t lock; /* tables, and polls */
+    int num_tables;
+    int max_tables;
+    struct pressure_table * tables;
+
+    int interval_ms; /* 0 without watcher thread */
+    int started;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+};
+
+/* read a whole small file, return -1 if it cannot be read */
+static int
+read_small_file(char const * path, char * buf, size_t size)
+{
+    FILE * f;
+    size_t len;
+
+    if (path[0] == '\0')
+        return -1;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    len = fread(buf, 1, size - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    return 0;
+}
+
+/* the line of buf starting with the word name, NULL if none */
+static char const *
+find_line(char const * buf, char const * name)
+{
+    size_t len = strlen(name);
+    char const * line;
+
+    for (line = buf ; line != NULL ; line = strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+
+        if (strncmp(line, name, len) == 0 && line[len] == ' ')
+            return line + len + 1;
+    }
+
+    return NULL;
+}
+
+static uint64_t
+events_value(char const * buf, char const * name)
+{
+    char const * value = find_line(buf, name);
+
+    return (value != NULL) ? strtoull(value, NULL, 10) : 0;
+}
+
+/* the total= stall time of a PSI line, in us */
+static uint64_t
+psi_total(char const * buf, char const * name)
+{
+    char const * value = find_line(buf, name);
+    char const * end;
+
+    if (value == NULL)
+        return 0;
+
+    end = strchr(value, '\n');
+    value = strstr(value, "total=");
+    if (value == NULL || (end != NULL && value > end))
+        return 0;
+
+    return strtoull(value + 6, NULL, 10);
+}
+
+/* the memory.events counters going up */
+static int
+pressure_read_events(struct sht_pressure * p, uint64_t * high,
+        uint64_t * max)
+{
+    char buf[PRESSURE_BUF_SIZE];
+
+    if (read_small_file(p->events_path, buf, sizeof(buf)) != 0)
+        return -1;
+
+    *high = events_value(buf, "high");
+    *max = events_value(buf, "max") + events_value(buf, "oom");
+
+    return 0;
+}
+
+/* the PSI stall times going up: the averages lag for seconds after the
+ * stalls, only the stalls since the last poll count */
+static int
+pressure_read_psi(struct sht_pressure * p, uint64_t * some,
+        uint64_t * full)
+{
+    char buf[PRESSURE_BUF_SIZE];
+
+    if (read_small_file(p->psi_path, buf, sizeof(buf)) != 0)
+        return -1;
+
+    *some = psi_total(buf, "some");
+    *full = psi_total(buf, "full");
+
+    return 0;
+}
+
+/* whether tasks stalled more than pct % of the elapsed time */
+static int
+psi_stalled(uint64_t total, uint64_t last, uint64_t elapsed_ns, int pct)
+{
+    uint64_t stall_ns;
+
+    if (total <= last)
+        return 0;
+
+    stall_ns = (total - last) * 1000;
+    return stall_ns * 100 >= pct * elapsed_ns;
+}
+
+static enum sht_pressure_level
+pressure_level(struct sht_pressure * p)
+{
+    uint64_t high, max, some, full, now, elapsed;
+    enum sht_pressure_level level = SHT_PRESSURE_NONE;
+
+    if (pressure_read_events(p, &high, &max) == 0) {
+        if (max > p->events_max)
+            level = SHT_PRESSURE_CRITICAL;
+        else if (high > p->events_high)
+            level = SHT_PRESSURE_MEDIUM;
+
+        p->events_high = high;
+        p->events_max = max;
+    }
+
+    if (pressure_read_psi(p, &some, &full) == 0) {
+        now = now_ns();
+        elapsed = now - p->psi_ns;
+        if (psi_stalled(full, p->psi_full, elapsed, PRESSURE_FULL_PCT))
+            level = SHT_PRESSURE_CRITICAL;
+        else if (psi_stalled(some, p->psi_some, elapsed, PRESSURE_SOME_PCT))
+            level = MAX(level, SHT_PRESSURE_MEDIUM);
+
+        p->psi_some = some;
+        p->psi_full = full;
+        p->psi_ns = now;
+    }
+
+    return level;
+}
+
+/* give back what h does not need. Tables confined to a thread, and the
+ * single writer ones, are only modified by their own threads */
+static void
+pressure_relieve(struct sht * h)
+{
+    if ((h->flags & SHT_F_NOSYNC) || h->swmr != NULL)
+        return;
+
+    sht_shrink(h);
+
+    /* the old lines are only freed once the migration is over,
+     * and the slabs once their nodes moved. The node pool is not
+     * refilled, it would take back what was just given */
+    while (gc_collect(h, INT32_MAX) > 0)
+        ;
+}
+
+enum sht_pressure_level sht_pressure_poll(struct sht_pressure * p)
+{
+    int i;
+    struct pressure_table * t;
+    enum sht_pressure_level level;
+
+    pthread_mutex_lock(&p->lock);
+    level = pressure_level(p);
+    if (level != SHT_PRESSURE_NONE) {
+        for (i = 0 ; i < p->num_tables ; i++) {
+            t = &p->tables[i];
+            if (t->evict != NULL)
+                t->evict(t->h, level, t->arg);
+
+            pressure_relieve(t->h);
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return level;
+}
+
+static void *
+pressure_thread(void * arg)
+{
+    struct sht_pressure * p = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&p->stop_lock);
+    while (!p->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += p->interval_ms / 1000;
+        ts.tv_nsec += (p->interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&p->stop_cond, &p->stop_lock, &ts);
+        if (p->stop)
+            break;
+
+        pthread_mutex_unlock(&p->stop_lock);
+        sht_pressure_poll(p);
+        pthread_mutex_lock(&p->stop_lock);
+    }
+
+    pthread_mutex_unlock(&p->stop_lock);
+
+    return NULL;
+}
+
+/* the cgroup v2 directory of this process */
+static int
+own_cgroup(char * dir, size_t size)
+{
+    char * path, * end;
+    char buf[PRESSURE_BUF_SIZE];
+
+    if (read_small_file("/proc/self/cgroup", buf, sizeof(buf)) != 0)
+        return -1;
+
+    /* the unified hierarchy is "0::/path" */
+    path = strstr(buf, "0::");
+    if (path == NULL || (path != buf && path[-1] != '\n'))
+        return -1;
+
+    path += 3;
+    end = strchr(path, '\n');
+    if (end != NULL)
+        *end = '\0';
+
+    if (snprintf(dir, size, "/sys/fs/cgroup%s", path) >= (int) size)
+        return -1;
+
+    return 0;
+}
+
+struct sht_pressure * sht_pressure_create(char const * cgroup,
+        int interval_ms)
+{
+    char dir[PATH_MAX];
+    char buf[PRESSURE_BUF_SIZE];
+    struct sht_pressure * p;
+
+    if (interval_ms < 0)
+        return NULL;
+
+    if (cgroup == NULL) {
+        if (own_cgroup(dir, sizeof(dir)) != 0)
+            return NULL;
+
+        cgroup = dir;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    if (snprintf(p->events_path, sizeof(p->events_path),
+                "%s/memory.events", cgroup) >= (int) sizeof(p->events_path)
+            || snprintf(p->psi_path, sizeof(p->psi_path),
+                "%s/memory.pressure", cgroup) >= (int) sizeof(p->psi_path)) {
+        free(p);
+        return NULL;
+    }
+
+    /* the root cgroup has no memory.pressure, the system has one */
+    if (cgroup == dir && read_small_file(p->psi_path, buf, sizeof(buf)) != 0)
+        snprintf(p->psi_path, sizeof(p->psi_path), "/proc/pressure/memory");
+
+    /* only the stalls and events from now on count */
+    if (pressure_read_psi(p, &p->psi_some, &p->psi_full) != 0)
+        p->psi_path[0] = '\0';
+
+    p->psi_ns = now_ns();
+
+    if (pressure_read_events(p, &p->events_high, &p->events_max) != 0)
+        p->events_path[0] = '\0';
+
+    if (p->events_path[0] == '\0' && p->psi_path[0] == '\0') {
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->stop_lock, NULL);
+    pthread_cond_init(&p->stop_cond, NULL);
+
+    p->interval_ms = interval_ms;
+    if (interval_ms > 0) {
+        if (pthread_create(&p->thread, NULL, pressure_thread, p) != 0) {
+            sht_pressure_destroy(p);
+            return NULL;
+        }
+
+        p->started = 1;
+    }
+
+    return p;
+}
+
+void sht_pressure_destroy(struct sht_pressure * p)
+{
+    if (p == NULL)
+        return;
+
+    if (p->started) {
+        pthread_mutex_lock(&p->stop_lock);
+        p->stop = 1;
+        pthread_cond_signal(&p->stop_cond);
+        pthread_mutex_unlock(&p->stop_lock);
+        pthread_join(p->thread, NULL);
+    }
+
+    pthread_cond_destroy(&p->stop_cond);
+    pthread_mutex_destroy(&p->stop_lock);
+    pthread_mutex_destroy(&p->lock);
+    free(p->tables);
+    free(p);
+}
+
+int sht_pressure_add(struct sht_pressure * p, struct sht * h,
+        sht_evict_fn evict, void * arg)
+{
+    int max;
+    struct pressure_table * tables;
+
+    if (p == NULL || h == NULL)
+        return -1;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->num_tables == p->max_tables) {
+        max = MAX(2 * p->max_tables, 4);
+        tables = realloc(p->tables, max * sizeof(*tables));
+        if (tables == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return -1;
+        }
+
+        p->tables = tables;
+        p->max_tables = max;
+    }
+
+    p->tables[p->num_tables++] = (struct pressure_table) {
+        .h = h,
+        .evict = evict,
+        .arg = arg,
+    };
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+int sht_pressure_remove(struct sht_pressure * p, struct sht * h)
+{
+    int i, rv;
+
+    if (p == NULL)
+        return -1;
+
+    rv = -1;
+    pthread_mutex_lock(&p->lock);
+    for (i = 0 ; i < p->num_tables ; i++) {
+        if (p->tables[i].h == h) {
+            p->tables[i] = p->tables[--p->num_tables];
+            rv = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return rv;
 }
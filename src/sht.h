@@ -8,7 +8,16 @@ typedef uint32_t (* hash_fn) (void * data, size_t datalen);
 /* simple table of linked-lists, no double-size */
 struct sht;
 
-struct sht * sht_create_custom(int size, alloc_fn _alloc, free_fn _free,
+/* creation flags */
+#define SHT_F_SMALL  (1 << 0) /* start as a small array, allocate lines later */
+#define SHT_F_SWMR   (1 << 1) /* single writer thread, lock-free readers */
+#define SHT_F_NOSYNC (1 << 2) /* used by a single thread, no synchronization */
+#define SHT_F_SLAB   (1 << 3) /* nodes and short keys allocated from slabs */
+
+/* size is the initial number of lines, <= 0 for the default */
+struct sht * sht_create_ext(int64_t size, int flags, alloc_fn _alloc,
+        free_fn _free, hash_fn _hash);
+struct sht * sht_create_custom(int64_t size, alloc_fn _alloc, free_fn _free,
         hash_fn _hash);
 void sht_destroy(struct sht * h);
 
@@ -19,8 +28,157 @@ void * sht_lookup(struct sht * h, void * key, size_t keylen);
 void * sht_lookup_insert(struct sht * h, void * key, size_t keylen,
         void * value);
 int sht_remove(struct sht * h, void * key, size_t keylen);
+
+/* move at most max_gc_num nodes from the table being resized, if any.
+ * SHT_F_SLAB tables then move the nodes left in their sparsest slabs to
+ * the fuller ones, and give the slabs emptied back to the system. The
+ * operations of synchronized tables do a share of this work too.
+ * Return the number of nodes moved */
 int sht_gc(struct sht * h, int max_gc_num);
 
+/* bound the maintenance work of each operation while a resize migrates
+ * nodes: between min_probes and max_probes nodes moved or lines visited,
+ * raised as long as inserts outpace the migration, and at most max_ns
+ * nanoseconds if not 0. Defaults to 4 to 256 probes, without time limit */
+int sht_set_gc_budget(struct sht * h, int min_probes, int max_probes,
+        uint64_t max_ns);
+
+/* grow the table ahead of num_entries insertions, with a single resize.
+ * A migration still running is first finished by the calling thread, which
+ * blocks until then. The nodes are then migrated incrementally, by the
+ * following operations.
+ * Short on memory, the table may grow by less than asked and 0 is still
+ * returned, as for the resizes on insert: -1 means it could not grow */
+int sht_reserve(struct sht * h, size_t num_entries);
+
+/* shrink the table to about one line per entry, if it has more than twice
+ * as many lines. Nodes are migrated incrementally, as when growing */
+int sht_shrink(struct sht * h);
+
+/* set aside num_nodes nodes for keys of up to max_keylen bytes, used by
+ * the inserts whose allocations fail. Removed pool nodes return to the
+ * pool, and sht_gc() allocates it back to num_nodes, though not while
+ * relieving memory pressure. Resizes short on
+ * memory grow the table by less rather than fail. max_keylen cannot be
+ * raised once set. Not for SHT_F_SWMR tables.
+ * Return -1 if the pool could not be filled */
+int sht_set_node_pool(struct sht * h, int num_nodes, size_t max_keylen);
+
+/* the counters printed by sht_dump_stats() */
+struct sht_stats {
+    size_t num_lines;
+    uint64_t lookups;
+    uint64_t inserts;
+    uint64_t removes;
+    uint64_t collisions;
+    uint64_t double_size;
+    uint64_t double_size_fail;
+    uint64_t slow_growth;
+    uint64_t treeified;
+    uint64_t combined;   /* inserts done by another thread holding the line */
+    uint64_t gc_lag;     /* gc budget raises */
+    uint64_t gc_timeout; /* gc steps cut short by their time budget */
+    uint64_t pool_used;
+    uint64_t slab_moved;
+    uint64_t slabs_released;
+    uint64_t slab_bytes; /* mapped for the nodes, outside of alloc/free */
+};
+
+void sht_get_stats(struct sht const * h, struct sht_stats * stats);
 void sht_dump_stats(struct sht const * h);
 
+/* per-thread write buffer: inserts are only visible once flushed, by batch.
+ * sht_wbuf_insert() flushes when the buffer is full,
+ * and sht_wbuf_destroy() flushes what remains.
+ * The nodes of a batch are allocated together, their memory is only given
+ * back once they are all removed */
+struct sht_wbuf;
+
+struct sht_wbuf * sht_wbuf_create(struct sht * h, int capacity);
+void sht_wbuf_destroy(struct sht_wbuf * b);
+int sht_wbuf_insert(struct sht_wbuf * b, void * key, size_t keylen,
+        void * value);
+int sht_wbuf_flush(struct sht_wbuf * b);
+
+/* operation trace: a binary log of the operations of the table, written to
+ * fd. One operation in sample_rate (a power of 2) of each thread is
+ * recorded, with the hash and length of its key and its time. Keys are not
+ * recorded. Records are buffered per thread and written by blocks, the
+ * last ones by sht_trace_stop(), which returns -1 if a write failed */
+enum sht_trace_op {
+    SHT_TRACE_LOOKUP,
+    SHT_TRACE_INSERT,
+    SHT_TRACE_LOOKUP_INSERT,
+    SHT_TRACE_REMOVE,
+};
+
+#define SHT_TRACE_MAGIC 0x45435254 /* "TRCE" */
+#define SHT_TRACE_VERSION 1
+#define SHT_TRACE_MAX_KEYLEN 0xffffff /* longer keys are recorded as such */
+
+/* the trace starts with a header, followed by blocks of records */
+struct sht_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t record_size;
+};
+
+/* records of a single thread, in order. Threads are numbered from 0 */
+struct sht_trace_block {
+    uint32_t thread;
+    uint32_t num_records;
+};
+
+struct sht_trace_record {
+    uint64_t ns;        /* since the trace started */
+    uint32_t hash;
+    uint32_t keylen_op; /* key length << 8 | enum sht_trace_op */
+};
+
+#define SHT_TRACE_OP(r) ((r)->keylen_op & 0xff)
+#define SHT_TRACE_KEYLEN(r) ((r)->keylen_op >> 8)
+
+int sht_trace_start(struct sht * h, int fd, int sample_rate);
+int sht_trace_stop(struct sht * h);
+
+/* SHT_F_SWMR tables: all the modifications are done by a single thread, the
+ * other threads only call sht_lookup() between sht_reader_register() and
+ * sht_reader_unregister(). Memory removed by the writer is only freed once
+ * each reader has called sht_reader_quiescent(), which it does when holding
+ * no value it previously looked up. sht_gc() frees what it can */
+int sht_reader_register(struct sht * h);
+void sht_reader_quiescent(struct sht * h, int reader);
+void sht_reader_unregister(struct sht * h, int reader);
+
+/* memory pressure watcher, for the cgroup v2 directory given, or the one
+ * of the process if NULL. Pressure is medium when the memory.events high
+ * counter goes up or tasks stalled on memory (PSI) since the last check,
+ * critical when the max or oom counters go up or every task stalled.
+ * Under pressure, each table added is given to its evict callback if any,
+ * then shrunk, its migration finished and its slabs compacted. Only the
+ * callback is called for SHT_F_NOSYNC and SHT_F_SWMR tables, from the
+ * watcher thread: it must not add or remove tables.
+ * With an interval of 0, there is no thread and sht_pressure_poll() checks
+ * the pressure once, and returns its level. Tables must be removed before
+ * being destroyed */
+enum sht_pressure_level {
+    SHT_PRESSURE_NONE,
+    SHT_PRESSURE_MEDIUM,
+    SHT_PRESSURE_CRITICAL,
+};
+
+typedef void (* sht_evict_fn)(struct sht * h, enum sht_pressure_level level,
+        void * arg);
+
+struct sht_pressure;
+
+struct sht_pressure * sht_pressure_create(char const * cgroup,
+        int interval_ms);
+void sht_pressure_destroy(struct sht_pressure * p);
+int sht_pressure_add(struct sht_pressure * p, struct sht * h,
+        sht_evict_fn evict, void * arg);
+int sht_pressure_remove(struct sht_pressure * p, struct sht * h);
+enum sht_pressure_level sht_pressure_poll(struct sht_pressure * p);
+
 #endif /* SIMPLE_HASHTABLE_HEADER */
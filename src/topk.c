@@ -0,0 +1,462 @@
+#define _POSIX_C_SOURCE 200112L /* pthread_spin_*() */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "topk.h"
+
+/* counters are stored with their key, every stride bytes */
+struct counter {
+    uint64_t count;
+    uint64_t error;
+    uint32_t hash;
+    uint32_t heap_pos;
+    uint32_t keylen;
+    uint8_t key[];
+};
+
+struct topk {
+    int k;
+    int len;
+    size_t max_keylen;
+    size_t stride;
+
+    uint32_t sample_mask;
+    uint64_t rng;
+
+    /* counter id + 1, 0 when empty */
+    uint32_t index_mask;
+    uint32_t * index;
+
+    /* counter ids, min-heap on their count */
+    uint32_t * heap;
+    uint8_t * counters;
+
+    pthread_spinlock_t lock;
+
+    /* stats */
+    uint64_t cpt_updates;
+    uint64_t cpt_sampled;
+    uint64_t cpt_evictions;
+    uint64_t cpt_merges;
+};
+
+static inline
+struct counter * counter(struct topk const * t, uint32_t id)
+{
+    return (struct counter *) (t->counters + id * t->stride);
+}
+
+static inline
+uint64_t xorshift64(uint64_t * state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static inline
+uint32_t next_pow2(uint32_t n)
+{
+    uint32_t p = 1;
+
+    while (p < n)
+        p <<= 1;
+
+    return p;
+}
+
+void topk_destroy(struct topk * t)
+{
+    if (t != NULL) {
+        pthread_spin_destroy(&t->lock);
+        free(t->index);
+        free(t->heap);
+        free(t->counters);
+        free(t);
+    }
+}
+
+struct topk * topk_create(int k, size_t max_keylen, int sample_rate)
+{
+    struct topk * t;
+
+    if (k <= 0 || k > (1 << 24) || max_keylen == 0)
+        return NULL;
+
+    if (sample_rate <= 0)
+        sample_rate = 1;
+
+    if (sample_rate & (sample_rate - 1))
+        return NULL;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    t->k = k;
+    t->max_keylen = max_keylen;
+    t->stride = (sizeof(struct counter) + max_keylen + 7) & ~(size_t) 7;
+    t->sample_mask = sample_rate - 1;
+    t->rng = (uintptr_t) t | 1;
+
+    /* keep the index at most half full */
+    t->index_mask = next_pow2(2 * k) - 1;
+    t->index = calloc(t->index_mask + 1, sizeof(*t->index));
+    t->heap = malloc(k * sizeof(*t->heap));
+    t->counters = malloc(k * t->stride);
+    if (t->index == NULL || t->heap == NULL || t->counters == NULL) {
+        free(t->index);
+        free(t->heap);
+        free(t->counters);
+        free(t);
+        return NULL;
+    }
+
+    pthread_spin_init(&t->lock, PTHREAD_PROCESS_PRIVATE);
+
+    return t;
+}
+
+static void
+_topk_reset(struct topk * t)
+{
+    memset(t->index, 0, (t->index_mask + 1) * sizeof(*t->index));
+    t->len = 0;
+}
+
+void topk_reset(struct topk * t)
+{
+    pthread_spin_lock(&t->lock);
+    _topk_reset(t);
+    pthread_spin_unlock(&t->lock);
+}
+
+/* return the index slot of the key, or the empty slot where it belongs */
+static uint32_t
+index_find(struct topk const * t, uint32_t hash, void const * key,
+        size_t keylen)
+{
+    uint32_t i;
+    struct counter const * c;
+
+    for (i = hash & t->index_mask ; t->index[i] != 0 ;
+            i = (i + 1) & t->index_mask) {
+        c = counter(t, t->index[i] - 1);
+        if (c->hash == hash && c->keylen == keylen
+                && memcmp(c->key, key, keylen) == 0)
+            break;
+    }
+
+    return i;
+}
+
+/* backward-shift deletion: no tombstones */
+static void
+index_delete(struct topk * t, uint32_t i)
+{
+    uint32_t j, home;
+
+    for (j = (i + 1) & t->index_mask ; t->index[j] != 0 ;
+            j = (j + 1) & t->index_mask) {
+        home = counter(t, t->index[j] - 1)->hash & t->index_mask;
+
+        /* move back entries whose home is not within (i, j] */
+        if (((j - home) & t->index_mask) >= ((j - i) & t->index_mask)) {
+            t->index[i] = t->index[j];
+            i = j;
+        }
+    }
+
+    t->index[i] = 0;
+}
+
+static void
+heap_swap(struct topk * t, uint32_t a, uint32_t b)
+{
+    uint32_t tmp;
+
+    tmp = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+
+    counter(t, t->heap[a])->heap_pos = a;
+    counter(t, t->heap[b])->heap_pos = b;
+}
+
+/* for new counters, appended to the heap */
+static void
+heap_sift_up(struct topk * t, uint32_t pos)
+{
+    uint32_t parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (counter(t, t->heap[parent])->count
+                <= counter(t, t->heap[pos])->count)
+            break;
+
+        heap_swap(t, pos, parent);
+        pos = parent;
+    }
+}
+
+/* counts only increase: existing counters only move down */
+static void
+heap_sift_down(struct topk * t, uint32_t pos)
+{
+    uint32_t child, len = t->len;
+
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= len)
+            break;
+
+        if (child + 1 < len && counter(t, t->heap[child + 1])->count
+                < counter(t, t->heap[child])->count)
+            child++;
+
+        if (counter(t, t->heap[pos])->count
+                <= counter(t, t->heap[child])->count)
+            break;
+
+        heap_swap(t, pos, child);
+        pos = child;
+    }
+}
+
+static void
+counter_set(struct counter * c, uint32_t hash, void const * key,
+        size_t keylen, uint64_t count, uint64_t error)
+{
+    c->count = count;
+    c->error = error;
+    c->hash = hash;
+    c->keylen = keylen;
+    memcpy(c->key, key, keylen);
+}
+
+/* expects the lock to be held */
+static void
+_topk_add(struct topk * t, uint32_t hash, void const * key, size_t keylen,
+        uint64_t count, uint64_t error)
+{
+    int append;
+    uint32_t i, id;
+    uint64_t min;
+    struct counter * c;
+
+    i = index_find(t, hash, key, keylen);
+    if (t->index[i] != 0) {
+        c = counter(t, t->index[i] - 1);
+        c->count += count;
+        c->error += error;
+        heap_sift_down(t, c->heap_pos);
+        return;
+    }
+
+    if (t->len < t->k) {
+        id = t->len++;
+        t->heap[id] = id;
+        counter(t, id)->heap_pos = id;
+        min = 0;
+        append = 1;
+    } else {
+        /* take the smallest counter over */
+        id = t->heap[0];
+        c = counter(t, id);
+        min = c->count;
+        index_delete(t, index_find(t, c->hash, c->key, c->keylen));
+        i = index_find(t, hash, key, keylen);
+        t->cpt_evictions++;
+        append = 0;
+    }
+
+    c = counter(t, id);
+    counter_set(c, hash, key, keylen, min + count, min + error);
+    t->index[i] = id + 1;
+
+    if (append)
+        heap_sift_up(t, c->heap_pos);
+    else
+        heap_sift_down(t, c->heap_pos);
+}
+
+int topk_add(struct topk * t, void * key, size_t keylen)
+{
+    if (unlikely(keylen == 0 || keylen > t->max_keylen))
+        return -1;
+
+    t->cpt_updates++;
+    if (t->sample_mask != 0
+            && likely((xorshift64(&t->rng) & t->sample_mask) != 0))
+        return 0;
+
+    pthread_spin_lock(&t->lock);
+    t->cpt_sampled++;
+    _topk_add(t, oat_hash(key, keylen), key, keylen, t->sample_mask + 1, 0);
+    pthread_spin_unlock(&t->lock);
+
+    return 0;
+}
+
+static uint64_t
+topk_min(struct topk const * t)
+{
+    return (t->len == t->k) ? counter(t, t->heap[0])->count : 0;
+}
+
+static int
+counter_ptr_cmp_desc(void const * a, void const * b)
+{
+    struct counter const * ca = *(struct counter * const *) a;
+    struct counter const * cb = *(struct counter * const *) b;
+
+    return (ca->count < cb->count) - (ca->count > cb->count);
+}
+
+/* mergeable summaries (Agarwal et al. 2012): a key missing from a full
+ * summary may have had up to its minimum count there */
+int topk_merge(struct topk * dst, struct topk * src, int reset_src)
+{
+    int i, n, rv;
+    uint32_t slot;
+    uint64_t dst_min, src_min;
+    uint8_t * tmp;
+    struct counter * c, * s;
+    struct counter ** all;
+
+    if (dst == src || src->max_keylen > dst->max_keylen)
+        return -1;
+
+    rv = -1;
+    all = malloc((dst->k + src->k) * sizeof(*all));
+    tmp = malloc((size_t) (dst->k + src->k) * dst->stride);
+    if (all == NULL || tmp == NULL)
+        goto exit;
+
+    /* in address order: merges both ways must not deadlock */
+    if ((uintptr_t) dst < (uintptr_t) src) {
+        pthread_spin_lock(&dst->lock);
+        pthread_spin_lock(&src->lock);
+    } else {
+        pthread_spin_lock(&src->lock);
+        pthread_spin_lock(&dst->lock);
+    }
+
+    dst_min = topk_min(dst);
+    src_min = topk_min(src);
+
+    n = 0;
+    for (i = 0 ; i < dst->len ; i++) {
+        s = counter(dst, i);
+        c = (struct counter *) (tmp + n * dst->stride);
+        counter_set(c, s->hash, s->key, s->keylen, s->count, s->error);
+
+        slot = index_find(src, s->hash, s->key, s->keylen);
+        if (src->index[slot] != 0) {
+            s = counter(src, src->index[slot] - 1);
+            c->count += s->count;
+            c->error += s->error;
+        } else {
+            c->count += src_min;
+            c->error += src_min;
+        }
+
+        all[n++] = c;
+    }
+
+    for (i = 0 ; i < src->len ; i++) {
+        s = counter(src, i);
+        slot = index_find(dst, s->hash, s->key, s->keylen);
+        if (dst->index[slot] != 0)
+            continue;
+
+        c = (struct counter *) (tmp + n * dst->stride);
+        counter_set(c, s->hash, s->key, s->keylen, s->count + dst_min,
+                s->error + dst_min);
+        all[n++] = c;
+    }
+
+    if (reset_src)
+        _topk_reset(src);
+
+    pthread_spin_unlock(&src->lock);
+
+    /* keep the k largest, in increasing order: a valid min-heap */
+    qsort(all, n, sizeof(*all), counter_ptr_cmp_desc);
+    n = MIN(n, dst->k);
+
+    _topk_reset(dst);
+    for (i = 0 ; i < n ; i++) {
+        s = all[n - 1 - i];
+        c = counter(dst, i);
+        counter_set(c, s->hash, s->key, s->keylen, s->count, s->error);
+        c->heap_pos = i;
+        dst->heap[i] = i;
+        dst->index[index_find(dst, c->hash, c->key, c->keylen)] = i + 1;
+    }
+
+    dst->len = n;
+    dst->cpt_merges++;
+    pthread_spin_unlock(&dst->lock);
+
+    rv = 0;
+
+exit:
+    free(all);
+    free(tmp);
+    return rv;
+}
+
+int topk_list(struct topk * t, struct topk_entry * entries, int max)
+{
+    int i, n;
+    struct counter ** all;
+
+    all = malloc(t->k * sizeof(*all));
+    if (all == NULL)
+        return -1;
+
+    pthread_spin_lock(&t->lock);
+
+    for (i = 0 ; i < t->len ; i++)
+        all[i] = counter(t, i);
+
+    qsort(all, t->len, sizeof(*all), counter_ptr_cmp_desc);
+
+    n = MIN(max, t->len);
+    for (i = 0 ; i < n ; i++) {
+        entries[i] = (struct topk_entry) {
+            .key = all[i]->key,
+            .keylen = all[i]->keylen,
+            .count = all[i]->count,
+            .error = all[i]->error,
+        };
+    }
+
+    pthread_spin_unlock(&t->lock);
+    free(all);
+
+    return n;
+}
+
+void topk_dump_stats(struct topk const * t)
+{
+    printf("counters: %d/%d\n", t->len, t->k);
+    printf("sample rate: %u\n", t->sample_mask + 1);
+    printf("updates: %lu\n", t->cpt_updates);
+    printf("sampled updates: %lu\n", t->cpt_sampled);
+    printf("evictions: %lu\n", t->cpt_evictions);
+    printf("merges: %lu\n", t->cpt_merges);
+}
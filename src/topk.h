@@ -0,0 +1,46 @@
+#ifndef TOPK_HEADER
+#define TOPK_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Space-Saving heavy hitters tracker (Metwally et al. 2005).
+ *
+ * Keeps k counters, in a min-heap indexed by an open-addressing table.
+ * A key missing once all counters are used takes over the smallest one,
+ * whose count becomes the error of the new key. Any key more frequent
+ * than 1/k of the stream is guaranteed to be tracked.
+ *
+ * Each thread updates its own summary, counting 1 update out of
+ * sample_rate (a power of 2) with a weight of sample_rate. Only sampled
+ * updates take the summary lock, so that a collector can merge the
+ * summaries of all threads while they run */
+struct topk;
+
+struct topk_entry {
+    void const * key;
+    size_t keylen;
+    uint64_t count; /* over-estimated by at most error */
+    uint64_t error;
+};
+
+/* keys longer than max_keylen are not counted */
+struct topk * topk_create(int k, size_t max_keylen, int sample_rate);
+void topk_destroy(struct topk * t);
+void topk_reset(struct topk * t);
+
+/* return -1 if the key is too long */
+int topk_add(struct topk * t, void * key, size_t keylen);
+
+/* add the counters of src to dst, and empty src if reset_src is set:
+ * merging periodically counts each update once.
+ * src may have been created with a shorter max_keylen */
+int topk_merge(struct topk * dst, struct topk * src, int reset_src);
+
+/* fill entries with at most max counters, most frequent first.
+ * Keys point into the summary, and are valid until its next update */
+int topk_list(struct topk * t, struct topk_entry * entries, int max);
+
+void topk_dump_stats(struct topk const * t);
+
+#endif /* TOPK_HEADER */
@@ -0,0 +1,1071 @@
+#define _POSIX_C_SOURCE 200809L /* fdatasync(), openat(), fdopendir() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "sht.h"
+#include "wsht.h"
+
+#define DEFAULT_NUM_LINES 100
+
+/* log files of the table directory: <id>.wal */
+#define LOG_SUFFIX ".wal"
+#define LOG_NAME_MAX 32
+
+/* buffer of each writer, records do not span buffers */
+#define LOG_BUF_SIZE ((size_t) 1 << 20)
+
+#define DEFAULT_COMMIT_INTERVAL_MS 2
+
+/* locks of the keys, power of 2 */
+#define NUM_STRIPES 1024
+
+/* log bytes per entry assumed to size the table when recovering */
+#define RECOVERY_BYTES_PER_ENTRY 64
+
+#define RECORD_ALIGN 8
+
+enum record_op {
+    RECORD_SET = 1,
+    RECORD_REMOVE = 2,
+};
+
+/* followed by the key, the value and zeroed padding to RECORD_ALIGN bytes */
+struct record {
+    uint32_t check; /* of the rest of the record, see record_check() */
+    uint32_t op;
+    uint32_t keylen;
+    uint32_t valuelen;
+    uint64_t lsn;
+};
+
+struct entry {
+    struct entry * prev;
+    struct entry * next;
+
+    uint64_t lsn;    /* of the last record applied */
+    int removed;     /* only while recovering */
+    size_t keylen;
+    size_t valuelen;
+    size_t cap;      /* bytes available at value */
+    uint8_t * value; /* after the key, until it outgrows it */
+    uint8_t key[];
+};
+
+/* operations on the keys of a stripe are serialized by its lock,
+ * which orders their records */
+struct stripe {
+    pthread_spinlock_t lock;
+    uint64_t lsn; /* last given */
+    struct entry * entries;
+} CACHE_ALIGNED;
+
+struct wsht_writer {
+    struct wsht * h;
+    struct wsht_writer * next;
+    uint32_t id;
+    int fd;
+    int error;
+
+    /* records are appended by the owner, which publishes len. The commit
+     * thread writes them out as they come, the owner rewinds the buffer
+     * once full. No lock on the way of the operations */
+    uint8_t * buf;
+    size_t len;
+
+    pthread_mutex_t io_lock; /* written, cpt_bytes and the writes */
+    size_t written;
+
+    /* held across fdatasync(): a sync only returns once the bytes written
+     * before it are durable, even when another thread syncs them */
+    pthread_mutex_t sync_lock;
+    uint64_t synced; /* log bytes durable, compared to cpt_bytes */
+
+    /* stats */
+    uint64_t cpt_records; /* only written by the owner */
+    uint64_t cpt_bytes;   /* under io_lock, log bytes written */
+    uint64_t cpt_syncs;   /* under sync_lock */
+};
+
+struct wsht {
+    int dirfd;
+    struct sht * sht;
+    int commit_interval_ms;
+
+    pthread_mutex_t lock; /* writers, next_log_id and the totals */
+    struct wsht_writer * writers;
+    uint32_t next_log_id;
+
+    pthread_t thread;
+    int started;
+    int stop;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+
+    /* stats, of the writers destroyed */
+    uint64_t cpt_records;
+    uint64_t cpt_bytes;
+    uint64_t cpt_syncs;
+    uint64_t cpt_logs;
+
+    /* stats of the recovery */
+    uint64_t cpt_replayed_logs;
+    uint64_t cpt_replayed_records;
+    uint64_t cpt_torn_logs;
+    uint64_t cpt_recovery_ns;
+
+    struct stripe stripes[NUM_STRIPES];
+};
+
+static inline
+struct stripe * stripe_of(struct wsht * h, void const * key, size_t keylen)
+{
+    return &h->stripes[oat_hash(VOIDPTR(key), keylen) & (NUM_STRIPES - 1)];
+}
+
+static inline
+size_t record_size(size_t keylen, size_t valuelen)
+{
+    size_t size = sizeof(struct record) + keylen + valuelen;
+
+    return (size + RECORD_ALIGN - 1) & ~((size_t) RECORD_ALIGN - 1);
+}
+
+/* torn writes detection: multiply-xorshift over the 8 bytes words that
+ * follow check, faster than hashing bytes one at a time */
+static inline
+uint32_t record_check(struct record const * rec)
+{
+    size_t i, n;
+    uint64_t h, word;
+    uint8_t const * p = (uint8_t const *) rec;
+
+    n = record_size(rec->keylen, rec->valuelen) / sizeof(word);
+    h = rec->op;
+    for (i = 1 ; i < n ; i++) {
+        memcpy(&word, p + i * sizeof(word), sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+
+    return h;
+}
+
+/*
+ * Entries
+ */
+
+static struct entry *
+entry_create(void const * key, size_t keylen, void const * value,
+        size_t valuelen)
+{
+    struct entry * e;
+
+    e = malloc(sizeof(*e) + keylen + valuelen);
+    if (e == NULL)
+        return NULL;
+
+    *e = (struct entry) {
+        .keylen = keylen,
+        .valuelen = valuelen,
+        .cap = valuelen,
+    };
+    e->value = e->key + keylen;
+    memcpy(e->key, key, keylen);
+    if (valuelen > 0)
+        memcpy(e->value, value, valuelen);
+
+    return e;
+}
+
+static void
+entry_destroy(struct entry * e)
+{
+    if (e->value != e->key + e->keylen)
+        free(e->value);
+
+    free(e);
+}
+
+static int
+entry_set_value(struct entry * e, void const * value, size_t valuelen)
+{
+    uint8_t * buf;
+
+    if (valuelen > e->cap) {
+        buf = malloc(valuelen);
+        if (buf == NULL)
+            return -1;
+
+        if (e->value != e->key + e->keylen)
+            free(e->value);
+
+        e->value = buf;
+        e->cap = valuelen;
+    }
+
+    if (valuelen > 0)
+        memcpy(e->value, value, valuelen);
+
+    e->valuelen = valuelen;
+
+    return 0;
+}
+
+/* expect the stripe lock to be held */
+static int
+entry_add(struct wsht * h, struct stripe * s, struct entry * e)
+{
+    if (sht_insert(h->sht, e->key, e->keylen, e) != 0)
+        return -1;
+
+    e->prev = NULL;
+    e->next = s->entries;
+    if (s->entries != NULL)
+        s->entries->prev = e;
+
+    s->entries = e;
+
+    return 0;
+}
+
+/* expect the stripe lock to be held */
+static void
+entry_del(struct wsht * h, struct stripe * s, struct entry * e)
+{
+    sht_remove(h->sht, e->key, e->keylen);
+
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        s->entries = e->next;
+
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+}
+
+/*
+ * Logs
+ */
+
+static int
+write_all(int fd, uint8_t const * buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* expect io_lock to be held */
+static int
+writer_write(struct wsht_writer * w)
+{
+    int rv;
+    size_t len;
+
+    rv = 0;
+    len = __atomic_load_n(&w->len, __ATOMIC_ACQUIRE);
+    if (len > w->written) {
+        rv = write_all(w->fd, w->buf + w->written, len - w->written);
+        if (rv == 0) {
+            w->cpt_bytes += len - w->written;
+            w->written = len;
+        }
+    }
+
+    return rv;
+}
+
+/* write out the records of w, then sync the log if sync is set.
+ * Syncs do not hold io_lock: the owner may rewind meanwhile.
+ * Return -1 once the log of w failed */
+static int
+writer_flush(struct wsht_writer * w, int sync)
+{
+    int rv;
+    uint64_t written;
+
+    pthread_mutex_lock(&w->io_lock);
+    rv = writer_write(w);
+    written = w->cpt_bytes;
+    pthread_mutex_unlock(&w->io_lock);
+
+    if (rv == 0 && sync) {
+        pthread_mutex_lock(&w->sync_lock);
+        if (w->synced < written) {
+            rv = fdatasync(w->fd);
+            if (rv == 0) {
+                w->synced = written;
+                w->cpt_syncs++;
+            }
+        }
+
+        pthread_mutex_unlock(&w->sync_lock);
+    }
+
+    if (rv != 0)
+        __atomic_store_n(&w->error, 1, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&w->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+/* make room for a record of size bytes in the buffer of w */
+static int
+writer_reserve(struct wsht_writer * w, size_t size)
+{
+    int rv;
+
+    if (unlikely(__atomic_load_n(&w->error, __ATOMIC_RELAXED)))
+        return -1;
+
+    if (likely(LOG_BUF_SIZE - w->len >= size))
+        return 0;
+
+    pthread_mutex_lock(&w->io_lock);
+    rv = writer_write(w);
+    if (rv == 0) {
+        w->written = 0;
+        __atomic_store_n(&w->len, 0, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&w->io_lock);
+
+    if (rv != 0)
+        __atomic_store_n(&w->error, 1, __ATOMIC_RELAXED);
+
+    return rv;
+}
+
+static void
+writer_append(struct wsht_writer * w, enum record_op op, uint64_t lsn,
+        void const * key, size_t keylen, void const * value,
+        size_t valuelen)
+{
+    size_t size;
+    uint8_t * p;
+    struct record * rec;
+
+    size = record_size(keylen, valuelen);
+
+    p = w->buf + w->len;
+    rec = (struct record *) p;
+    *rec = (struct record) {
+        .op = op,
+        .keylen = keylen,
+        .valuelen = valuelen,
+        .lsn = lsn,
+    };
+
+    p += sizeof(*rec);
+    memcpy(p, key, keylen);
+    p += keylen;
+    if (valuelen > 0)
+        memcpy(p, value, valuelen);
+
+    p += valuelen;
+    memset(p, 0, w->buf + w->len + size - p);
+
+    rec->check = record_check(rec);
+    __atomic_store_n(&w->len, w->len + size, __ATOMIC_RELEASE);
+
+    w->cpt_records++;
+}
+
+static void *
+commit_thread(void * arg)
+{
+    struct wsht * h = arg;
+    struct wsht_writer * w;
+    struct timespec ts;
+
+    pthread_mutex_lock(&h->stop_lock);
+    while (!h->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += h->commit_interval_ms / 1000;
+        ts.tv_nsec += (h->commit_interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&h->stop_cond, &h->stop_lock, &ts);
+        if (h->stop)
+            break;
+
+        pthread_mutex_unlock(&h->stop_lock);
+
+        pthread_mutex_lock(&h->lock);
+        for (w = h->writers ; w != NULL ; w = w->next)
+            writer_flush(w, 1);
+
+        pthread_mutex_unlock(&h->lock);
+
+        pthread_mutex_lock(&h->stop_lock);
+    }
+
+    pthread_mutex_unlock(&h->stop_lock);
+    return h;
+}
+
+struct wsht_writer * wsht_writer_create(struct wsht * h)
+{
+    struct wsht_writer * w;
+    char name[LOG_NAME_MAX];
+
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+
+    w->h = h;
+    w->fd = -1;
+    w->buf = malloc(LOG_BUF_SIZE);
+    if (w->buf == NULL)
+        goto err;
+
+    pthread_mutex_lock(&h->lock);
+    w->id = h->next_log_id++;
+    pthread_mutex_unlock(&h->lock);
+
+    snprintf(name, sizeof(name), "%u" LOG_SUFFIX, w->id);
+    w->fd = openat(h->dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND,
+            0644);
+    if (w->fd < 0)
+        goto err;
+
+    /* the log itself must survive a crash */
+    if (fsync(h->dirfd) != 0) {
+        close(w->fd);
+        unlinkat(h->dirfd, name, 0);
+        goto err;
+    }
+
+    pthread_mutex_init(&w->io_lock, NULL);
+    pthread_mutex_init(&w->sync_lock, NULL);
+
+    pthread_mutex_lock(&h->lock);
+    w->next = h->writers;
+    h->writers = w;
+    h->cpt_logs++;
+    pthread_mutex_unlock(&h->lock);
+
+    return w;
+
+err:
+    free(w->buf);
+    free(w);
+    return NULL;
+}
+
+void wsht_writer_destroy(struct wsht_writer * w)
+{
+    struct wsht * h;
+    struct wsht_writer ** link;
+    char name[LOG_NAME_MAX];
+
+    if (w == NULL)
+        return;
+
+    h = w->h;
+    pthread_mutex_lock(&h->lock);
+    for (link = &h->writers ; *link != w ; link = &(*link)->next)
+        ;
+
+    *link = w->next;
+    pthread_mutex_unlock(&h->lock);
+
+    writer_flush(w, 1);
+    close(w->fd);
+
+    /* nothing to replay */
+    if (w->cpt_bytes == 0) {
+        snprintf(name, sizeof(name), "%u" LOG_SUFFIX, w->id);
+        unlinkat(h->dirfd, name, 0);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->cpt_records += w->cpt_records;
+    h->cpt_bytes += w->cpt_bytes;
+    h->cpt_syncs += w->cpt_syncs;
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_mutex_destroy(&w->sync_lock);
+    pthread_mutex_destroy(&w->io_lock);
+    free(w->buf);
+    free(w);
+}
+
+int wsht_sync(struct wsht_writer * w)
+{
+    return writer_flush(w, 1);
+}
+
+/*
+ * Operations
+ */
+
+static int
+wsht_set(struct wsht_writer * w, void const * key, size_t keylen,
+        void const * value, size_t valuelen, int replace)
+{
+    int rv;
+    uint64_t lsn;
+    struct entry * e;
+    struct stripe * s;
+    struct wsht * h = w->h;
+
+    if (unlikely(key == NULL || keylen == 0
+                || (value == NULL && valuelen > 0)))
+        return -1;
+
+    if (unlikely(keylen > LOG_BUF_SIZE || valuelen > LOG_BUF_SIZE
+                || record_size(keylen, valuelen) > LOG_BUF_SIZE))
+        return -1;
+
+    if (unlikely(writer_reserve(w, record_size(keylen, valuelen)) != 0))
+        return -1;
+
+    rv = -1;
+    lsn = 0;
+    s = stripe_of(h, key, keylen);
+    pthread_spin_lock(&s->lock);
+
+    e = sht_lookup(h->sht, VOIDPTR(key), keylen);
+    if (e == NULL) {
+        e = entry_create(key, keylen, value, valuelen);
+        if (unlikely(e == NULL))
+            goto exit;
+
+        if (unlikely(entry_add(h, s, e) != 0)) {
+            entry_destroy(e);
+            goto exit;
+        }
+    } else if (!replace || entry_set_value(e, value, valuelen) != 0) {
+        goto exit;
+    }
+
+    rv = 0;
+    lsn = ++s->lsn;
+    e->lsn = lsn;
+
+exit:
+    pthread_spin_unlock(&s->lock);
+
+    if (rv == 0)
+        writer_append(w, RECORD_SET, lsn, key, keylen, value, valuelen);
+
+    return rv;
+}
+
+int wsht_insert(struct wsht_writer * w, void const * key, size_t keylen,
+        void const * value, size_t valuelen)
+{
+    return wsht_set(w, key, keylen, value, valuelen, 0);
+}
+
+int wsht_upsert(struct wsht_writer * w, void const * key, size_t keylen,
+        void const * value, size_t valuelen)
+{
+    return wsht_set(w, key, keylen, value, valuelen, 1);
+}
+
+int wsht_remove(struct wsht_writer * w, void const * key, size_t keylen)
+{
+    uint64_t lsn;
+    struct entry * e;
+    struct stripe * s;
+    struct wsht * h = w->h;
+
+    if (unlikely(key == NULL || keylen == 0 || keylen > LOG_BUF_SIZE
+                || record_size(keylen, 0) > LOG_BUF_SIZE))
+        return -1;
+
+    if (unlikely(writer_reserve(w, record_size(keylen, 0)) != 0))
+        return -1;
+
+    s = stripe_of(h, key, keylen);
+    pthread_spin_lock(&s->lock);
+
+    e = sht_lookup(h->sht, VOIDPTR(key), keylen);
+    if (e == NULL) {
+        pthread_spin_unlock(&s->lock);
+        return -1;
+    }
+
+    entry_del(h, s, e);
+    lsn = ++s->lsn;
+    pthread_spin_unlock(&s->lock);
+
+    entry_destroy(e);
+    writer_append(w, RECORD_REMOVE, lsn, key, keylen, NULL, 0);
+
+    return 0;
+}
+
+int wsht_lookup(struct wsht * h, void const * key, size_t keylen,
+        void * value, size_t * valuelen)
+{
+    struct entry * e;
+    struct stripe * s;
+
+    if (unlikely(key == NULL || keylen == 0))
+        return -1;
+
+    s = stripe_of(h, key, keylen);
+    pthread_spin_lock(&s->lock);
+
+    e = sht_lookup(h->sht, VOIDPTR(key), keylen);
+    if (e != NULL && valuelen != NULL) {
+        if (e->valuelen > 0)
+            memcpy(value, e->value, MIN(*valuelen, e->valuelen));
+
+        *valuelen = e->valuelen;
+    }
+
+    pthread_spin_unlock(&s->lock);
+
+    return e != NULL ? 0 : -1;
+}
+
+/*
+ * Recovery
+ *
+ * Each thread replays whole logs, taken in turn. A record is applied if
+ * it is more recent than the last one applied to its key: removes leave
+ * an entry behind, so that an older record of another log does not bring
+ * the key back. These are dropped once every log is replayed.
+ */
+
+struct recovery {
+    struct wsht * h;
+    uint32_t * ids;
+    int num_logs;
+    int next; /* next log to replay */
+};
+
+struct recovery_thread {
+    struct recovery * r;
+    pthread_t thread;
+    int error;
+    uint64_t max_lsn;
+    uint64_t records;
+    uint64_t torn_logs;
+};
+
+static int
+recovery_apply(struct wsht * h, struct record const * rec)
+{
+    int rv;
+    struct entry * e;
+    struct stripe * s;
+    uint8_t const * key = (uint8_t const *) (rec + 1);
+    uint8_t const * value = key + rec->keylen;
+    size_t valuelen = (rec->op == RECORD_SET) ? rec->valuelen : 0;
+
+    rv = 0;
+    s = stripe_of(h, key, rec->keylen);
+    pthread_spin_lock(&s->lock);
+
+    e = sht_lookup(h->sht, VOIDPTR(key), rec->keylen);
+    if (e == NULL) {
+        e = entry_create(key, rec->keylen, value, valuelen);
+        if (e == NULL) {
+            rv = -1;
+            goto exit;
+        }
+
+        if (entry_add(h, s, e) != 0) {
+            entry_destroy(e);
+            rv = -1;
+            goto exit;
+        }
+    } else if (rec->lsn < e->lsn) {
+        goto exit;
+    } else if (entry_set_value(e, value, valuelen) != 0) {
+        rv = -1;
+        goto exit;
+    }
+
+    e->lsn = rec->lsn;
+    e->removed = (rec->op == RECORD_REMOVE);
+
+exit:
+    pthread_spin_unlock(&s->lock);
+
+    return rv;
+}
+
+/* replay the records of a log up to the first one torn by a crash */
+static int
+recovery_replay(struct recovery_thread * t, uint32_t id)
+{
+    int fd, rv;
+    size_t off, size;
+    uint8_t * base;
+    struct stat st;
+    struct record const * rec;
+    char name[LOG_NAME_MAX];
+
+    snprintf(name, sizeof(name), "%u" LOG_SUFFIX, id);
+    fd = openat(t->r->h->dirfd, name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    posix_madvise(base, size, POSIX_MADV_SEQUENTIAL);
+
+    rv = 0;
+    off = 0;
+    while (off < size) {
+        rec = (struct record const *) (base + off);
+        if (size - off < sizeof(*rec) || rec->keylen == 0
+                || (rec->op != RECORD_SET && rec->op != RECORD_REMOVE)
+                || (uint64_t) rec->keylen + rec->valuelen
+                    > size - off - sizeof(*rec)
+                || record_size(rec->keylen, rec->valuelen) > size - off
+                || rec->check != record_check(rec)) {
+            t->torn_logs++;
+            break;
+        }
+
+        rv = recovery_apply(t->r->h, rec);
+        if (rv != 0)
+            break;
+
+        t->max_lsn = MAX(t->max_lsn, rec->lsn);
+        t->records++;
+        off += record_size(rec->keylen, rec->valuelen);
+    }
+
+    munmap(base, size);
+
+    return rv;
+}
+
+static void *
+recovery_thread(void * arg)
+{
+    int i;
+    struct recovery_thread * t = arg;
+
+    while (!t->error) {
+        i = __atomic_fetch_add(&t->r->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->r->num_logs)
+            break;
+
+        t->error = recovery_replay(t, t->r->ids[i]);
+    }
+
+    return t;
+}
+
+/* list the logs of the directory, and their total size */
+static int
+recovery_list(struct wsht * h, struct recovery * r, uint64_t * bytes)
+{
+    int fd, cap;
+    DIR * dir;
+    char * end;
+    uint32_t * ids;
+    struct stat st;
+    unsigned long id;
+    struct dirent * d;
+
+    fd = dup(h->dirfd);
+    if (fd < 0)
+        return -1;
+
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    cap = 0;
+    *bytes = 0;
+    while ((d = readdir(dir)) != NULL) {
+        errno = 0;
+        id = strtoul(d->d_name, &end, 10);
+        if (end == d->d_name || errno != 0 || id > UINT32_MAX
+                || strcmp(end, LOG_SUFFIX) != 0)
+            continue;
+
+        if (r->num_logs == cap) {
+            cap = MAX(2 * cap, 16);
+            ids = realloc(r->ids, cap * sizeof(*ids));
+            if (ids == NULL)
+                goto err;
+
+            r->ids = ids;
+        }
+
+        if (fstatat(h->dirfd, d->d_name, &st, 0) == 0)
+            *bytes += st.st_size;
+
+        r->ids[r->num_logs++] = id;
+        h->next_log_id = MAX(h->next_log_id, id + 1);
+    }
+
+    closedir(dir);
+    return 0;
+
+err:
+    closedir(dir);
+    return -1;
+}
+
+/* drop the keys removed, and resume the sequence numbers after the last */
+static void
+recovery_finish(struct wsht * h, uint64_t max_lsn)
+{
+    int i;
+    struct stripe * s;
+    struct entry * e, * next;
+
+    for (i = 0 ; i < NUM_STRIPES ; i++) {
+        s = &h->stripes[i];
+        s->lsn = max_lsn;
+        for (e = s->entries ; e != NULL ; e = next) {
+            next = e->next;
+            if (e->removed) {
+                entry_del(h, s, e);
+                entry_destroy(e);
+            }
+        }
+    }
+}
+
+static int
+recovery_run(struct wsht * h, int64_t size, int num_threads)
+{
+    int i, rv, started;
+    uint64_t bytes, max_lsn, start_ns;
+    struct timespec ts;
+    struct recovery r = { .h = h };
+    struct recovery_thread * threads;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if (recovery_list(h, &r, &bytes) != 0) {
+        free(r.ids);
+        return -1;
+    }
+
+    /* sized once, no resize while replaying */
+    if (size <= 0)
+        size = MAX(bytes / RECOVERY_BYTES_PER_ENTRY, DEFAULT_NUM_LINES);
+
+    h->sht = sht_create_ext(size, 0, NULL, NULL, NULL);
+    if (h->sht == NULL) {
+        free(r.ids);
+        return -1;
+    }
+
+    num_threads = MAX(MIN(num_threads, r.num_logs), 1);
+    threads = calloc(num_threads, sizeof(*threads));
+    if (threads == NULL) {
+        free(r.ids);
+        return -1;
+    }
+
+    /* the calling thread replays too */
+    started = 0;
+    for (i = 0 ; i < num_threads ; i++) {
+        threads[i].r = &r;
+        if (i > 0 && pthread_create(&threads[i].thread, NULL,
+                    recovery_thread, &threads[i]) != 0)
+            break;
+
+        started++;
+    }
+
+    recovery_thread(&threads[0]);
+
+    rv = 0;
+    max_lsn = 0;
+    for (i = 0 ; i < started ; i++) {
+        if (i > 0)
+            pthread_join(threads[i].thread, NULL);
+
+        rv |= threads[i].error;
+        max_lsn = MAX(max_lsn, threads[i].max_lsn);
+        h->cpt_replayed_records += threads[i].records;
+        h->cpt_torn_logs += threads[i].torn_logs;
+    }
+
+    h->cpt_replayed_logs = r.num_logs;
+    recovery_finish(h, max_lsn);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h->cpt_recovery_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec - start_ns;
+
+    free(threads);
+    free(r.ids);
+
+    return rv;
+}
+
+/*
+ * Table
+ */
+
+static void
+stripes_destroy(struct wsht * h)
+{
+    int i;
+    struct entry * e, * next;
+
+    for (i = 0 ; i < NUM_STRIPES ; i++) {
+        for (e = h->stripes[i].entries ; e != NULL ; e = next) {
+            next = e->next;
+            entry_destroy(e);
+        }
+
+        pthread_spin_destroy(&h->stripes[i].lock);
+    }
+}
+
+void wsht_close(struct wsht * h)
+{
+    if (h == NULL)
+        return;
+
+    if (h->started) {
+        pthread_mutex_lock(&h->stop_lock);
+        h->stop = 1;
+        pthread_cond_signal(&h->stop_cond);
+        pthread_mutex_unlock(&h->stop_lock);
+        pthread_join(h->thread, NULL);
+    }
+
+    while (h->writers != NULL)
+        wsht_writer_destroy(h->writers);
+
+    stripes_destroy(h);
+    sht_destroy(h->sht);
+    if (h->dirfd >= 0)
+        close(h->dirfd);
+
+    pthread_cond_destroy(&h->stop_cond);
+    pthread_mutex_destroy(&h->stop_lock);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+struct wsht * wsht_open(char const * dir, int64_t size, int num_threads,
+        int commit_interval_ms)
+{
+    int i;
+    void * mem;
+    struct wsht * h;
+
+    if (dir == NULL)
+        return NULL;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return NULL;
+
+    if (posix_memalign(&mem, CACHELINE_SIZE, sizeof(*h)) != 0)
+        return NULL;
+
+    h = mem;
+    memset(h, 0, sizeof(*h));
+    h->dirfd = -1;
+    h->commit_interval_ms = commit_interval_ms > 0 ? commit_interval_ms
+        : DEFAULT_COMMIT_INTERVAL_MS;
+
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_mutex_init(&h->stop_lock, NULL);
+    pthread_cond_init(&h->stop_cond, NULL);
+    for (i = 0 ; i < NUM_STRIPES ; i++)
+        pthread_spin_init(&h->stripes[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+    h->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (h->dirfd < 0)
+        goto err;
+
+    if (recovery_run(h, size, num_threads) != 0)
+        goto err;
+
+    if (pthread_create(&h->thread, NULL, commit_thread, h) != 0)
+        goto err;
+
+    h->started = 1;
+
+    return h;
+
+err:
+    wsht_close(h);
+    return NULL;
+}
+
+void wsht_dump_stats(struct wsht * h)
+{
+    struct wsht_writer * w;
+    uint64_t records, bytes, syncs;
+
+    pthread_mutex_lock(&h->lock);
+    records = h->cpt_records;
+    bytes = h->cpt_bytes;
+    syncs = h->cpt_syncs;
+    for (w = h->writers ; w != NULL ; w = w->next) {
+        records += w->cpt_records;
+        pthread_mutex_lock(&w->io_lock);
+        bytes += w->cpt_bytes;
+        pthread_mutex_unlock(&w->io_lock);
+        pthread_mutex_lock(&w->sync_lock);
+        syncs += w->cpt_syncs;
+        pthread_mutex_unlock(&w->sync_lock);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    printf("logs created: %lu\n", h->cpt_logs);
+    printf("records logged: %lu\n", records);
+    printf("bytes logged: %lu\n", bytes);
+    printf("log syncs: %lu\n", syncs);
+    printf("logs replayed: %lu\n", h->cpt_replayed_logs);
+    printf("records replayed: %lu\n", h->cpt_replayed_records);
+    printf("torn logs: %lu\n", h->cpt_torn_logs);
+    printf("recovery time (ms): %lu\n", h->cpt_recovery_ns / 1000000);
+    sht_dump_stats(h->sht);
+}
@@ -0,0 +1,55 @@
+#ifndef WRITE_AHEAD_LOGGED_HASHTABLE_HEADER
+#define WRITE_AHEAD_LOGGED_HASHTABLE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* durable table: an sht whose changes are appended to write-ahead logs
+ * in a directory, and replayed into the table when it is opened again.
+ *
+ * Each writer appends to its own log file, through a buffer written out
+ * and synced with fdatasync() by a commit thread every commit interval:
+ * the operations of an interval are made durable together (group commit).
+ * wsht_sync() waits until the operations of a writer are durable.
+ *
+ * Operations on the same key are ordered by a sequence number (LSN),
+ * recovery keeps the latest record of each key whatever its log. After a
+ * crash, each key is in a state it had, the operations not synced yet may
+ * be lost. Keys and values are copied, in the native byte order.
+ * Logs are only appended to, never compacted */
+struct wsht;
+struct wsht_writer;
+
+/* open the table logged in dir, created if needed. Its logs are replayed
+ * by num_threads threads into a table of size lines, or sized from the
+ * logs if size <= 0. commit_interval_ms <= 0 selects the default (2ms) */
+struct wsht * wsht_open(char const * dir, int64_t size, int num_threads,
+        int commit_interval_ms);
+/* sync and destroy what remains of the writers */
+void wsht_close(struct wsht * h);
+
+/* a writer is used by a single thread, each one appends to a new log */
+struct wsht_writer * wsht_writer_create(struct wsht * h);
+void wsht_writer_destroy(struct wsht_writer * w);
+
+/* record sizes are limited to 1MB, key and value included.
+ * Writes fail once the log of their writer could not be written */
+
+/* fails if the key is already present */
+int wsht_insert(struct wsht_writer * w, void const * key, size_t keylen,
+        void const * value, size_t valuelen);
+/* insert, or replace the value */
+int wsht_upsert(struct wsht_writer * w, void const * key, size_t keylen,
+        void const * value, size_t valuelen);
+int wsht_remove(struct wsht_writer * w, void const * key, size_t keylen);
+
+/* copy at most *valuelen bytes of the value, and set *valuelen to its size */
+int wsht_lookup(struct wsht * h, void const * key, size_t keylen,
+        void * value, size_t * valuelen);
+
+/* write out and sync the log of w, return -1 on error */
+int wsht_sync(struct wsht_writer * w);
+
+void wsht_dump_stats(struct wsht * h);
+
+#endif /* WRITE_AHEAD_LOGGED_HASHTABLE_HEADER */
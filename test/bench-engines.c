@@ -0,0 +1,620 @@
+#define _POSIX_C_SOURCE 200809L /* pthread barriers, mkdtemp() */
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "dsht.h"
+#include "psht.h"
+#include "sht.h"
+#include "wsht.h"
+
+/*
+ * sht, locked
+ */
+
+static alloc_fn
+engine_alloc(void)
+{
+    return bench_alloc_enabled ? bench_alloc : NULL;
+}
+
+static free_fn
+engine_free(void)
+{
+    return bench_alloc_enabled ? bench_free : NULL;
+}
+
+static void *
+sht_engine_create(int64_t size, int num_threads)
+{
+    (void) num_threads;
+    return sht_create_custom(size, engine_alloc(), engine_free(), NULL);
+}
+
+/* nodes come from mmap()ed slabs, only the lines go through the hooks:
+ * the engine is not flagged BENCH_ENGINE_ALLOC_HOOKS, sht_get_stats()
+ * reports the slab bytes */
+static void *
+slab_engine_create(int64_t size, int num_threads)
+{
+    (void) num_threads;
+    return sht_create_ext(size, SHT_F_SLAB, engine_alloc(), engine_free(),
+            NULL);
+}
+
+static void
+sht_engine_destroy(void * table)
+{
+    sht_destroy(table);
+}
+
+static int
+sht_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    return sht_insert(handle, key, keylen, value);
+}
+
+static void *
+sht_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    return sht_lookup(handle, key, keylen);
+}
+
+static int
+sht_engine_remove(void * handle, void * key, size_t keylen)
+{
+    return sht_remove(handle, key, keylen);
+}
+
+static void *
+sht_engine_lookup_insert(void * handle, void * key, size_t keylen,
+        void * value)
+{
+    return sht_lookup_insert(handle, key, keylen, value);
+}
+
+/*
+ * sht, single writer and lock-free readers.
+ * Thread 0 is the writer, the others are readers going through a
+ * quiescent state after each lookup
+ */
+
+struct swmr_handle {
+    struct sht * h;
+    int reader; /* -1 for the writer */
+};
+
+static void *
+swmr_engine_create(int64_t size, int num_threads)
+{
+    (void) num_threads;
+    return sht_create_ext(size, SHT_F_SWMR, engine_alloc(), engine_free(),
+            NULL);
+}
+
+static void *
+swmr_engine_attach(void * table, int id)
+{
+    struct swmr_handle * sh;
+
+    sh = malloc(sizeof(*sh));
+    if (sh == NULL)
+        return NULL;
+
+    sh->h = table;
+    sh->reader = -1;
+    if (id != 0) {
+        sh->reader = sht_reader_register(sh->h);
+        if (sh->reader < 0) {
+            free(sh);
+            return NULL;
+        }
+    }
+
+    return sh;
+}
+
+static void
+swmr_engine_detach(void * handle)
+{
+    struct swmr_handle * sh = handle;
+
+    if (sh->reader >= 0)
+        sht_reader_unregister(sh->h, sh->reader);
+
+    free(sh);
+}
+
+static int
+swmr_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    struct swmr_handle * sh = handle;
+
+    return sht_insert(sh->h, key, keylen, value);
+}
+
+static void *
+swmr_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    void * value;
+    struct swmr_handle * sh = handle;
+
+    value = sht_lookup(sh->h, key, keylen);
+    if (sh->reader >= 0)
+        sht_reader_quiescent(sh->h, sh->reader);
+
+    return value;
+}
+
+static int
+swmr_engine_remove(void * handle, void * key, size_t keylen)
+{
+    struct swmr_handle * sh = handle;
+
+    return sht_remove(sh->h, key, keylen);
+}
+
+static void *
+swmr_engine_lookup_insert(void * handle, void * key, size_t keylen,
+        void * value)
+{
+    struct swmr_handle * sh = handle;
+
+    return sht_lookup_insert(sh->h, key, keylen, value);
+}
+
+/*
+ * naive baseline: an unsynchronized sht behind a global mutex
+ */
+
+struct mutex_table {
+    pthread_mutex_t lock;
+    struct sht * h;
+};
+
+static void *
+mutex_engine_create(int64_t size, int num_threads)
+{
+    struct mutex_table * t;
+
+    (void) num_threads;
+
+    t = malloc(sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    t->h = sht_create_ext(size, SHT_F_NOSYNC, engine_alloc(), engine_free(),
+            NULL);
+    if (t->h == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_init(&t->lock, NULL);
+
+    return t;
+}
+
+static void
+mutex_engine_destroy(void * table)
+{
+    struct mutex_table * t = table;
+
+    pthread_mutex_destroy(&t->lock);
+    sht_destroy(t->h);
+    free(t);
+}
+
+static int
+mutex_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    int rv;
+    struct mutex_table * t = handle;
+
+    pthread_mutex_lock(&t->lock);
+    rv = sht_insert(t->h, key, keylen, value);
+    pthread_mutex_unlock(&t->lock);
+
+    return rv;
+}
+
+static void *
+mutex_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    void * value;
+    struct mutex_table * t = handle;
+
+    pthread_mutex_lock(&t->lock);
+    value = sht_lookup(t->h, key, keylen);
+    pthread_mutex_unlock(&t->lock);
+
+    return value;
+}
+
+static int
+mutex_engine_remove(void * handle, void * key, size_t keylen)
+{
+    int rv;
+    struct mutex_table * t = handle;
+
+    pthread_mutex_lock(&t->lock);
+    rv = sht_remove(t->h, key, keylen);
+    pthread_mutex_unlock(&t->lock);
+
+    return rv;
+}
+
+static void *
+mutex_engine_lookup_insert(void * handle, void * key, size_t keylen,
+        void * value)
+{
+    struct mutex_table * t = handle;
+
+    pthread_mutex_lock(&t->lock);
+    value = sht_lookup_insert(t->h, key, keylen, value);
+    pthread_mutex_unlock(&t->lock);
+
+    return value;
+}
+
+/*
+ * psht: keys and values are copied into an anonymous shared region.
+ * The value stored is the key pointer, so that lookups return it
+ */
+
+/* region bytes per expected key */
+#define PSHT_BYTES_PER_KEY 256
+#define PSHT_MIN_MEM_SIZE (1 << 20)
+
+static void *
+psht_engine_create(int64_t size, int num_threads)
+{
+    (void) num_threads;
+
+    size = MAX(size, 1);
+    return psht_create(NULL, MIN(size, INT_MAX),
+            PSHT_MIN_MEM_SIZE + (size_t) size * PSHT_BYTES_PER_KEY);
+}
+
+static void
+psht_engine_destroy(void * table)
+{
+    psht_close(table);
+}
+
+static int
+psht_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    return psht_insert(handle, key, keylen, &value, sizeof(value));
+}
+
+static void *
+psht_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    void * value;
+    size_t valuelen = sizeof(value);
+
+    if (psht_lookup(handle, key, keylen, &value, &valuelen) != 0)
+        return NULL;
+
+    return value;
+}
+
+static int
+psht_engine_remove(void * handle, void * key, size_t keylen)
+{
+    return psht_remove(handle, key, keylen);
+}
+
+/*
+ * dsht: one server thread per 2 client threads, a client per thread
+ */
+
+static void *
+dsht_engine_create(int64_t size, int num_threads)
+{
+    int num_shards = MAX(num_threads / 2, 1);
+
+    size = MIN(size / num_shards, INT_MAX);
+    return dsht_create(num_shards, num_threads, size, NULL);
+}
+
+static void
+dsht_engine_destroy(void * table)
+{
+    dsht_destroy(table);
+}
+
+static void *
+dsht_engine_attach(void * table, int id)
+{
+    (void) id;
+    return dsht_client_create(table);
+}
+
+static void
+dsht_engine_detach(void * handle)
+{
+    dsht_client_destroy(handle);
+}
+
+static int
+dsht_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    return dsht_insert(handle, key, keylen, value);
+}
+
+static void *
+dsht_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    return dsht_lookup(handle, key, keylen);
+}
+
+static int
+dsht_engine_remove(void * handle, void * key, size_t keylen)
+{
+    return dsht_remove(handle, key, keylen);
+}
+
+static void *
+dsht_engine_lookup_insert(void * handle, void * key, size_t keylen,
+        void * value)
+{
+    return dsht_lookup_insert(handle, key, keylen, value);
+}
+
+/*
+ * wsht: logs in a temporary directory, a writer per thread.
+ * The value stored is the key pointer, so that lookups return it
+ */
+
+struct wsht_table {
+    struct wsht * h;
+    char dir[32];
+};
+
+struct wsht_handle {
+    struct wsht * h;
+    struct wsht_writer * w;
+};
+
+static void *
+wsht_engine_create(int64_t size, int num_threads)
+{
+    struct wsht_table * t;
+
+    (void) num_threads;
+
+    t = malloc(sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    strcpy(t->dir, "/tmp/ix-bench-wsht-XXXXXX");
+    if (mkdtemp(t->dir) == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    t->h = wsht_open(t->dir, size, 1, 0);
+    if (t->h == NULL) {
+        rmdir(t->dir);
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+static void
+wsht_engine_destroy(void * table)
+{
+    DIR * d;
+    struct dirent * e;
+    struct wsht_table * t = table;
+
+    wsht_close(t->h);
+
+    d = opendir(t->dir);
+    if (d != NULL) {
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] != '.')
+                unlinkat(dirfd(d), e->d_name, 0);
+        }
+
+        closedir(d);
+    }
+
+    rmdir(t->dir);
+    free(t);
+}
+
+static void *
+wsht_engine_attach(void * table, int id)
+{
+    struct wsht_handle * handle;
+    struct wsht_table * t = table;
+
+    (void) id;
+
+    handle = malloc(sizeof(*handle));
+    if (handle == NULL)
+        return NULL;
+
+    handle->h = t->h;
+    handle->w = wsht_writer_create(t->h);
+    if (handle->w == NULL) {
+        free(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+static void
+wsht_engine_detach(void * handle)
+{
+    struct wsht_handle * wh = handle;
+
+    wsht_writer_destroy(wh->w);
+    free(wh);
+}
+
+static int
+wsht_engine_insert(void * handle, void * key, size_t keylen, void * value)
+{
+    struct wsht_handle * wh = handle;
+
+    return wsht_insert(wh->w, key, keylen, &value, sizeof(value));
+}
+
+static void *
+wsht_engine_lookup(void * handle, void * key, size_t keylen)
+{
+    void * value;
+    size_t valuelen = sizeof(value);
+    struct wsht_handle * wh = handle;
+
+    if (wsht_lookup(wh->h, key, keylen, &value, &valuelen) != 0)
+        return NULL;
+
+    return value;
+}
+
+static int
+wsht_engine_remove(void * handle, void * key, size_t keylen)
+{
+    struct wsht_handle * wh = handle;
+
+    return wsht_remove(wh->w, key, keylen);
+}
+
+struct bench_engine const bench_engines[] = {
+    {
+        .name = "sht",
+        .flags = BENCH_ENGINE_ALLOC_HOOKS,
+        .create = sht_engine_create,
+        .destroy = sht_engine_destroy,
+        .insert = sht_engine_insert,
+        .lookup = sht_engine_lookup,
+        .remove = sht_engine_remove,
+        .lookup_insert = sht_engine_lookup_insert,
+    },
+    {
+        .name = "sht-slab",
+        .create = slab_engine_create,
+        .destroy = sht_engine_destroy,
+        .insert = sht_engine_insert,
+        .lookup = sht_engine_lookup,
+        .remove = sht_engine_remove,
+        .lookup_insert = sht_engine_lookup_insert,
+    },
+    {
+        .name = "sht-swmr",
+        .flags = BENCH_ENGINE_SINGLE_WRITER | BENCH_ENGINE_ALLOC_HOOKS,
+        .create = swmr_engine_create,
+        .destroy = sht_engine_destroy,
+        .attach = swmr_engine_attach,
+        .detach = swmr_engine_detach,
+        .insert = swmr_engine_insert,
+        .lookup = swmr_engine_lookup,
+        .remove = swmr_engine_remove,
+        .lookup_insert = swmr_engine_lookup_insert,
+    },
+    {
+        .name = "psht",
+        .create = psht_engine_create,
+        .destroy = psht_engine_destroy,
+        .insert = psht_engine_insert,
+        .lookup = psht_engine_lookup,
+        .remove = psht_engine_remove,
+    },
+    {
+        .name = "dsht",
+        .create = dsht_engine_create,
+        .destroy = dsht_engine_destroy,
+        .attach = dsht_engine_attach,
+        .detach = dsht_engine_detach,
+        .insert = dsht_engine_insert,
+        .lookup = dsht_engine_lookup,
+        .remove = dsht_engine_remove,
+        .lookup_insert = dsht_engine_lookup_insert,
+    },
+    {
+        .name = "wsht",
+        .create = wsht_engine_create,
+        .destroy = wsht_engine_destroy,
+        .attach = wsht_engine_attach,
+        .detach = wsht_engine_detach,
+        .insert = wsht_engine_insert,
+        .lookup = wsht_engine_lookup,
+        .remove = wsht_engine_remove,
+    },
+    {
+        .name = "mutex",
+        .flags = BENCH_ENGINE_ALLOC_HOOKS,
+        .create = mutex_engine_create,
+        .destroy = mutex_engine_destroy,
+        .insert = mutex_engine_insert,
+        .lookup = mutex_engine_lookup,
+        .remove = mutex_engine_remove,
+        .lookup_insert = mutex_engine_lookup_insert,
+    },
+};
+int const bench_num_engines = arraylen(bench_engines);
+
+struct bench_engine const * bench_engine_find(char const * name)
+{
+    int i;
+
+    for (i = 0 ; i < bench_num_engines ; i++) {
+        if (strcmp(name, bench_engines[i].name) == 0)
+            return &bench_engines[i];
+    }
+
+    return NULL;
+}
+
+void * bench_engine_attach(struct bench_engine const * e, void * table,
+        int id)
+{
+    return e->attach != NULL ? e->attach(table, id) : table;
+}
+
+void bench_engine_detach(struct bench_engine const * e, void * handle)
+{
+    if (e->detach != NULL && handle != NULL)
+        e->detach(handle);
+}
+
+/* the key is also the value */
+void * bench_engine_op(struct bench_engine const * e, void * handle,
+        enum bench_op op, void * key, size_t keylen)
+{
+    void * value;
+
+    switch (op) {
+    case BENCH_LOOKUP:
+        return e->lookup(handle, key, keylen);
+    case BENCH_INSERT:
+        return e->insert(handle, key, keylen, key) == 0 ? key : NULL;
+    case BENCH_REMOVE:
+        return e->remove(handle, key, keylen) == 0 ? key : NULL;
+    case BENCH_LOOKUP_INSERT:
+    default:
+        if (e->lookup_insert != NULL)
+            return e->lookup_insert(handle, key, keylen, key);
+
+        value = e->lookup(handle, key, keylen);
+        if (value == NULL && e->insert(handle, key, keylen, key) == 0)
+            value = key;
+
+        return value;
+    }
+}
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE /* cpu affinity, syscall() */
+#include <linux/perf_event.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * cpu placement
+ */
+
+static char const * const placement_names[] = {
+    [BENCH_PLACE_CORE] = "core",
+    [BENCH_PLACE_SMT] = "smt",
+    [BENCH_PLACE_SOCKET] = "socket",
+};
+
+int bench_placement_parse(char const * name, enum bench_placement * p)
+{
+    int i;
+
+    for (i = 0 ; i < arraylen(placement_names) ; i++) {
+        if (strcmp(name, placement_names[i]) == 0) {
+            *p = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+char const * bench_placement_name(enum bench_placement p)
+{
+    return placement_names[p];
+}
+
+struct cpu_topology {
+    int cpu;
+    int core;
+    int package;
+    int core_rank; /* of the core within its package */
+    int smt;       /* of the cpu within its core */
+    uint64_t order;
+};
+
+static int
+read_topology(int cpu, char const * name)
+{
+    int value;
+    FILE * f;
+    char path[128];
+
+    snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    /* unknown topology: every cpu on its own core, in a single package */
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    if (fscanf(f, "%d", &value) != 1)
+        value = -1;
+
+    fclose(f);
+
+    return value;
+}
+
+static int
+topology_cmp(void const * a, void const * b)
+{
+    struct cpu_topology const * ta = a;
+    struct cpu_topology const * tb = b;
+
+    return (ta->order > tb->order) - (ta->order < tb->order);
+}
+
+int bench_cpus(int * cpus, int max, enum bench_placement p)
+{
+    int i, j, n;
+    cpu_set_t set;
+    struct cpu_topology * topo;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return -1;
+
+    topo = calloc(CPU_SETSIZE, sizeof(*topo));
+    if (topo == NULL)
+        return -1;
+
+    n = 0;
+    for (i = 0 ; i < CPU_SETSIZE ; i++) {
+        if (!CPU_ISSET(i, &set))
+            continue;
+
+        topo[n].cpu = i;
+        topo[n].core = read_topology(i, "core_id");
+        topo[n].package = MAX(read_topology(i, "physical_package_id"), 0);
+        if (topo[n].core < 0)
+            topo[n].core = i;
+
+        n++;
+    }
+
+    /* hardware threads of a core are ranked by cpu id */
+    for (i = 0 ; i < n ; i++) {
+        for (j = 0 ; j < i ; j++) {
+            if (topo[j].package == topo[i].package
+                    && topo[j].core == topo[i].core)
+                topo[i].smt++;
+        }
+    }
+
+    /* cores of a package by core id, counting their first thread only */
+    for (i = 0 ; i < n ; i++) {
+        for (j = 0 ; j < n ; j++) {
+            if (topo[j].package == topo[i].package && topo[j].smt == 0
+                    && topo[j].core < topo[i].core)
+                topo[i].core_rank++;
+        }
+    }
+
+    for (i = 0 ; i < n ; i++) {
+        switch (p) {
+        case BENCH_PLACE_SMT:
+            topo[i].order = (uint64_t) topo[i].package << 40
+                | (uint64_t) topo[i].core_rank << 20 | topo[i].smt;
+            break;
+        case BENCH_PLACE_SOCKET:
+            topo[i].order = (uint64_t) topo[i].smt << 40
+                | (uint64_t) topo[i].core_rank << 20 | topo[i].package;
+            break;
+        case BENCH_PLACE_CORE:
+        default:
+            topo[i].order = (uint64_t) topo[i].smt << 40
+                | (uint64_t) topo[i].package << 20 | topo[i].core_rank;
+            break;
+        }
+    }
+
+    qsort(topo, n, sizeof(*topo), topology_cmp);
+
+    n = MIN(n, max);
+    for (i = 0 ; i < n ; i++)
+        cpus[i] = topo[i].cpu;
+
+    free(topo);
+
+    return n;
+}
+
+int bench_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * operation mixes
+ */
+
+struct bench_mix const bench_mixes[] = {
+    /* lookup, insert, remove, lookup-insert */
+    { .name = "read", .percent = {100, 0, 0, 0} },
+    { .name = "read-mostly", .percent = {90, 5, 5, 0} },
+    { .name = "mixed", .percent = {25, 25, 25, 25} },
+    { .name = "write", .percent = {0, 50, 50, 0} },
+};
+int const bench_num_mixes = arraylen(bench_mixes);
+
+struct bench_mix const * bench_mix_find(char const * name)
+{
+    int i;
+
+    for (i = 0 ; i < bench_num_mixes ; i++) {
+        if (strcmp(name, bench_mixes[i].name) == 0)
+            return &bench_mixes[i];
+    }
+
+    return NULL;
+}
+
+int bench_mix_read_only(struct bench_mix const * mix)
+{
+    return mix->percent[BENCH_LOOKUP] == 100;
+}
+
+char const * bench_op_name(enum bench_op op)
+{
+    static char const * const names[] = {
+        [BENCH_LOOKUP] = "lookup",
+        [BENCH_INSERT] = "insert",
+        [BENCH_REMOVE] = "remove",
+        [BENCH_LOOKUP_INSERT] = "lookup-insert",
+    };
+
+    return names[op];
+}
+
+/*
+ * instrumented allocator
+ */
+
+/* keeps the alignment of malloc() */
+#define ALLOC_HEADER_SIZE 16
+
+int bench_alloc_enabled;
+
+static struct bench_alloc_stats alloc_stats[BENCH_NUM_OPS + 1];
+static uint64_t alloc_live;
+static uint64_t alloc_peak;
+
+/* operation type of this thread, and what it allocated so far */
+static __thread enum bench_op alloc_op = BENCH_NUM_OPS;
+static __thread uint64_t alloc_op_bytes;
+
+static void
+atomic_max(uint64_t * ptr, uint64_t value)
+{
+    uint64_t cur = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+
+    while (value > cur && !__atomic_compare_exchange_n(ptr, &cur, value, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void * bench_alloc(size_t size)
+{
+    char * ptr;
+    struct bench_alloc_stats * st = &alloc_stats[alloc_op];
+
+    ptr = malloc(size + ALLOC_HEADER_SIZE);
+    if (ptr == NULL)
+        return NULL;
+
+    *(size_t *) ptr = size;
+
+    __atomic_add_fetch(&st->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->bytes, size, __ATOMIC_RELAXED);
+    alloc_op_bytes += size;
+    atomic_max(&st->peak_bytes, alloc_op_bytes);
+    atomic_max(&alloc_peak,
+            __atomic_add_fetch(&alloc_live, size, __ATOMIC_RELAXED));
+
+    return ptr + ALLOC_HEADER_SIZE;
+}
+
+void bench_free(void * ptr)
+{
+    char * base;
+
+    if (ptr == NULL)
+        return;
+
+    base = (char *) ptr - ALLOC_HEADER_SIZE;
+    __atomic_add_fetch(&alloc_stats[alloc_op].frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&alloc_live, *(size_t *) base, __ATOMIC_RELAXED);
+    free(base);
+}
+
+void bench_alloc_set_op(enum bench_op op)
+{
+    alloc_op = op;
+    alloc_op_bytes = 0;
+}
+
+void bench_alloc_reset(void)
+{
+    memset(alloc_stats, 0, sizeof(alloc_stats));
+    alloc_peak = alloc_live;
+}
+
+uint64_t bench_alloc_stats(struct bench_alloc_stats stats[BENCH_NUM_OPS + 1])
+{
+    memcpy(stats, alloc_stats, sizeof(alloc_stats));
+    return alloc_peak;
+}
+
+uint64_t bench_alloc_live(void)
+{
+    return __atomic_load_n(&alloc_live, __ATOMIC_RELAXED);
+}
+
+uint64_t bench_rss_bytes(void)
+{
+    FILE * f;
+    unsigned long size, resident;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+
+    fclose(f);
+
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * threads
+ */
+
+struct thread_arg {
+    struct bench_threads * t;
+    int id;
+};
+
+static void *
+bench_thread(void * void_arg)
+{
+    struct thread_arg * arg = void_arg;
+    struct bench_threads * t = arg->t;
+
+    if (t->cpus != NULL)
+        bench_pin(t->cpus[arg->id]);
+
+    pthread_barrier_wait(&t->barrier);
+    t->fn(t, arg->id);
+
+    return NULL;
+}
+
+uint64_t bench_threads_run(struct bench_threads * t)
+{
+    int i;
+    uint64_t start;
+    pthread_t * threads;
+    struct thread_arg * args;
+    struct timespec ts;
+
+    threads = calloc(t->num_threads, sizeof(*threads));
+    args = calloc(t->num_threads, sizeof(*args));
+    if (threads == NULL || args == NULL) {
+        free(threads);
+        free(args);
+        return 0;
+    }
+
+    t->stop = 0;
+    pthread_barrier_init(&t->barrier, NULL, t->num_threads + 1);
+
+    for (i = 0 ; i < t->num_threads ; i++) {
+        args[i] = (struct thread_arg) { .t = t, .id = i };
+        if (pthread_create(&threads[i], NULL, bench_thread, &args[i]) != 0) {
+            fprintf(stderr, "cannot start thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&t->barrier);
+    start = bench_now_ns();
+
+    if (t->duration_ns != 0) {
+        ts.tv_sec = t->duration_ns / 1000000000;
+        ts.tv_nsec = t->duration_ns % 1000000000;
+        while (nanosleep(&ts, &ts) != 0)
+            ;
+
+        __atomic_store_n(&t->stop, 1, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0 ; i < t->num_threads ; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_barrier_destroy(&t->barrier);
+    free(threads);
+    free(args);
+
+    return bench_now_ns() - start;
+}
+
+/*
+ * hardware counters
+ */
+
+#define HW_CACHE_READ_MISS(cache) ((cache) \
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct {
+    char const * name;
+    uint32_t type;
+    uint64_t config;
+} const counters[] = {
+    [BENCH_L1D_MISSES] = {
+        "l1d-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D),
+    },
+    [BENCH_LLC_MISSES] = {
+        "llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+    },
+    [BENCH_DTLB_MISSES] = {
+        "dtlb-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB),
+    },
+};
+
+int bench_counters_open(struct bench_counters * c)
+{
+    int i, n;
+    struct perf_event_attr attr;
+
+    n = 0;
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (c->fd[i] >= 0)
+            n++;
+    }
+
+    return n;
+}
+
+void bench_counters_close(struct bench_counters * c)
+{
+    int i;
+
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++) {
+        if (c->fd[i] >= 0)
+            close(c->fd[i]);
+
+        c->fd[i] = -1;
+    }
+}
+
+void bench_counters_start(struct bench_counters * c)
+{
+    int i;
+
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void bench_counters_stop(struct bench_counters * c,
+        uint64_t values[BENCH_NUM_COUNTERS])
+{
+    int i;
+
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++) {
+        values[i] = BENCH_COUNTER_NONE;
+        if (c->fd[i] < 0)
+            continue;
+
+        ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(c->fd[i], &values[i], sizeof(values[i]))
+                != sizeof(values[i]))
+            values[i] = BENCH_COUNTER_NONE;
+    }
+}
+
+char const * bench_counter_name(enum bench_counter counter)
+{
+    return counters[counter].name;
+}
+
+/*
+ * running mean and standard deviation (Welford)
+ */
+
+void bench_stat_add(struct bench_stat * s, double value)
+{
+    double delta = value - s->mean;
+
+    s->n++;
+    s->mean += delta / s->n;
+    s->m2 += delta * (value - s->mean);
+}
+
+double bench_stat_stddev(struct bench_stat const * s)
+{
+    return s->n > 1 ? sqrt(s->m2 / (s->n - 1)) : 0;
+}
+
+/*
+ * latency histograms
+ */
+
+static int
+hist_index(uint64_t value)
+{
+    int shift;
+
+    if (value < BENCH_HIST_SUB)
+        return value;
+
+    /* 16 sub-buckets per power of 2 */
+    shift = 63 - __builtin_clzll(value) - 4;
+    return (shift + 1) * BENCH_HIST_SUB
+        + ((value >> shift) & (BENCH_HIST_SUB - 1));
+}
+
+static uint64_t
+hist_value(int index)
+{
+    int shift, sub;
+
+    if (index < BENCH_HIST_SUB)
+        return index;
+
+    shift = index / BENCH_HIST_SUB - 1;
+    sub = index % BENCH_HIST_SUB;
+
+    return (((uint64_t) BENCH_HIST_SUB + sub) << shift)
+        + ((uint64_t) 1 << shift) - 1;
+}
+
+void bench_hist_record(struct bench_hist * h, uint64_t value)
+{
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->max = MAX(h->max, value);
+}
+
+void bench_hist_merge(struct bench_hist * dst, struct bench_hist const * src)
+{
+    int i;
+
+    for (i = 0 ; i < BENCH_HIST_BUCKETS ; i++)
+        dst->buckets[i] += src->buckets[i];
+
+    dst->count += src->count;
+    dst->max = MAX(dst->max, src->max);
+}
+
+uint64_t bench_hist_percentile(struct bench_hist const * h, double p)
+{
+    int i;
+    uint64_t rank, seen;
+
+    if (h->count == 0)
+        return 0;
+
+    rank = p * h->count / 100;
+    if (rank >= h->count)
+        return h->max;
+
+    seen = 0;
+    for (i = 0 ; i < BENCH_HIST_BUCKETS ; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return MIN(hist_value(i), h->max);
+    }
+
+    return h->max;
+}
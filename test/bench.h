@@ -0,0 +1,240 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* helpers shared by the benchmarks */
+
+uint64_t bench_now_ns(void);
+
+/* xorshift64*, state must not be 0 */
+static inline
+uint64_t bench_rand(uint64_t * state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * cpu placement
+ */
+
+enum bench_placement {
+    BENCH_PLACE_CORE,   /* one thread per core, filling a socket first */
+    BENCH_PLACE_SMT,    /* fill both hardware threads of a core first */
+    BENCH_PLACE_SOCKET, /* one thread per core, alternating sockets */
+};
+
+int bench_placement_parse(char const * name, enum bench_placement * p);
+char const * bench_placement_name(enum bench_placement p);
+
+/* fill cpus with the cpus this process may run on, in the order threads
+ * should be placed on them. Return their number */
+int bench_cpus(int * cpus, int max, enum bench_placement p);
+
+int bench_pin(int cpu);
+
+/*
+ * operation mixes, in percents
+ */
+
+enum bench_op {
+    BENCH_LOOKUP,
+    BENCH_INSERT,
+    BENCH_REMOVE,
+    BENCH_LOOKUP_INSERT,
+    BENCH_NUM_OPS,
+};
+
+struct bench_mix {
+    char const * name;
+    int percent[BENCH_NUM_OPS];
+};
+
+extern struct bench_mix const bench_mixes[];
+extern int const bench_num_mixes;
+
+struct bench_mix const * bench_mix_find(char const * name);
+char const * bench_op_name(enum bench_op op);
+
+static inline
+enum bench_op bench_mix_pick(struct bench_mix const * mix, uint64_t r)
+{
+    int op, p = r % 100;
+
+    for (op = 0 ; op < BENCH_NUM_OPS - 1 ; op++) {
+        p -= mix->percent[op];
+        if (p < 0)
+            break;
+    }
+
+    return op;
+}
+
+/*
+ * engines: the tables under test, behind a common interface.
+ * Defined in bench-engines.c
+ */
+
+#define BENCH_ENGINE_SINGLE_WRITER (1 << 0) /* only one thread modifies it */
+/* allocates all its memory with bench_alloc(). Engines which map some of
+ * it themselves, like the slabs of sht-slab, are not instrumented and
+ * their allocation columns are NAN */
+#define BENCH_ENGINE_ALLOC_HOOKS   (1 << 1)
+
+struct bench_engine {
+    char const * name;
+    int flags;
+
+    /* size is the expected number of keys, num_threads the number of
+     * threads attaching to the table */
+    void * (* create)(int64_t size, int num_threads);
+    void (* destroy)(void * table);
+
+    /* per-thread handle, used by the operations below.
+     * When NULL, the table is its own handle */
+    void * (* attach)(void * table, int id);
+    void (* detach)(void * handle);
+
+    int (* insert)(void * handle, void * key, size_t keylen, void * value);
+    void * (* lookup)(void * handle, void * key, size_t keylen);
+    int (* remove)(void * handle, void * key, size_t keylen);
+    /* a lookup then an insert if NULL */
+    void * (* lookup_insert)(void * handle, void * key, size_t keylen,
+            void * value);
+};
+
+extern struct bench_engine const bench_engines[];
+extern int const bench_num_engines;
+
+struct bench_engine const * bench_engine_find(char const * name);
+
+void * bench_engine_attach(struct bench_engine const * e, void * table,
+        int id);
+void bench_engine_detach(struct bench_engine const * e, void * handle);
+void * bench_engine_op(struct bench_engine const * e, void * handle,
+        enum bench_op op, void * key, size_t keylen);
+
+/* whether the mix is only made of lookups */
+int bench_mix_read_only(struct bench_mix const * mix);
+
+/*
+ * instrumented allocator, for the tables taking allocator hooks once
+ * bench_alloc_enabled is set. Allocations are accounted to the operation
+ * type the calling thread declared, BENCH_NUM_OPS being everything else
+ * (creation, prefill, destruction...)
+ */
+
+struct bench_alloc_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;      /* allocated */
+    uint64_t peak_bytes; /* allocated by a single operation */
+};
+
+extern int bench_alloc_enabled;
+
+void * bench_alloc(size_t size);
+void bench_free(void * ptr);
+
+void bench_alloc_set_op(enum bench_op op);
+void bench_alloc_reset(void);
+/* return the peak of the allocated bytes not freed yet */
+uint64_t bench_alloc_stats(struct bench_alloc_stats stats[BENCH_NUM_OPS + 1]);
+/* allocated bytes not freed yet */
+uint64_t bench_alloc_live(void);
+
+/* resident set size of the process, 0 when unknown */
+uint64_t bench_rss_bytes(void);
+
+/*
+ * threads running for a given time, released at once
+ */
+
+struct bench_threads {
+    int num_threads;
+    int const * cpus;     /* pin thread i on cpus[i], unless NULL */
+    uint64_t duration_ns; /* 0: wait for the threads to return */
+    void (* fn)(struct bench_threads * t, int id);
+    void * arg;
+
+    int stop;
+    pthread_barrier_t barrier;
+};
+
+static inline
+int bench_should_stop(struct bench_threads const * t)
+{
+    return __atomic_load_n(&t->stop, __ATOMIC_RELAXED);
+}
+
+/* return the elapsed time, in ns */
+uint64_t bench_threads_run(struct bench_threads * t);
+
+/*
+ * hardware counters of the calling thread, through perf_event_open().
+ * Counters the kernel refuses read as BENCH_COUNTER_NONE
+ */
+
+enum bench_counter {
+    BENCH_L1D_MISSES,
+    BENCH_LLC_MISSES,
+    BENCH_DTLB_MISSES,
+    BENCH_NUM_COUNTERS,
+};
+
+#define BENCH_COUNTER_NONE UINT64_MAX
+
+struct bench_counters {
+    int fd[BENCH_NUM_COUNTERS];
+};
+
+/* return the number of counters available */
+int bench_counters_open(struct bench_counters * c);
+void bench_counters_close(struct bench_counters * c);
+void bench_counters_start(struct bench_counters * c);
+void bench_counters_stop(struct bench_counters * c,
+        uint64_t values[BENCH_NUM_COUNTERS]);
+char const * bench_counter_name(enum bench_counter counter);
+
+/*
+ * running mean and standard deviation
+ */
+
+struct bench_stat {
+    uint64_t n;
+    double mean;
+    double m2;
+};
+
+void bench_stat_add(struct bench_stat * s, double value);
+double bench_stat_stddev(struct bench_stat const * s);
+
+/*
+ * latency histograms: log-linear buckets, within 1/16 of the value
+ */
+
+#define BENCH_HIST_SUB 16
+#define BENCH_HIST_BUCKETS (61 * BENCH_HIST_SUB)
+
+struct bench_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+};
+
+void bench_hist_record(struct bench_hist * h, uint64_t value);
+void bench_hist_merge(struct bench_hist * dst, struct bench_hist const * src);
+
+/* upper bound of the bucket holding the p-th percentile, p in [0, 100] */
+uint64_t bench_hist_percentile(struct bench_hist const * h, double p);
+
+#endif /* BENCH_H */
@@ -0,0 +1,100 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "dsht.h"
+
+#define NUM_SHARDS 4
+#define NUM_CLIENTS 8
+#define NUM_HT_LINES 10
+#define NUM_KEYS (10 * 1000)
+#define BATCH 32
+
+static struct dsht * h;
+static int keys[NUM_KEYS];
+
+/* all clients lookup_insert all the keys, by batches */
+static void *
+client_thread(void * void_args)
+{
+    int i, n, done, submitted;
+    struct dsht_client * c;
+    struct dsht_response resp[BATCH];
+
+    (void) void_args;
+
+    c = dsht_client_create(h);
+    check(c != NULL);
+
+    submitted = 0;
+    done = 0;
+    while (done < NUM_KEYS) {
+        for (i = 0 ; i < BATCH && submitted < NUM_KEYS ; i++) {
+            if (dsht_submit(c, DSHT_LOOKUP_INSERT, &keys[submitted],
+                        sizeof(keys[submitted]), &keys[submitted],
+                        &keys[submitted]) != 0)
+                break;
+
+            submitted++;
+        }
+
+        n = dsht_poll(c, resp, arraylen(resp));
+        for (i = 0 ; i < n ; i++)
+            check(resp[i].value == resp[i].cookie);
+
+        done += n;
+    }
+
+    dsht_client_destroy(c);
+
+    return NULL;
+}
+
+int main(void)
+{
+    int i, rv;
+    struct dsht_client * c;
+    pthread_t threads[NUM_CLIENTS];
+
+    for (i = 0 ; i < NUM_KEYS ; i++)
+        keys[i] = i;
+
+    h = dsht_create(NUM_SHARDS, NUM_CLIENTS, NUM_HT_LINES, NULL);
+    check(h != NULL);
+
+    for (i = 0 ; i < NUM_CLIENTS ; i++) {
+        rv = pthread_create(&threads[i], NULL, &client_thread, NULL);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_CLIENTS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+    }
+
+    /* test all the entries have been inserted, then remove them */
+    c = dsht_client_create(h);
+    check(c != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        check(dsht_lookup(c, &keys[i], sizeof(keys[i])) == &keys[i]);
+        rv = dsht_remove(c, &keys[i], sizeof(keys[i]));
+        check(rv == 0);
+        check(dsht_lookup(c, &keys[i], sizeof(keys[i])) == NULL);
+    }
+
+    dsht_client_destroy(c);
+
+    printf("### dump delegated hashtable\n");
+    dsht_dump_stats(h);
+
+    dsht_destroy(h);
+
+    return 0;
+}
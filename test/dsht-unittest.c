@@ -0,0 +1,138 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "dsht.h"
+
+static void
+test_creation(void)
+{
+    int i;
+    struct dsht * h;
+    struct dsht_client * c[4];
+
+    h = dsht_create(0, 1, 10, NULL);
+    check(h == NULL);
+
+    h = dsht_create(2, 0, 10, NULL);
+    check(h == NULL);
+
+    h = dsht_create(2, arraylen(c), 10, NULL);
+    check(h != NULL);
+
+    for (i = 0 ; i < arraylen(c) ; i++) {
+        c[i] = dsht_client_create(h);
+        check(c[i] != NULL);
+    }
+
+    check(dsht_client_create(h) == NULL);
+
+    dsht_client_destroy(c[0]);
+    c[0] = dsht_client_create(h);
+    check(c[0] != NULL);
+
+    for (i = 0 ; i < arraylen(c) ; i++)
+        dsht_client_destroy(c[i]);
+
+    dsht_destroy(h);
+}
+
+static void
+test_insert_lookup_remove(void)
+{
+    struct dsht * h;
+    struct dsht_client * c;
+    int * ptr;
+    int rv;
+    int key = 42;
+    int value = 23;
+
+    h = dsht_create(4, 1, 10, NULL);
+    check(h != NULL);
+    c = dsht_client_create(h);
+    check(c != NULL);
+
+    rv = dsht_insert(c, NULL, sizeof(key), &value);
+    check(rv != 0);
+
+    rv = dsht_insert(c, &key, sizeof(key), &value);
+    check(rv == 0);
+
+    ptr = dsht_lookup(c, &value, sizeof(value));
+    check(ptr == NULL);
+
+    ptr = dsht_lookup(c, &key, sizeof(key));
+    check(ptr != NULL && *ptr == value);
+
+    ptr = dsht_lookup_insert(c, &key, sizeof(key), &key);
+    check(ptr == &value);
+
+    rv = dsht_remove(c, &key, sizeof(key));
+    check(rv == 0);
+
+    ptr = dsht_lookup(c, &key, sizeof(key));
+    check(ptr == NULL);
+
+    dsht_client_destroy(c);
+    dsht_destroy(h);
+}
+
+static void
+test_batch(void)
+{
+    struct dsht * h;
+    struct dsht_client * c;
+    struct dsht_response resp[16];
+    int i, n, done, submitted;
+    int keys[1000];
+    int seen[1000] = {0};
+
+    h = dsht_create(3, 1, 10, NULL);
+    check(h != NULL);
+    c = dsht_client_create(h);
+    check(c != NULL);
+
+    /* keep the rings full, the responses come back in any order */
+    submitted = 0;
+    done = 0;
+    while (done < arraylen(keys)) {
+        while (submitted < arraylen(keys)) {
+            keys[submitted] = submitted;
+            if (dsht_submit(c, DSHT_LOOKUP_INSERT, &keys[submitted],
+                        sizeof(keys[submitted]), &keys[submitted],
+                        &keys[submitted]) != 0)
+                break;
+
+            submitted++;
+        }
+
+        n = dsht_poll(c, resp, arraylen(resp));
+        for (i = 0 ; i < n ; i++) {
+            check(resp[i].value == resp[i].cookie);
+            seen[*(int *) resp[i].cookie]++;
+        }
+
+        done += n;
+    }
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        check(seen[i] == 1);
+        check(dsht_lookup(c, &keys[i], sizeof(keys[i])) == &keys[i]);
+    }
+
+    dsht_client_destroy(c);
+    dsht_destroy(h);
+}
+
+int main(void)
+{
+    test_creation();
+    test_insert_lookup_remove();
+    test_batch();
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "hll.h"
+
+/* each thread counts its share of the keys, and all of them
+ * once more: the merged estimate must only count them once */
+#define NUM_KEYS 10 * 1000 * 1000
+#define NUM_THREADS 8
+
+static struct hll * estimators[NUM_THREADS];
+
+static void *
+hll_test_thread(void * void_args)
+{
+    uint64_t i;
+    int id = (int) (intptr_t) void_args;
+    struct hll * h = estimators[id];
+
+    for (i = id ; i < NUM_KEYS ; i += NUM_THREADS)
+        hll_add(h, &i, sizeof(i));
+
+    for (i = 0 ; i < NUM_KEYS / 10 ; i++)
+        hll_add(h, &i, sizeof(i));
+
+    return NULL;
+}
+
+int main(void)
+{
+    int rv, i;
+    uint64_t count;
+    pthread_t threads[NUM_THREADS];
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        estimators[i] = hll_create(14);
+        check(estimators[i] != NULL);
+        rv = pthread_create(&threads[i], NULL, &hll_test_thread,
+                (void *) (intptr_t) i);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+    }
+
+    for (i = 1 ; i < NUM_THREADS ; i++) {
+        rv = hll_merge(estimators[0], estimators[i]);
+        check(rv == 0);
+    }
+
+    /* standard error is 0.8%, allow 5 of them */
+    count = hll_count(estimators[0]);
+    check(count > NUM_KEYS * 0.96 && count < NUM_KEYS * 1.04);
+    check(hll_size(estimators[0]) == 1 << 14);
+
+    hll_dump_stats(estimators[0]);
+
+    for (i = 0 ; i < NUM_THREADS ; i++)
+        hll_destroy(estimators[i]);
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "hll.h"
+#include "sht.h"
+
+#define NUM_KEYS 100 * 1000
+
+static void
+fill(struct hll * h, int first, int n)
+{
+    int i;
+
+    for (i = first ; i < first + n ; i++)
+        hll_add(h, &i, sizeof(i));
+}
+
+static void
+test_creation(void)
+{
+    int i;
+    struct hll * h;
+    int valid[] = {-1, 0, 4, 12, 16};
+    int invalid[] = {1, 3, 19, INT_MAX};
+
+    for (i = 0 ; i < arraylen(valid) ; i++) {
+        h = hll_create(valid[i]);
+        check(h != NULL);
+        check(hll_count(h) == 0);
+        hll_destroy(h);
+    }
+
+    for (i = 0 ; i < arraylen(invalid) ; i++) {
+        h = hll_create(invalid[i]);
+        check(h == NULL);
+    }
+}
+
+static void
+test_count(void)
+{
+    int i, j;
+    uint64_t count;
+    struct hll * h;
+
+    h = hll_create(12);
+    check(h != NULL);
+
+    /* close to exact for small cardinalities */
+    for (i = 0 ; i < 100 ; i++)
+        hll_add(h, &i, sizeof(i));
+
+    check(hll_count(h) >= 98 && hll_count(h) <= 102);
+
+    /* duplicates do not count */
+    for (j = 0 ; j < 3 ; j++) {
+        for (i = 0 ; i < NUM_KEYS ; i++)
+            hll_add(h, &i, sizeof(i));
+    }
+
+    /* 3 standard errors */
+    count = hll_count(h);
+    check(count > NUM_KEYS * 0.95 && count < NUM_KEYS * 1.05);
+
+    /* the same keys, hashed ahead */
+    for (i = 0 ; i < NUM_KEYS ; i++)
+        hll_add_hash(h, hll_hash(&i, sizeof(i)));
+
+    check(hll_count(h) == count);
+
+    hll_destroy(h);
+}
+
+static void
+test_sparse(void)
+{
+    int i;
+    size_t size;
+    struct hll * h;
+
+    h = hll_create(12);
+    check(h != NULL);
+    check(hll_size(h) == 0);
+
+    /* sparse: smaller than the 4096 dense registers */
+    for (i = 0 ; i < 100 ; i++)
+        hll_add(h, &i, sizeof(i));
+
+    size = hll_size(h);
+    check(size > 0 && size < 4096);
+    check(hll_count(h) >= 98 && hll_count(h) <= 102);
+
+    for (i = 0 ; i < NUM_KEYS ; i++)
+        hll_add(h, &i, sizeof(i));
+
+    check(hll_size(h) == 4096);
+
+    hll_destroy(h);
+}
+
+static void
+test_merge(void)
+{
+    int i, j;
+    struct hll * all, * dst, * src;
+    struct hll * other;
+    int counts[] = {10, 1000, NUM_KEYS};
+
+    other = hll_create(10);
+    check(other != NULL);
+
+    /* every combination of sparse and dense */
+    for (i = 0 ; i < arraylen(counts) ; i++) {
+        for (j = 0 ; j < arraylen(counts) ; j++) {
+            all = hll_create(12);
+            dst = hll_create(12);
+            src = hll_create(12);
+            check(all != NULL && dst != NULL && src != NULL);
+
+            fill(all, 0, counts[i]);
+            fill(dst, 0, counts[i]);
+            fill(all, NUM_KEYS / 2, counts[j]);
+            fill(src, NUM_KEYS / 2, counts[j]);
+
+            check(hll_merge(dst, src) == 0);
+            check(hll_count(dst) == hll_count(all));
+            check(hll_merge(dst, other) == -1);
+
+            hll_destroy(all);
+            hll_destroy(dst);
+            hll_destroy(src);
+        }
+    }
+
+    hll_destroy(other);
+}
+
+static void
+test_presize(void)
+{
+    int rv, i;
+    int * keys;
+    int * ptr;
+    struct hll * est;
+    struct sht * h;
+
+    keys = malloc(NUM_KEYS * sizeof(*keys));
+    check(keys != NULL);
+
+    est = hll_create(0);
+    check(est != NULL);
+
+    /* estimate from a sample of the stream */
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        keys[i] = i;
+        if (i % 10 == 0)
+            hll_add(est, &keys[i], sizeof(keys[i]));
+    }
+
+    h = sht_create(0);
+    check(h != NULL);
+
+    rv = sht_reserve(h, hll_count(est) * 10);
+    check(rv == 0);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    sht_destroy(h);
+    hll_destroy(est);
+    free(keys);
+}
+
+int main(void)
+{
+    test_creation();
+    test_count();
+    test_sparse();
+    test_merge();
+    test_presize();
+
+    return 0;
+}
@@ -0,0 +1,1455 @@
+#define _POSIX_C_SOURCE 200809L /* getopt(), pthread barriers */
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+
+/* the same workloads run against every ix table, and a global mutex
+ * baseline. Results are printed as a single CSV or JSON report, the JSON
+ * one with the environment it was measured in.
+ *
+ * The soak mode churns a table for as long as asked, and samples its
+ * memory footprint on the way: growth of the resident size beyond the
+ * live allocations comes from fragmentation.
+ *
+ * The compare mode reads two JSON reports, and flags the measures of the
+ * second one which are significantly worse than in the first one */
+
+#define MAX_THREADS 1024
+#define DEFAULT_NUM_KEYS (1 << 16)
+#define DEFAULT_DURATION_MS 500
+#define DEFAULT_WSS_MAX_KEYS (1 << 22)
+#define WSS_MIN_KEYS (1 << 8)
+#define WSS_MIN_OPS (1 << 20)
+#define DEFAULT_RUNS 1
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_THRESHOLD 5 /* % */
+
+struct options {
+    char const * mode;
+    struct bench_engine const * engine; /* NULL for all of them */
+    struct bench_mix const * mix;       /* NULL for all of them */
+    int max_threads;
+    enum bench_placement placement;
+    uint64_t duration_ns;
+    uint64_t num_keys;
+    uint64_t wss_max_keys;
+    char const * format;
+    char const * output;   /* NULL for stdout */
+    int runs;              /* of each measure */
+    char const * baseline; /* compare mode */
+    double threshold;      /* smallest regression reported, in % */
+    uint64_t interval_ns;  /* between soak samples */
+};
+
+static struct options opts = {
+    .mode = "scaling",
+    .placement = BENCH_PLACE_CORE,
+    .duration_ns = DEFAULT_DURATION_MS * 1000000ULL,
+    .num_keys = DEFAULT_NUM_KEYS,
+    .wss_max_keys = DEFAULT_WSS_MAX_KEYS,
+    .format = "csv",
+    .runs = DEFAULT_RUNS,
+    .threshold = DEFAULT_THRESHOLD,
+    .interval_ns = DEFAULT_INTERVAL_MS * 1000000ULL,
+};
+
+static uint64_t * keys;
+
+/*
+ * report: one row per measure, NAN numbers are missing values
+ */
+
+struct report_field {
+    char const * name;
+    char const * str; /* NULL for a number */
+    double num;
+};
+
+static FILE * out;
+static int report_rows;
+
+static int
+report_json(void)
+{
+    return strcmp(opts.format, "json") == 0;
+}
+
+static void
+print_json_string(char const * str)
+{
+    fputc('"', out);
+    for ( ; *str != '\0' ; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', out);
+
+        if ((unsigned char) *str >= 0x20)
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void
+report_value(struct report_field const * f)
+{
+    if (f->str != NULL && report_json())
+        print_json_string(f->str);
+    else if (f->str != NULL)
+        fprintf(out, "%s", f->str);
+    else if (isnan(f->num))
+        fprintf(out, "%s", report_json() ? "null" : "");
+    else
+        fprintf(out, "%.10g", f->num);
+}
+
+static void
+report_row(struct report_field const * fields, int num_fields)
+{
+    int i;
+
+    if (report_json()) {
+        fprintf(out, report_rows == 0 ? "    {" : ",\n    {");
+        for (i = 0 ; i < num_fields ; i++) {
+            fprintf(out, "%s\"%s\": ", i == 0 ? "" : ", ", fields[i].name);
+            report_value(&fields[i]);
+        }
+        fprintf(out, "}");
+    } else {
+        if (report_rows == 0) {
+            for (i = 0 ; i < num_fields ; i++)
+                fprintf(out, "%s%s", i == 0 ? "" : ",", fields[i].name);
+
+            fprintf(out, "\n");
+        }
+
+        for (i = 0 ; i < num_fields ; i++) {
+            fprintf(out, i == 0 ? "" : ",");
+            report_value(&fields[i]);
+        }
+        fprintf(out, "\n");
+    }
+
+    fflush(out);
+    report_rows++;
+}
+
+static void
+cpu_model(char * model, size_t size)
+{
+    FILE * f;
+    char line[256], * value;
+
+    snprintf(model, size, "unknown");
+    f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        value = strchr(line, ':');
+        if (value == NULL || strncmp(line, "model name", 10) != 0)
+            continue;
+
+        value += strspn(value, ": \t");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        break;
+    }
+
+    fclose(f);
+}
+
+static char const *
+compiler(void)
+{
+#if defined(__clang__)
+    return "clang " __clang_version__;
+#elif defined(__GNUC__)
+    return "gcc " __VERSION__;
+#else
+    return "unknown";
+#endif
+}
+
+/* build options of this benchmark, which are those of the libraries */
+static void
+report_build(void)
+{
+#ifdef IX_BUILDTYPE
+    char const * buildtype = IX_BUILDTYPE;
+#else
+    char const * buildtype = "unknown";
+#endif
+#ifdef __OPTIMIZE__
+    int optimize = 1;
+#else
+    int optimize = 0;
+#endif
+#ifdef NDEBUG
+    int ndebug = 1;
+#else
+    int ndebug = 0;
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+    int sanitized = 1;
+#else
+    int sanitized = 0;
+#endif
+
+    fprintf(out, "    \"build\": {\"type\": ");
+    print_json_string(buildtype);
+    fprintf(out, ", \"optimize\": %s, \"ndebug\": %s, \"sanitized\": %s, "
+            "\"log2_cacheline_size\": %d},\n",
+            optimize ? "true" : "false", ndebug ? "true" : "false",
+            sanitized ? "true" : "false", CONFIG_LOG2_CPU_CACHELINE_SIZE);
+}
+
+static void
+report_begin(int num_cpus)
+{
+    time_t now;
+    struct utsname uts;
+    char model[256], date[32];
+
+    if (!report_json())
+        return;
+
+    cpu_model(model, sizeof(model));
+    if (uname(&uts) != 0)
+        snprintf(uts.release, sizeof(uts.release), "unknown");
+
+    now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "{\n  \"env\": {\n    \"cpu_model\": ");
+    print_json_string(model);
+    fprintf(out, ",\n    \"cpus_online\": %ld,\n",
+            sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "    \"cpus_used\": %d,\n", num_cpus);
+    fprintf(out, "    \"kernel\": ");
+    print_json_string(uts.release);
+    fprintf(out, ",\n    \"compiler\": ");
+    print_json_string(compiler());
+    fprintf(out, ",\n");
+    report_build();
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"mode\": ");
+    print_json_string(opts.mode);
+    fprintf(out, ",\n    \"placement\": \"%s\",\n",
+            bench_placement_name(opts.placement));
+    fprintf(out, "    \"duration_ms\": %lu,\n", opts.duration_ns / 1000000);
+    fprintf(out, "    \"runs\": %d\n", opts.runs);
+    fprintf(out, "  },\n  \"results\": [\n");
+}
+
+static void
+report_end(void)
+{
+    if (report_json())
+        fprintf(out, "%s  ]\n}\n", report_rows == 0 ? "" : "\n");
+}
+
+/*
+ * common helpers
+ */
+
+static void
+init_keys(uint64_t num_keys)
+{
+    uint64_t i;
+
+    keys = malloc(num_keys * sizeof(*keys));
+    if (keys == NULL) {
+        fprintf(stderr, "cannot allocate %lu keys\n", num_keys);
+        exit(1);
+    }
+
+    for (i = 0 ; i < num_keys ; i++)
+        keys[i] = i;
+}
+
+/* insert the keys [0, n) with a step, from a temporary handle */
+static int
+prefill(struct bench_engine const * e, void * table, uint64_t n,
+        uint64_t step)
+{
+    uint64_t i;
+    void * handle;
+
+    handle = bench_engine_attach(e, table, 0);
+    if (handle == NULL)
+        return -1;
+
+    for (i = 0 ; i < n ; i += step)
+        e->insert(handle, &keys[i], sizeof(keys[i]), &keys[i]);
+
+    bench_engine_detach(e, handle);
+
+    return 0;
+}
+
+static int
+engine_selected(struct bench_engine const * e)
+{
+    return opts.engine == NULL || opts.engine == e;
+}
+
+/*
+ * scaling: throughput of each engine and mix, from 1 to max_threads
+ */
+
+struct scaling_ctx {
+    struct bench_engine const * engine;
+    struct bench_mix const * mix;
+    void * table;
+
+    /* allocations of the runs, when profiled */
+    struct bench_alloc_stats alloc[BENCH_NUM_OPS + 1];
+    uint64_t alloc_ops[BENCH_NUM_OPS];
+    uint64_t alloc_peak;
+};
+
+struct thread_result {
+    uint64_t ops;
+    uint64_t ops_by_type[BENCH_NUM_OPS]; /* when profiling allocations */
+    int failed;
+} CACHE_ALIGNED;
+
+static struct thread_result results[MAX_THREADS];
+
+static void
+scaling_thread(struct bench_threads * t, int id)
+{
+    void * handle;
+    enum bench_op op;
+    uint64_t r, rng, ops;
+    uint64_t ops_by_type[BENCH_NUM_OPS] = {0};
+    struct scaling_ctx const * ctx = t->arg;
+
+    results[id].ops = 0;
+    results[id].failed = 0;
+
+    handle = bench_engine_attach(ctx->engine, ctx->table, id);
+    if (handle == NULL) {
+        results[id].failed = 1;
+        return;
+    }
+
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+    ops = 0;
+    while (!bench_should_stop(t)) {
+        r = bench_rand(&rng);
+        op = bench_mix_pick(ctx->mix, r >> 32);
+        if (bench_alloc_enabled) {
+            bench_alloc_set_op(op);
+            ops_by_type[op]++;
+        }
+
+        bench_engine_op(ctx->engine, handle, op, &keys[r % opts.num_keys],
+                sizeof(keys[0]));
+        ops++;
+    }
+
+    bench_alloc_set_op(BENCH_NUM_OPS);
+    bench_engine_detach(ctx->engine, handle);
+    results[id].ops = ops;
+    memcpy(results[id].ops_by_type, ops_by_type, sizeof(ops_by_type));
+}
+
+/* add the allocations of a run to the previous ones */
+static void
+scaling_alloc_add(struct scaling_ctx * ctx, int num_threads)
+{
+    int i, op;
+    uint64_t peak;
+    struct bench_alloc_stats stats[BENCH_NUM_OPS + 1];
+
+    peak = bench_alloc_stats(stats);
+    ctx->alloc_peak = MAX(ctx->alloc_peak, peak);
+    for (op = 0 ; op <= BENCH_NUM_OPS ; op++) {
+        ctx->alloc[op].allocs += stats[op].allocs;
+        ctx->alloc[op].frees += stats[op].frees;
+        ctx->alloc[op].bytes += stats[op].bytes;
+        ctx->alloc[op].peak_bytes = MAX(ctx->alloc[op].peak_bytes,
+                stats[op].peak_bytes);
+    }
+
+    for (i = 0 ; i < num_threads ; i++) {
+        for (op = 0 ; op < BENCH_NUM_OPS ; op++)
+            ctx->alloc_ops[op] += results[i].ops_by_type[op];
+    }
+}
+
+static double
+scaling_run(struct scaling_ctx * ctx, int const * cpus, int num_threads)
+{
+    int i;
+    uint64_t ops, elapsed;
+    struct bench_threads t = {
+        .num_threads = num_threads,
+        .cpus = cpus,
+        .duration_ns = opts.duration_ns,
+        .fn = scaling_thread,
+        .arg = ctx,
+    };
+
+    bench_alloc_reset();
+    ctx->table = ctx->engine->create(opts.num_keys, num_threads);
+    if (ctx->table == NULL)
+        return -1;
+
+    /* every other key: lookups hit half the time */
+    if (prefill(ctx->engine, ctx->table, opts.num_keys, 2) != 0) {
+        ctx->engine->destroy(ctx->table);
+        return -1;
+    }
+
+    elapsed = bench_threads_run(&t);
+
+    ops = 0;
+    for (i = 0 ; i < num_threads ; i++) {
+        if (results[i].failed)
+            elapsed = 0;
+
+        ops += results[i].ops;
+    }
+
+    if (bench_alloc_enabled)
+        scaling_alloc_add(ctx, num_threads);
+
+    ctx->engine->destroy(ctx->table);
+
+    return elapsed == 0 ? -1 : ops * 1e9 / elapsed;
+}
+
+#define ALLOC_FIELDS 4
+#define MAX_SCALING_FIELDS (10 + ALLOC_FIELDS * BENCH_NUM_OPS + 1)
+
+/* per operation type allocations, NAN when they are not instrumented or
+ * when the mix has no such operation */
+static int
+scaling_alloc_fields(struct scaling_ctx const * ctx,
+        struct report_field * fields)
+{
+    int op, f, n, known;
+    char * c;
+    double ops, values[ALLOC_FIELDS];
+    static char names[BENCH_NUM_OPS][ALLOC_FIELDS][48];
+    static char const * const suffixes[ALLOC_FIELDS] = {
+        "allocs_per_op", "frees_per_op", "bytes_per_op", "peak_bytes",
+    };
+
+    n = 0;
+    for (op = 0 ; op < BENCH_NUM_OPS ; op++) {
+        ops = ctx->alloc_ops[op];
+        known = ops > 0 && (ctx->engine->flags & BENCH_ENGINE_ALLOC_HOOKS);
+
+        values[0] = ctx->alloc[op].allocs / ops;
+        values[1] = ctx->alloc[op].frees / ops;
+        values[2] = ctx->alloc[op].bytes / ops;
+        values[3] = ctx->alloc[op].peak_bytes;
+
+        for (f = 0 ; f < ALLOC_FIELDS ; f++) {
+            snprintf(names[op][f], sizeof(names[op][f]), "%s_%s",
+                    bench_op_name(op), suffixes[f]);
+            for (c = names[op][f] ; *c != '\0' ; c++) {
+                if (*c == '-')
+                    *c = '_';
+            }
+
+            fields[n++] = (struct report_field) {
+                .name = names[op][f],
+                .num = known ? values[f] : NAN,
+            };
+        }
+    }
+
+    fields[n++] = (struct report_field) {
+        .name = "peak_live_bytes",
+        .num = (ctx->engine->flags & BENCH_ENGINE_ALLOC_HOOKS)
+            ? ctx->alloc_peak : NAN,
+    };
+
+    return n;
+}
+
+static void
+scaling_report(struct scaling_ctx const * ctx, int num_threads,
+        struct bench_stat const * stat, double single)
+{
+    int n;
+    struct report_field fields[MAX_SCALING_FIELDS] = {
+        { .name = "mode", .str = "scaling" },
+        { .name = "engine", .str = ctx->engine->name },
+        { .name = "mix", .str = ctx->mix->name },
+        { .name = "placement", .str = bench_placement_name(opts.placement) },
+        { .name = "threads", .num = num_threads },
+        { .name = "runs", .num = stat->n },
+        { .name = "ops_per_s", .num = stat->mean },
+        { .name = "ops_per_s_stddev", .num = bench_stat_stddev(stat) },
+        { .name = "ns_per_op", .num = num_threads * 1e9 / stat->mean },
+        { .name = "efficiency", .num = stat->mean / (num_threads * single) },
+    };
+
+    n = 10;
+    if (bench_alloc_enabled)
+        n += scaling_alloc_fields(ctx, &fields[n]);
+
+    report_row(fields, n);
+}
+
+/* 1, 2, 4... and the number of cpus */
+static int
+next_num_threads(int n, int max)
+{
+    return (n < max && 2 * n > max) ? max : 2 * n;
+}
+
+static int
+run_scaling(int const * cpus, int num_cpus)
+{
+    int e, m, n, run;
+    double rate, single;
+    struct bench_stat stat;
+    struct scaling_ctx ctx;
+
+    init_keys(opts.num_keys);
+
+    for (e = 0 ; e < bench_num_engines ; e++) {
+        ctx.engine = &bench_engines[e];
+        if (!engine_selected(ctx.engine))
+            continue;
+
+        for (m = 0 ; m < bench_num_mixes ; m++) {
+            ctx.mix = &bench_mixes[m];
+            if (opts.mix != NULL && opts.mix != ctx.mix)
+                continue;
+
+            single = 0;
+            for (n = 1 ; n <= num_cpus ; n = next_num_threads(n, num_cpus)) {
+                /* other threads of single writer engines cannot modify */
+                if (n > 1 && (ctx.engine->flags & BENCH_ENGINE_SINGLE_WRITER)
+                        && !bench_mix_read_only(ctx.mix))
+                    break;
+
+                stat = (struct bench_stat) {0};
+                memset(ctx.alloc, 0, sizeof(ctx.alloc));
+                memset(ctx.alloc_ops, 0, sizeof(ctx.alloc_ops));
+                ctx.alloc_peak = 0;
+                for (run = 0 ; run < opts.runs ; run++) {
+                    rate = scaling_run(&ctx, cpus, n);
+                    if (rate < 0) {
+                        fprintf(stderr, "%s: cannot run with %d threads\n",
+                                ctx.engine->name, n);
+                        return -1;
+                    }
+
+                    bench_stat_add(&stat, rate);
+                }
+
+                if (n == 1)
+                    single = stat.mean;
+
+                scaling_report(&ctx, n, &stat, single);
+            }
+        }
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+/*
+ * wss: single thread lookup cost as the table outgrows the caches
+ */
+
+struct wss_result {
+    struct bench_stat ns;
+    double misses[BENCH_NUM_COUNTERS]; /* of the last run */
+};
+
+/* look up random keys among [base, base + n), n a power of 2 */
+static void
+wss_measure(struct bench_engine const * e, void * handle,
+        struct bench_counters * c, uint64_t base, uint64_t n,
+        struct wss_result * res)
+{
+    int i;
+    uint64_t op, num_ops, r, rng, elapsed, key;
+    uint64_t values[BENCH_NUM_COUNTERS];
+
+    num_ops = MAX(n, WSS_MIN_OPS);
+    rng = 0x9e3779b97f4a7c15ULL;
+
+    /* key i is i: computing the keys keeps their array out of the cache
+     * misses measured */
+    bench_counters_start(c);
+    elapsed = bench_now_ns();
+    for (op = 0 ; op < num_ops ; op++) {
+        r = bench_rand(&rng);
+        key = base + (r & (n - 1));
+        e->lookup(handle, &key, sizeof(key));
+    }
+    elapsed = bench_now_ns() - elapsed;
+    bench_counters_stop(c, values);
+
+    bench_stat_add(&res->ns, (double) elapsed / num_ops);
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++)
+        res->misses[i] = values[i] == BENCH_COUNTER_NONE
+            ? NAN : (double) values[i] / num_ops;
+}
+
+static int
+wss_run(struct bench_engine const * e, struct bench_counters * c,
+        uint64_t n)
+{
+    int run;
+    void * table, * handle;
+    struct wss_result hits = {0}, misses = {0};
+
+    table = e->create(n, 1);
+    if (table == NULL)
+        return -1;
+
+    if (prefill(e, table, n, 1) != 0)
+        goto err;
+
+    handle = bench_engine_attach(e, table, 0);
+    if (handle == NULL)
+        goto err;
+
+    /* keys [n, 2n) are never inserted */
+    for (run = 0 ; run < opts.runs ; run++) {
+        wss_measure(e, handle, c, 0, n, &hits);
+        wss_measure(e, handle, c, n, n, &misses);
+    }
+
+    bench_engine_detach(e, handle);
+    e->destroy(table);
+
+    report_row((struct report_field[]) {
+        { .name = "mode", .str = "wss" },
+        { .name = "engine", .str = e->name },
+        { .name = "keys", .num = n },
+        { .name = "runs", .num = hits.ns.n },
+        { .name = "hit_ns_per_op", .num = hits.ns.mean },
+        { .name = "hit_ns_per_op_stddev",
+            .num = bench_stat_stddev(&hits.ns) },
+        { .name = "hit_l1d_misses_per_op",
+            .num = hits.misses[BENCH_L1D_MISSES] },
+        { .name = "hit_llc_misses_per_op",
+            .num = hits.misses[BENCH_LLC_MISSES] },
+        { .name = "hit_dtlb_misses_per_op",
+            .num = hits.misses[BENCH_DTLB_MISSES] },
+        { .name = "miss_ns_per_op", .num = misses.ns.mean },
+        { .name = "miss_ns_per_op_stddev",
+            .num = bench_stat_stddev(&misses.ns) },
+        { .name = "miss_l1d_misses_per_op",
+            .num = misses.misses[BENCH_L1D_MISSES] },
+        { .name = "miss_llc_misses_per_op",
+            .num = misses.misses[BENCH_LLC_MISSES] },
+        { .name = "miss_dtlb_misses_per_op",
+            .num = misses.misses[BENCH_DTLB_MISSES] },
+    }, 14);
+
+    return 0;
+
+err:
+    e->destroy(table);
+    return -1;
+}
+
+static int
+run_wss(int const * cpus, int num_cpus)
+{
+    int e;
+    uint64_t n;
+    struct bench_counters c;
+
+    (void) num_cpus;
+
+    /* only the keys inserted, the lookups compute theirs */
+    init_keys(opts.wss_max_keys);
+    bench_pin(cpus[0]);
+    if (bench_counters_open(&c) == 0)
+        fprintf(stderr, "no hardware counter available\n");
+
+    for (e = 0 ; e < bench_num_engines ; e++) {
+        if (!engine_selected(&bench_engines[e]))
+            continue;
+
+        for (n = WSS_MIN_KEYS ; n <= opts.wss_max_keys ; n *= 2) {
+            if (wss_run(&bench_engines[e], &c, n) != 0) {
+                fprintf(stderr, "%s: cannot run with %lu keys\n",
+                        bench_engines[e].name, n);
+                bench_counters_close(&c);
+                return -1;
+            }
+        }
+    }
+
+    bench_counters_close(&c);
+    free(keys);
+
+    return 0;
+}
+
+/*
+ * soak: hours of insert/remove churn, sampling the memory footprint.
+ * Keys have various lengths so that the freed nodes and keys do not fit
+ * the next allocations exactly
+ */
+
+#define SOAK_MAX_KEYLEN 64
+
+struct soak_ctx {
+    struct bench_engine const * engine;
+    void * table;
+    int num_threads;
+    int num_writers; /* the others look keys up */
+
+    char (* keys)[SOAK_MAX_KEYLEN];
+    uint8_t * present; /* only touched by the writer owning the key */
+
+    uint64_t start_ns;
+    uint64_t rss_base; /* before the table was created */
+    pthread_t sampler;
+    int stop;
+};
+
+struct soak_result {
+    uint64_t ops;
+    uint64_t live_entries;
+    uint64_t live_key_bytes;
+} CACHE_ALIGNED;
+
+static struct soak_result soak_results[MAX_THREADS];
+
+static size_t
+soak_keylen(uint64_t i)
+{
+    uint64_t x = i + 1;
+
+    return sizeof(uint64_t)
+        + bench_rand(&x) % (SOAK_MAX_KEYLEN - sizeof(uint64_t) + 1);
+}
+
+static int
+soak_init_keys(struct soak_ctx * ctx)
+{
+    uint64_t i;
+
+    ctx->keys = malloc(opts.num_keys * sizeof(*ctx->keys));
+    ctx->present = calloc(opts.num_keys, sizeof(*ctx->present));
+    if (ctx->keys == NULL || ctx->present == NULL) {
+        fprintf(stderr, "cannot allocate %lu keys\n", opts.num_keys);
+        return -1;
+    }
+
+    for (i = 0 ; i < opts.num_keys ; i++) {
+        memset(ctx->keys[i], i, SOAK_MAX_KEYLEN);
+        memcpy(ctx->keys[i], &i, sizeof(i));
+    }
+
+    return 0;
+}
+
+/* each writer toggles random keys of its own slice, which stays half
+ * full. Readers look up random keys of every slice */
+static void
+soak_thread(struct bench_threads * t, int id)
+{
+    void * handle;
+    size_t keylen;
+    uint64_t i, lo, n, rng, ops, live, live_bytes;
+    struct soak_ctx * ctx = t->arg;
+    struct bench_engine const * e = ctx->engine;
+
+    handle = bench_engine_attach(e, ctx->table, id);
+    if (handle == NULL)
+        return;
+
+    lo = 0;
+    n = opts.num_keys;
+    if (id < ctx->num_writers) {
+        lo = opts.num_keys * id / ctx->num_writers;
+        n = opts.num_keys * (id + 1) / ctx->num_writers - lo;
+    }
+
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+    ops = live = live_bytes = 0;
+    while (n > 0 && !bench_should_stop(t)) {
+        i = lo + bench_rand(&rng) % n;
+        keylen = soak_keylen(i);
+        if (id >= ctx->num_writers) {
+            e->lookup(handle, ctx->keys[i], keylen);
+        } else if (ctx->present[i]) {
+            if (e->remove(handle, ctx->keys[i], keylen) == 0) {
+                ctx->present[i] = 0;
+                live--;
+                live_bytes -= keylen;
+            }
+        } else {
+            if (e->insert(handle, ctx->keys[i], keylen, ctx->keys[i]) == 0) {
+                ctx->present[i] = 1;
+                live++;
+                live_bytes += keylen;
+            }
+        }
+
+        ops++;
+        __atomic_store_n(&soak_results[id].ops, ops, __ATOMIC_RELAXED);
+        __atomic_store_n(&soak_results[id].live_entries, live,
+                __ATOMIC_RELAXED);
+        __atomic_store_n(&soak_results[id].live_key_bytes, live_bytes,
+                __ATOMIC_RELAXED);
+    }
+
+    bench_engine_detach(e, handle);
+}
+
+static void
+soak_sample(struct soak_ctx const * ctx)
+{
+    int i;
+    uint64_t ops, live, live_bytes, rss;
+    double alloc_live;
+
+    ops = live = live_bytes = 0;
+    for (i = 0 ; i < ctx->num_threads ; i++) {
+        ops += __atomic_load_n(&soak_results[i].ops, __ATOMIC_RELAXED);
+        live += __atomic_load_n(&soak_results[i].live_entries,
+                __ATOMIC_RELAXED);
+        live_bytes += __atomic_load_n(&soak_results[i].live_key_bytes,
+                __ATOMIC_RELAXED);
+    }
+
+    /* what the table made resident since it was created */
+    rss = bench_rss_bytes();
+    rss = rss > ctx->rss_base ? rss - ctx->rss_base : 0;
+    alloc_live = (ctx->engine->flags & BENCH_ENGINE_ALLOC_HOOKS)
+        ? bench_alloc_live() : NAN;
+
+    report_row((struct report_field[]) {
+        { .name = "mode", .str = "soak" },
+        { .name = "engine", .str = ctx->engine->name },
+        { .name = "threads", .num = ctx->num_threads },
+        { .name = "keys", .num = opts.num_keys },
+        { .name = "elapsed_ms",
+            .num = (bench_now_ns() - ctx->start_ns) / 1000000 },
+        { .name = "ops", .num = ops },
+        { .name = "live_entries", .num = live },
+        { .name = "live_key_bytes", .num = live_bytes },
+        { .name = "rss_bytes", .num = rss },
+        { .name = "alloc_live_bytes", .num = alloc_live },
+        { .name = "fragmentation",
+            .num = alloc_live > 0 ? rss / alloc_live : NAN },
+        { .name = "rss_bytes_per_entry",
+            .num = live > 0 ? (double) rss / live : NAN },
+    }, 12);
+
+    if (out != stdout)
+        fflush(out);
+}
+
+static void *
+soak_sampler(void * arg)
+{
+    struct soak_ctx * ctx = arg;
+    struct timespec ts;
+
+    for (;;) {
+        ts.tv_sec = opts.interval_ns / 1000000000;
+        ts.tv_nsec = opts.interval_ns % 1000000000;
+        while (nanosleep(&ts, &ts) != 0)
+            ;
+
+        if (__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        soak_sample(ctx);
+    }
+
+    return NULL;
+}
+
+static int
+soak_run(struct soak_ctx * ctx, int const * cpus)
+{
+    struct bench_engine const * e = ctx->engine;
+    struct bench_threads t = {
+        .num_threads = ctx->num_threads,
+        .cpus = cpus,
+        .duration_ns = opts.duration_ns,
+        .fn = soak_thread,
+        .arg = ctx,
+    };
+
+    ctx->num_writers = (e->flags & BENCH_ENGINE_SINGLE_WRITER)
+        ? 1 : ctx->num_threads;
+    memset(ctx->present, 0, opts.num_keys * sizeof(*ctx->present));
+    memset(soak_results, 0, sizeof(soak_results));
+
+    /* the memory freed by the previous engines may still be resident:
+     * select a single engine for comparable footprints */
+    ctx->rss_base = bench_rss_bytes();
+    bench_alloc_reset();
+    ctx->table = e->create(opts.num_keys, ctx->num_threads);
+    if (ctx->table == NULL)
+        return -1;
+
+    ctx->stop = 0;
+    ctx->start_ns = bench_now_ns();
+    if (pthread_create(&ctx->sampler, NULL, soak_sampler, ctx) != 0) {
+        e->destroy(ctx->table);
+        return -1;
+    }
+
+    bench_threads_run(&t);
+
+    /* the sampler may sleep for another interval */
+    __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(ctx->sampler, NULL);
+    soak_sample(ctx);
+
+    e->destroy(ctx->table);
+
+    return 0;
+}
+
+static int
+run_soak(int const * cpus, int num_cpus)
+{
+    int e, rv;
+    struct soak_ctx ctx = { .num_threads = num_cpus };
+
+    /* the footprint is only known through the allocator hooks */
+    bench_alloc_enabled = 1;
+
+    rv = soak_init_keys(&ctx);
+    for (e = 0 ; rv == 0 && e < bench_num_engines ; e++) {
+        ctx.engine = &bench_engines[e];
+        if (!engine_selected(ctx.engine))
+            continue;
+
+        rv = soak_run(&ctx, cpus);
+        if (rv != 0)
+            fprintf(stderr, "%s: cannot run with %d threads\n",
+                    ctx.engine->name, num_cpus);
+    }
+
+    free(ctx.keys);
+    free(ctx.present);
+
+    return rv;
+}
+
+/*
+ * compare: a JSON report against a baseline one
+ */
+
+#define MAX_ROW_FIELDS 32
+#define MAX_NAME_LEN 64
+
+struct row {
+    int num_fields;
+    struct {
+        char name[MAX_NAME_LEN];
+        char str[MAX_NAME_LEN];
+        int is_str;
+        double num;
+    } fields[MAX_ROW_FIELDS];
+};
+
+struct report {
+    int num_rows;
+    struct row * rows;
+};
+
+/* the fields identifying a measure, and the ones compared */
+static char const * const key_fields[] = {
+    "mode", "engine", "mix", "placement", "threads", "keys",
+};
+
+static struct {
+    char const * name;
+    int higher_is_better;
+} const metrics[] = {
+    { "ops_per_s", 1 },
+    { "hit_ns_per_op", 0 },
+    { "miss_ns_per_op", 0 },
+};
+
+static char *
+read_file(char const * path)
+{
+    long len;
+    FILE * f;
+    char * buf;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    buf = NULL;
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0
+            || fseek(f, 0, SEEK_SET) != 0)
+        goto out;
+
+    buf = malloc(len + 1);
+    if (buf == NULL)
+        goto out;
+
+    if (fread(buf, 1, len, f) != (size_t) len) {
+        free(buf);
+        buf = NULL;
+        goto out;
+    }
+
+    buf[len] = '\0';
+
+out:
+    fclose(f);
+    return buf;
+}
+
+static char const *
+skip_spaces(char const * p)
+{
+    return p + strspn(p, " \t\r\n");
+}
+
+/* copy a string, truncated to size */
+static char const *
+parse_string(char const * p, char * str, size_t size)
+{
+    size_t len = 0;
+
+    if (*p++ != '"')
+        return NULL;
+
+    for ( ; *p != '"' ; p++) {
+        if (*p == '\\')
+            p++;
+
+        if (*p == '\0')
+            return NULL;
+
+        if (len + 1 < size)
+            str[len++] = *p;
+    }
+
+    str[len] = '\0';
+
+    return p + 1;
+}
+
+/* a flat object of strings, numbers and nulls */
+static char const *
+parse_row(char const * p, struct row * row)
+{
+    char * end;
+    int i;
+
+    row->num_fields = 0;
+    if (*p++ != '{')
+        return NULL;
+
+    for (p = skip_spaces(p) ; *p != '}' ; p = skip_spaces(p)) {
+        if (row->num_fields == MAX_ROW_FIELDS)
+            return NULL;
+
+        i = row->num_fields++;
+        p = parse_string(p, row->fields[i].name, MAX_NAME_LEN);
+        if (p == NULL)
+            return NULL;
+
+        p = skip_spaces(p);
+        if (*p++ != ':')
+            return NULL;
+
+        p = skip_spaces(p);
+        row->fields[i].is_str = *p == '"';
+        row->fields[i].num = NAN;
+        if (row->fields[i].is_str) {
+            p = parse_string(p, row->fields[i].str, MAX_NAME_LEN);
+            if (p == NULL)
+                return NULL;
+        } else if (strncmp(p, "null", 4) == 0) {
+            p += 4;
+        } else {
+            row->fields[i].num = strtod(p, &end);
+            if (end == p)
+                return NULL;
+
+            p = end;
+        }
+
+        p = skip_spaces(p);
+        if (*p == ',')
+            p++;
+    }
+
+    return p + 1;
+}
+
+static int
+report_load(char const * path, struct report * r)
+{
+    void * rows;
+    char * buf;
+    char const * p;
+
+    r->num_rows = 0;
+    r->rows = NULL;
+
+    buf = read_file(path);
+    if (buf == NULL) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return -1;
+    }
+
+    p = strstr(buf, "\"results\"");
+    if (p == NULL || (p = strchr(p, '[')) == NULL)
+        goto err;
+
+    for (p = skip_spaces(p + 1) ; *p != ']' ; p = skip_spaces(p)) {
+        rows = realloc(r->rows, (r->num_rows + 1) * sizeof(*r->rows));
+        if (rows == NULL)
+            goto err;
+
+        r->rows = rows;
+        p = parse_row(p, &r->rows[r->num_rows]);
+        if (p == NULL)
+            goto err;
+
+        r->num_rows++;
+        p = skip_spaces(p);
+        if (*p == ',')
+            p++;
+    }
+
+    free(buf);
+    return 0;
+
+err:
+    fprintf(stderr, "%s: cannot parse the report\n", path);
+    free(buf);
+    free(r->rows);
+    r->rows = NULL;
+    return -1;
+}
+
+static int
+row_field(struct row const * row, char const * name)
+{
+    int i;
+
+    for (i = 0 ; i < row->num_fields ; i++) {
+        if (strcmp(row->fields[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static double
+row_num(struct row const * row, char const * name)
+{
+    int i = row_field(row, name);
+
+    return (i < 0 || row->fields[i].is_str) ? NAN : row->fields[i].num;
+}
+
+static void
+row_key(struct row const * row, char * key, size_t size)
+{
+    int i, f;
+    size_t len = 0;
+
+    key[0] = '\0';
+    for (i = 0 ; i < arraylen(key_fields) && len < size ; i++) {
+        f = row_field(row, key_fields[i]);
+        if (f < 0)
+            continue;
+
+        if (row->fields[f].is_str)
+            len += snprintf(key + len, size - len, "%s%s", len ? " " : "",
+                    row->fields[f].str);
+        else
+            len += snprintf(key + len, size - len, "%s%s=%g",
+                    len ? " " : "", key_fields[i], row->fields[f].num);
+    }
+}
+
+static struct row const *
+report_find(struct report const * r, char const * key)
+{
+    int i;
+    char other[256];
+
+    for (i = 0 ; i < r->num_rows ; i++) {
+        row_key(&r->rows[i], other, sizeof(other));
+        if (strcmp(key, other) == 0)
+            return &r->rows[i];
+    }
+
+    return NULL;
+}
+
+/* two-sided 95% critical values of the Student t distribution */
+static double
+t_critical(double df)
+{
+    static double const t[] = {
+        12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26, 2.23,
+        2.20, 2.18, 2.16, 2.14, 2.13, 2.12, 2.11, 2.10, 2.09, 2.09,
+        2.08, 2.07, 2.07, 2.06, 2.06, 2.06, 2.05, 2.05, 2.05, 2.04,
+    };
+
+    if (df < 1)
+        return INFINITY;
+
+    return df <= arraylen(t) ? t[(int) df - 1] : 1.96;
+}
+
+/* Welch's t-test of the difference of the means, when both sides have a
+ * standard deviation. Without one, any difference is significant */
+static int
+significant(double m1, double s1, double n1, double m2, double s2, double n2)
+{
+    double v1, v2, t, df;
+
+    if (!(n1 > 1 && n2 > 1 && s1 + s2 > 0))
+        return 1;
+
+    v1 = s1 * s1 / n1;
+    v2 = s2 * s2 / n2;
+    t = fabs(m2 - m1) / sqrt(v1 + v2);
+    df = (v1 + v2) * (v1 + v2)
+        / (v1 * v1 / (n1 - 1) + v2 * v2 / (n2 - 1));
+
+    return t > t_critical(df);
+}
+
+static int
+compare_row(struct row const * base, struct row const * cur,
+        char const * key)
+{
+    int m, regressions;
+    double b, c, change;
+    char stddev[MAX_NAME_LEN + 8];
+    char const * verdict;
+
+    regressions = 0;
+    for (m = 0 ; m < arraylen(metrics) ; m++) {
+        b = row_num(base, metrics[m].name);
+        c = row_num(cur, metrics[m].name);
+        if (isnan(b) || isnan(c) || b == 0)
+            continue;
+
+        /* positive is better */
+        change = metrics[m].higher_is_better
+            ? 100 * (c - b) / b : 100 * (b - c) / b;
+
+        snprintf(stddev, sizeof(stddev), "%s_stddev", metrics[m].name);
+        verdict = "same";
+        if (fabs(change) >= opts.threshold
+                && significant(b, row_num(base, stddev),
+                    row_num(base, "runs"), c, row_num(cur, stddev),
+                    row_num(cur, "runs"))) {
+            verdict = change < 0 ? "REGRESSION" : "better";
+            regressions += change < 0;
+        }
+
+        printf("%s %s %.10g %.10g %+.1f%% %s\n", key, metrics[m].name, b, c,
+                change, verdict);
+    }
+
+    return regressions;
+}
+
+static int
+run_compare(char const * path)
+{
+    int i, regressions, missing;
+    char key[256];
+    struct row const * base;
+    struct report baseline, current;
+
+    if (report_load(opts.baseline, &baseline) != 0)
+        return -1;
+
+    if (report_load(path, &current) != 0) {
+        free(baseline.rows);
+        return -1;
+    }
+
+    regressions = missing = 0;
+    printf("# measure metric baseline current change verdict\n");
+    for (i = 0 ; i < current.num_rows ; i++) {
+        row_key(&current.rows[i], key, sizeof(key));
+        base = report_find(&baseline, key);
+        if (base == NULL) {
+            missing++;
+            continue;
+        }
+
+        regressions += compare_row(base, &current.rows[i], key);
+    }
+
+    printf("# %d regressions above %g%%, %d measures not in the baseline\n",
+            regressions, opts.threshold, missing);
+
+    free(baseline.rows);
+    free(current.rows);
+
+    return regressions == 0 ? 0 : -1;
+}
+
+static void
+usage(char const * prog)
+{
+    int i;
+
+    fprintf(stderr, "usage: %s [-m mode] [-e engine] [-x mix] "
+            "[-t max threads] [-p placement] [-d duration ms] [-k keys] "
+            "[-M wss max keys] [-r runs] [-f csv|json] [-o output] "
+            "[-i soak interval ms] [-a]\n", prog);
+    fprintf(stderr, "       %s -m compare -b baseline.json [-T threshold %%] "
+            "report.json\n", prog);
+    fprintf(stderr, "modes: scaling (default), wss, soak, compare\n");
+    fprintf(stderr, "engines:");
+    for (i = 0 ; i < bench_num_engines ; i++)
+        fprintf(stderr, " %s", bench_engines[i].name);
+
+    fprintf(stderr, ", all by default\n");
+    fprintf(stderr, "mixes:");
+    for (i = 0 ; i < bench_num_mixes ; i++)
+        fprintf(stderr, " %s", bench_mixes[i].name);
+
+    fprintf(stderr, ", all by default\n");
+    fprintf(stderr, "placements: core (default), smt, socket\n");
+    fprintf(stderr, "-a: count the allocations of each operation type\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    int c, rv, num_cpus;
+    static int cpus[MAX_THREADS];
+
+    while ((c = getopt(argc, argv, "m:e:x:t:p:d:k:M:r:f:o:b:T:i:ah")) != -1) {
+        switch (c) {
+        case 'm':
+            opts.mode = optarg;
+            break;
+        case 'e':
+            opts.engine = bench_engine_find(optarg);
+            if (opts.engine == NULL)
+                usage(argv[0]);
+            break;
+        case 'x':
+            opts.mix = bench_mix_find(optarg);
+            if (opts.mix == NULL)
+                usage(argv[0]);
+            break;
+        case 't':
+            opts.max_threads = atoi(optarg);
+            break;
+        case 'p':
+            if (bench_placement_parse(optarg, &opts.placement) != 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            opts.duration_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'k':
+            opts.num_keys = strtoull(optarg, NULL, 0);
+            break;
+        case 'M':
+            opts.wss_max_keys = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.runs = atoi(optarg);
+            break;
+        case 'f':
+            opts.format = optarg;
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'b':
+            opts.baseline = optarg;
+            break;
+        case 'T':
+            opts.threshold = strtod(optarg, NULL);
+            break;
+        case 'i':
+            opts.interval_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'a':
+            bench_alloc_enabled = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (strcmp(opts.mode, "compare") == 0) {
+        if (opts.baseline == NULL || optind != argc - 1)
+            usage(argv[0]);
+
+        return run_compare(argv[optind]) == 0 ? 0 : 1;
+    }
+
+    if ((strcmp(opts.mode, "scaling") != 0 && strcmp(opts.mode, "wss") != 0
+                && strcmp(opts.mode, "soak") != 0)
+            || opts.num_keys == 0 || opts.duration_ns == 0 || opts.runs <= 0
+            || opts.interval_ns == 0
+            || opts.wss_max_keys < WSS_MIN_KEYS
+            || (strcmp(opts.format, "csv") != 0
+                && strcmp(opts.format, "json") != 0))
+        usage(argv[0]);
+
+    num_cpus = bench_cpus(cpus, MAX_THREADS, opts.placement);
+    if (num_cpus <= 0) {
+        fprintf(stderr, "cannot list the available cpus\n");
+        return 1;
+    }
+
+    if (opts.max_threads > 0)
+        num_cpus = MIN(num_cpus, opts.max_threads);
+
+    out = stdout;
+    if (opts.output != NULL) {
+        out = fopen(opts.output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "cannot open %s\n", opts.output);
+            return 1;
+        }
+    }
+
+    report_begin(num_cpus);
+
+    if (strcmp(opts.mode, "scaling") == 0)
+        rv = run_scaling(cpus, num_cpus);
+    else if (strcmp(opts.mode, "wss") == 0)
+        rv = run_wss(cpus, num_cpus);
+    else
+        rv = run_soak(cpus, num_cpus);
+
+    report_end();
+    if (out != stdout)
+        fclose(out);
+
+    return rv == 0 ? 0 : 1;
+}
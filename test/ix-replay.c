@@ -0,0 +1,421 @@
+#define _POSIX_C_SOURCE 200809L /* getopt(), pthread barriers */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "sht.h"
+
+/* replay a trace recorded with sht_trace_start() against an engine, each
+ * thread of the trace by a thread of its own. Keys are not recorded: each
+ * (hash, key length) pair of the trace is given a key of its own */
+
+#define MAX_THREADS 1024
+#define MAX_KEYLEN 1024 /* longer keys are truncated */
+
+struct options {
+    struct bench_engine const * engine;
+    double speed; /* 0: as fast as possible */
+    int prefill;
+};
+
+static struct options opts = {
+    .speed = 1,
+    .prefill = 1,
+};
+
+struct replay_thread {
+    uint32_t num_records;
+    struct sht_trace_record * records;
+    char ** keys;
+    char * key_data;
+
+    void * table;
+    int failed;
+    struct bench_hist latency; /* from the recorded time, scaled */
+    struct bench_hist service;
+};
+
+static struct replay_thread * threads;
+static int num_threads;
+static uint64_t first_ns;
+
+static enum bench_op const ops[] = {
+    [SHT_TRACE_LOOKUP] = BENCH_LOOKUP,
+    [SHT_TRACE_INSERT] = BENCH_INSERT,
+    [SHT_TRACE_LOOKUP_INSERT] = BENCH_LOOKUP_INSERT,
+    [SHT_TRACE_REMOVE] = BENCH_REMOVE,
+};
+
+static size_t
+record_keylen(struct sht_trace_record const * r)
+{
+    return MAX(MIN(SHT_TRACE_KEYLEN(r), MAX_KEYLEN), 1);
+}
+
+/* the same key for the same (hash, key length) */
+static void
+make_key(struct sht_trace_record const * r, char * key)
+{
+    size_t i, len = record_keylen(r);
+    uint64_t rng = ((uint64_t) r->hash << 32 | len) ^ 0x9e3779b97f4a7c15ULL;
+    uint64_t x = 0;
+
+    for (i = 0 ; i < len ; i++) {
+        if ((i & 7) == 0)
+            x = bench_rand(&rng);
+
+        key[i] = x >> (8 * (i & 7));
+    }
+}
+
+static struct replay_thread *
+trace_thread(uint32_t id)
+{
+    void * mem;
+    int n;
+
+    if (id >= MAX_THREADS)
+        return NULL;
+
+    if ((int) id >= num_threads) {
+        n = id + 1;
+        mem = realloc(threads, n * sizeof(*threads));
+        if (mem == NULL)
+            return NULL;
+
+        threads = mem;
+        memset(&threads[num_threads], 0,
+                (n - num_threads) * sizeof(*threads));
+        num_threads = n;
+    }
+
+    return &threads[id];
+}
+
+static int
+load_trace(char const * path)
+{
+    FILE * f;
+    void * mem;
+    uint32_t i;
+    size_t size;
+    struct replay_thread * t;
+    struct sht_trace_header hdr;
+    struct sht_trace_block block;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != SHT_TRACE_MAGIC
+            || hdr.version != SHT_TRACE_VERSION
+            || hdr.record_size != sizeof(struct sht_trace_record)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        goto err;
+    }
+
+    first_ns = UINT64_MAX;
+    while (fread(&block, sizeof(block), 1, f) == 1) {
+        t = trace_thread(block.thread);
+        if (t == NULL)
+            goto err_format;
+
+        size = (size_t) t->num_records + block.num_records;
+        mem = realloc(t->records, size * sizeof(*t->records));
+        if (mem == NULL)
+            goto err_format;
+
+        t->records = mem;
+        if (fread(&t->records[t->num_records], sizeof(*t->records),
+                    block.num_records, f) != block.num_records)
+            goto err_format;
+
+        for (i = 0 ; i < block.num_records ; i++)
+            first_ns = MIN(first_ns, t->records[t->num_records + i].ns);
+
+        t->num_records = size;
+    }
+
+    fclose(f);
+    return 0;
+
+err_format:
+    fprintf(stderr, "%s: truncated or too large trace\n", path);
+err:
+    fclose(f);
+    return -1;
+}
+
+static int
+make_keys(struct replay_thread * t)
+{
+    uint32_t i;
+    size_t len;
+
+    len = 0;
+    for (i = 0 ; i < t->num_records ; i++)
+        len += record_keylen(&t->records[i]);
+
+    t->keys = malloc(t->num_records * sizeof(*t->keys));
+    t->key_data = malloc(len);
+    if (t->keys == NULL || t->key_data == NULL)
+        return -1;
+
+    len = 0;
+    for (i = 0 ; i < t->num_records ; i++) {
+        t->keys[i] = t->key_data + len;
+        make_key(&t->records[i], t->keys[i]);
+        len += record_keylen(&t->records[i]);
+    }
+
+    return 0;
+}
+
+static int
+has_writes(struct replay_thread const * t)
+{
+    uint32_t i;
+
+    for (i = 0 ; i < t->num_records ; i++) {
+        if (SHT_TRACE_OP(&t->records[i]) != SHT_TRACE_LOOKUP)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* the keys of the trace, as if it was recorded on a populated table */
+static int
+prefill(void * table)
+{
+    int i;
+    uint32_t r;
+    void * handle;
+    struct bench_engine const * e = opts.engine;
+
+    handle = bench_engine_attach(e, table, 0);
+    if (handle == NULL)
+        return -1;
+
+    for (i = 0 ; i < num_threads ; i++) {
+        for (r = 0 ; r < threads[i].num_records ; r++)
+            bench_engine_op(e, handle, BENCH_LOOKUP_INSERT,
+                    threads[i].keys[r],
+                    record_keylen(&threads[i].records[r]));
+    }
+
+    bench_engine_detach(e, handle);
+
+    return 0;
+}
+
+static void
+replay_thread(struct bench_threads * bt, int id)
+{
+    uint32_t i, op;
+    void * handle;
+    uint64_t start, intended, begin, end;
+    struct replay_thread * t = &threads[id];
+    struct sht_trace_record const * r;
+
+    (void) bt;
+
+    handle = bench_engine_attach(opts.engine, t->table, id);
+    if (handle == NULL) {
+        t->failed = 1;
+        return;
+    }
+
+    start = bench_now_ns();
+    for (i = 0 ; i < t->num_records ; i++) {
+        r = &t->records[i];
+
+        begin = bench_now_ns();
+        intended = begin;
+        if (opts.speed > 0) {
+            intended = start + (uint64_t) ((r->ns - first_ns) / opts.speed);
+            while ((begin = bench_now_ns()) < intended)
+                cpu_relax();
+        }
+
+        op = SHT_TRACE_OP(r);
+        bench_engine_op(opts.engine, handle,
+                op < arraylen(ops) ? ops[op] : BENCH_LOOKUP,
+                t->keys[i], record_keylen(r));
+        end = bench_now_ns();
+
+        bench_hist_record(&t->latency, end - intended);
+        bench_hist_record(&t->service, end - begin);
+    }
+
+    bench_engine_detach(opts.engine, handle);
+}
+
+static void
+print_hist(char const * name, struct bench_hist const * hist)
+{
+    printf("%s (ns): p50 %lu p99 %lu p99.9 %lu p99.99 %lu max %lu\n", name,
+            bench_hist_percentile(hist, 50), bench_hist_percentile(hist, 99),
+            bench_hist_percentile(hist, 99.9),
+            bench_hist_percentile(hist, 99.99), hist->max);
+}
+
+static int
+replay(void)
+{
+    int i, n, writer;
+    void * table;
+    uint64_t num_records, elapsed;
+    struct replay_thread tmp;
+    struct bench_hist latency = {0}, service = {0};
+    static int cpus[MAX_THREADS];
+    struct bench_threads bt = {
+        .num_threads = num_threads,
+        .cpus = cpus,
+        .fn = replay_thread,
+    };
+
+    writer = -1;
+    num_records = 0;
+    for (i = 0 ; i < num_threads ; i++) {
+        if (make_keys(&threads[i]) != 0) {
+            fprintf(stderr, "cannot allocate the keys\n");
+            return -1;
+        }
+
+        num_records += threads[i].num_records;
+        if (!has_writes(&threads[i]))
+            continue;
+
+        if (writer >= 0 && (opts.engine->flags & BENCH_ENGINE_SINGLE_WRITER)) {
+            fprintf(stderr, "%s: several threads of the trace modify the "
+                    "table\n", opts.engine->name);
+            return -1;
+        }
+
+        writer = i;
+    }
+
+    /* the writer of single writer engines is their thread 0 */
+    if ((opts.engine->flags & BENCH_ENGINE_SINGLE_WRITER) && writer > 0) {
+        tmp = threads[0];
+        threads[0] = threads[writer];
+        threads[writer] = tmp;
+    }
+
+    /* more threads in the trace than cpus: they share them */
+    n = bench_cpus(cpus, MAX_THREADS, BENCH_PLACE_CORE);
+    if (n <= 0)
+        bt.cpus = NULL;
+
+    for (i = n ; n > 0 && i < num_threads ; i++)
+        cpus[i] = cpus[i % n];
+
+    table = opts.engine->create(num_records, num_threads);
+    if (table == NULL) {
+        fprintf(stderr, "%s: cannot create the table\n", opts.engine->name);
+        return -1;
+    }
+
+    if (opts.prefill && prefill(table) != 0) {
+        opts.engine->destroy(table);
+        return -1;
+    }
+
+    for (i = 0 ; i < num_threads ; i++)
+        threads[i].table = table;
+
+    elapsed = bench_threads_run(&bt);
+
+    for (i = 0 ; i < num_threads ; i++) {
+        if (threads[i].failed) {
+            fprintf(stderr, "%s: cannot attach thread %d\n",
+                    opts.engine->name, i);
+            opts.engine->destroy(table);
+            return -1;
+        }
+
+        bench_hist_merge(&latency, &threads[i].latency);
+        bench_hist_merge(&service, &threads[i].service);
+    }
+
+    opts.engine->destroy(table);
+
+    printf("engine %s, %d threads, %lu operations, speed %g\n",
+            opts.engine->name, num_threads, num_records, opts.speed);
+    printf("elapsed: %.3fs, %.0f ops/s\n", elapsed / 1e9,
+            elapsed == 0 ? 0 : num_records * 1e9 / elapsed);
+    print_hist("latency", &latency);
+    print_hist("service", &service);
+
+    return 0;
+}
+
+static void
+usage(char const * prog)
+{
+    int i;
+
+    fprintf(stderr, "usage: %s [-e engine] [-s speed] [-n] trace\n", prog);
+    fprintf(stderr, "engines:");
+    for (i = 0 ; i < bench_num_engines ; i++)
+        fprintf(stderr, " %s", bench_engines[i].name);
+
+    fprintf(stderr, ", sht by default\n");
+    fprintf(stderr, "-s: 1 for the recorded pace (default), 2 for twice as "
+            "fast..., 0 as fast as possible\n");
+    fprintf(stderr, "-n: do not insert the keys of the trace beforehand\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    int c, i, rv;
+
+    opts.engine = bench_engine_find("sht");
+    while ((c = getopt(argc, argv, "e:s:nh")) != -1) {
+        switch (c) {
+        case 'e':
+            opts.engine = bench_engine_find(optarg);
+            if (opts.engine == NULL)
+                usage(argv[0]);
+            break;
+        case 's':
+            opts.speed = strtod(optarg, NULL);
+            break;
+        case 'n':
+            opts.prefill = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || opts.speed < 0)
+        usage(argv[0]);
+
+    rv = load_trace(argv[optind]);
+    if (rv == 0 && num_threads == 0) {
+        fprintf(stderr, "%s: empty trace\n", argv[optind]);
+        rv = -1;
+    }
+
+    if (rv == 0)
+        rv = replay();
+
+    for (i = 0 ; i < num_threads ; i++) {
+        free(threads[i].records);
+        free(threads[i].keys);
+        free(threads[i].key_data);
+    }
+    free(threads);
+
+    return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE /* usleep() */
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "common.h"
+#include "psht.h"
+
+#define NUM_HT_LINES 10
+#define MEM_SIZE (16 << 20)
+#define NUM_PROCS 8
+#define NUM_KEYS (10 * 1000)
+#define NUM_KILLS 20
+
+static struct psht * h;
+
+/* every process inserts its share of the keys, and looks them all up */
+static void
+worker(int id)
+{
+    int i, rv, value;
+    size_t valuelen;
+
+    for (i = id ; i < NUM_KEYS ; i += NUM_PROCS) {
+        value = -i;
+        rv = psht_insert(h, &i, sizeof(i), &value, sizeof(value));
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        valuelen = sizeof(value);
+        rv = psht_lookup(h, &i, sizeof(i), &value, &valuelen);
+        check(rv != 0 || value == -i);
+    }
+}
+
+/* insert and remove as fast as possible, until killed */
+static void
+churner(void)
+{
+    int i;
+
+    for (i = 0 ; ; i = (i + 1) % NUM_KEYS) {
+        psht_insert(h, &i, sizeof(i), &i, sizeof(i));
+        psht_remove(h, &i, sizeof(i));
+    }
+}
+
+static void
+run_workers(void)
+{
+    int i, rv, status, value;
+    size_t valuelen;
+    pid_t pids[NUM_PROCS];
+
+    for (i = 0 ; i < NUM_PROCS ; i++) {
+        pids[i] = fork();
+        check(pids[i] >= 0);
+        if (pids[i] == 0) {
+            worker(i);
+            exit(0);
+        }
+    }
+
+    for (i = 0 ; i < NUM_PROCS ; i++) {
+        rv = waitpid(pids[i], &status, 0);
+        check(rv == pids[i]);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    /* test all the entries have been inserted */
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        valuelen = sizeof(value);
+        rv = psht_lookup(h, &i, sizeof(i), &value, &valuelen);
+        check(rv == 0 && value == -i);
+
+        rv = psht_remove(h, &i, sizeof(i));
+        check(rv == 0);
+    }
+}
+
+static void
+run_kills(void)
+{
+    int i, j, rv, status;
+    pid_t pid;
+
+    for (i = 0 ; i < NUM_KILLS ; i++) {
+        pid = fork();
+        check(pid >= 0);
+        if (pid == 0)
+            churner();
+
+        usleep(1000 + rand() % 1000);
+        kill(pid, SIGKILL);
+        rv = waitpid(pid, &status, 0);
+        check(rv == pid);
+
+        /* whatever the churner was doing, the table must remain usable */
+        for (j = 0 ; j < NUM_KEYS ; j++) {
+            psht_remove(h, &j, sizeof(j));
+            rv = psht_insert(h, &j, sizeof(j), &j, sizeof(j));
+            check(rv == 0);
+            rv = psht_remove(h, &j, sizeof(j));
+            check(rv == 0);
+        }
+    }
+}
+
+int main(void)
+{
+    srand(0);
+
+    h = psht_create(NULL, NUM_HT_LINES, MEM_SIZE);
+    check(h != NULL);
+
+    run_workers();
+    printf("### dump after workers\n");
+    psht_dump_stats(h);
+
+    run_kills();
+    printf("### dump after kills\n");
+    psht_dump_stats(h);
+
+    psht_close(h);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "psht.h"
+
+#define MEM_SIZE (1 << 20)
+
+static void
+test_creation(void)
+{
+    int i;
+    struct psht * h;
+    int sizes[] = {-1, 0, 1, 10, 100, 1 << 10};
+
+    for (i = 0 ; i < arraylen(sizes) ; i++) {
+        h = psht_create(NULL, sizes[i], MEM_SIZE);
+        check(h != NULL);
+        psht_close(h);
+    }
+
+    /* the lines do not fit in the region */
+    h = psht_create(NULL, 1 << 20, MEM_SIZE);
+    check(h == NULL);
+}
+
+static void
+test_insert_lookup_remove(void)
+{
+    struct psht * h;
+    int rv;
+    int key = 42;
+    int value = 23;
+    int out = 0;
+    size_t outlen;
+
+    h = psht_create(NULL, 10, MEM_SIZE);
+    check(h != NULL);
+
+    rv = psht_insert(h, NULL, sizeof(key), &value, sizeof(value));
+    check(rv != 0);
+
+    rv = psht_insert(h, &key, 0, &value, sizeof(value));
+    check(rv != 0);
+
+    rv = psht_insert(h, &key, sizeof(key), &value, sizeof(value));
+    check(rv == 0);
+
+    /* no duplicates */
+    rv = psht_insert(h, &key, sizeof(key), &value, sizeof(value));
+    check(rv != 0);
+
+    outlen = sizeof(out);
+    rv = psht_lookup(h, &value, sizeof(value), &out, &outlen);
+    check(rv != 0);
+
+    rv = psht_lookup(h, &key, sizeof(key), &out, &outlen);
+    check(rv == 0 && out == value && outlen == sizeof(value));
+
+    rv = psht_remove(h, &key, sizeof(key));
+    check(rv == 0);
+
+    rv = psht_lookup(h, &key, sizeof(key), NULL, NULL);
+    check(rv != 0);
+
+    rv = psht_remove(h, &key, sizeof(key));
+    check(rv != 0);
+
+    psht_close(h);
+}
+
+static void
+test_full(void)
+{
+    struct psht * h;
+    int rv, i, n;
+
+    h = psht_create(NULL, 10, 1 << 14);
+    check(h != NULL);
+
+    /* fill the region, then check freed blocks get reused */
+    for (n = 0 ; psht_insert(h, &n, sizeof(n), NULL, 0) == 0 ; n++)
+        ;
+
+    check(n > 0);
+
+    for (i = 0 ; i < n ; i++) {
+        rv = psht_remove(h, &i, sizeof(i));
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < n ; i++) {
+        rv = psht_insert(h, &i, sizeof(i), NULL, 0);
+        check(rv == 0);
+    }
+
+    psht_close(h);
+}
+
+static void
+test_open(void)
+{
+    struct psht * h, * h2;
+    char name[64];
+    int rv;
+    int key = 42;
+    int value = 23;
+    int out = 0;
+    size_t outlen = sizeof(out);
+
+    snprintf(name, sizeof(name), "/psht-unittest-%d", rand());
+
+    h = psht_create(name, 10, MEM_SIZE);
+    check(h != NULL);
+
+    /* exclusive creation */
+    h2 = psht_create(name, 10, MEM_SIZE);
+    check(h2 == NULL);
+
+    h2 = psht_open(name);
+    check(h2 != NULL);
+
+    rv = psht_insert(h, &key, sizeof(key), &value, sizeof(value));
+    check(rv == 0);
+
+    rv = psht_lookup(h2, &key, sizeof(key), &out, &outlen);
+    check(rv == 0 && out == value);
+
+    psht_close(h2);
+    psht_close(h);
+    rv = psht_unlink(name);
+    check(rv == 0);
+
+    h = psht_open(name);
+    check(h == NULL);
+}
+
+int main(void)
+{
+    test_creation();
+    test_insert_lookup_remove();
+    test_full();
+    test_open();
+
+    return 0;
+}
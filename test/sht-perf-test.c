@@ -1,4 +1,5 @@
-#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#define _POSIX_C_SOURCE 200809L /* getopt(), pthread barriers */
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stddef.h>
@@ -6,143 +7,635 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "bench.h"
 #include "common.h"
 #include "sht.h"
 
 #define NUM_HT_LINES (1 << 10)
 #define NUM_KEYS (NUM_HT_LINES << 4)
-#define NUM_THREADS 100
 #define NUM_ACTIONS (NUM_KEYS << 4)
 
+#define MAX_THREADS 1024
+#define DEFAULT_DURATION_MS 1000
+#define DEFAULT_RATE 100000
+#define DEFAULT_WSS_MAX_KEYS (1 << 22)
+#define WSS_MIN_KEYS (1 << 8)
+#define WSS_MIN_OPS (1 << 20)
+
 static struct sht * h;
 
-struct test_entry {
-    void * key;
-    void * value;
-    size_t keylen;
+struct options {
+    char const * mode;
+    int max_threads;
+    enum bench_placement placement;
+    struct bench_mix const * mix; /* NULL for all of them */
+    uint64_t duration_ns;
+    int num_keys;
+    int64_t size;  /* of the table, default: num_keys */
+    double rate;   /* open-loop operations per second, all threads */
+    uint64_t wss_max_keys;
+    char const * layout; /* NULL for all of them */
+    char const * trace;  /* of the stress run, for ix-replay */
 };
-static struct test_entry ** test_values;
 
-static inline int random_int(int max)
-{
-    return rand() % max;
-}
+static struct options opts = {
+    .mode = "stress",
+    .placement = BENCH_PLACE_CORE,
+    .duration_ns = DEFAULT_DURATION_MS * 1000000ULL,
+    .num_keys = NUM_KEYS,
+    .size = -1,
+    .rate = DEFAULT_RATE,
+    .wss_max_keys = DEFAULT_WSS_MAX_KEYS,
+};
 
-static inline void * random_ptr(void)
-{
-    return (void*) (uintptr_t) rand();
-}
+static uint64_t * keys;
+
+/* per-thread results, on their own cacheline */
+struct thread_result {
+    uint64_t ops;
+} CACHE_ALIGNED;
+
+static struct thread_result results[MAX_THREADS];
 
 static void
-init_test_values(void)
+init_keys(size_t num_keys)
 {
-    int i;
-    void * key;
-    struct test_entry * e;
+    size_t i;
 
-    test_values = malloc(NUM_KEYS * sizeof(*test_values));
-
-    for (i = 0 ; i < NUM_KEYS ; i++) {
-        e = malloc(sizeof(*e));
-        key = malloc(sizeof(int));
-        *(int*) key = i;
+    keys = malloc(num_keys * sizeof(*keys));
+    if (keys == NULL) {
+        fprintf(stderr, "cannot allocate %zu keys\n", num_keys);
+        exit(1);
+    }
 
-        *e = (struct test_entry) {
-            .key = key,
-            .value = random_ptr(),
-            .keylen = sizeof(int),
-        };
+    for (i = 0 ; i < num_keys ; i++)
+        keys[i] = i;
+}
 
-        test_values[i] = e;
+static inline
+void do_op(enum bench_op op, uint64_t * key)
+{
+    switch (op) {
+    case BENCH_LOOKUP:
+        sht_lookup(h, key, sizeof(*key));
+        break;
+    case BENCH_INSERT:
+        sht_insert(h, key, sizeof(*key), key);
+        break;
+    case BENCH_REMOVE:
+        sht_remove(h, key, sizeof(*key));
+        break;
+    case BENCH_LOOKUP_INSERT:
+    default:
+        sht_lookup_insert(h, key, sizeof(*key), key);
+        break;
     }
 }
 
+/* insert every other key: lookups hit half the time */
 static void
-deinit_test_values(void)
+prefill(int num_keys)
 {
     int i;
-    struct test_entry * e;
-
-    for (i = 0 ; i < NUM_KEYS ; i++) {
-        e = test_values[i];
-        free(e->key);
-        free(e);
-    }
 
-    free(test_values);
+    for (i = 0 ; i < num_keys ; i += 2)
+        sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
 }
 
-static void *
-sht_test_thread(void * void_args)
+/*
+ * stress: random operations, one thread per cpu
+ */
+
+static void
+stress_thread(struct bench_threads * t, int id)
 {
     int i;
-    struct test_entry * e;
+    uint64_t r, rng;
 
-    (void) void_args;
+    (void) t;
 
-    /* all threads insert all keys once (the same at about the same time) */
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
     for (i = 0 ; i < NUM_ACTIONS ; i++) {
-        e = test_values[random_int(NUM_KEYS)];
-        switch (random_int(4)) {
-        case 0:
-            sht_remove(h, e->key, e->keylen);
-            break;
-        case 1:
-            sht_insert(h, e->key, e->keylen, e->value);
-            break;
-        case 2:
-            sht_lookup(h, e->key, e->keylen);
-            break;
-        case 3:
-            sht_lookup_insert(h, e->key, e->keylen, e->value);
-            break;
-        }
+        r = bench_rand(&rng);
+        do_op((r >> 32) % BENCH_NUM_OPS, &keys[r % NUM_KEYS]);
     }
-
-    return NULL;
 }
 
 /* Dummy hash function so that the cost of hashing is at its lowest
  * by construction, all the hash values will be different, and keylen
- * will always equal 4 */
+ * will always equal 8 */
 static
 uint32_t dummy_hash(void * data, size_t len)
 {
     (void) len;
-    return *(uint32_t*) data;
+    return *(uint64_t*) data;
 }
 
-
-int main(void)
+static int
+run_stress(int const * cpus, int num_cpus)
 {
-    int i;
-    cpu_set_t cpuset;
-    pthread_t threads[NUM_THREADS] = {0};
-    void * thread_rv[NUM_THREADS];
+    int fd = -1;
+    struct bench_threads t = {
+        .num_threads = num_cpus,
+        .cpus = cpus,
+        .fn = stress_thread,
+    };
 
     h = sht_create_custom(NUM_HT_LINES, NULL, NULL, dummy_hash);
+    if (h == NULL)
+        return -1;
 
-    srand(0);
-    init_test_values();
+    if (opts.trace != NULL) {
+        fd = open(opts.trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || sht_trace_start(h, fd, 1) != 0) {
+            fprintf(stderr, "cannot trace to %s\n", opts.trace);
+            if (fd >= 0)
+                close(fd);
 
-    CPU_ZERO(&cpuset);
-    for (i = 0 ; i < NUM_THREADS ; i++) {
-        pthread_create(&threads[i], NULL, &sht_test_thread, NULL);
-        CPU_SET(i, &cpuset);
-        pthread_setaffinity_np(threads[i], sizeof(cpu_set_t), &cpuset);
+            sht_destroy(h);
+            return -1;
+        }
     }
 
-    /* join all threads */
-    for (i = 0 ; i < NUM_THREADS ; i++)
-        pthread_join(threads[i], (void **) &thread_rv[i]);
+    init_keys(NUM_KEYS);
+    bench_threads_run(&t);
+
+    if (fd >= 0) {
+        if (sht_trace_stop(h) != 0)
+            fprintf(stderr, "%s: incomplete trace\n", opts.trace);
+
+        close(fd);
+    }
 
     /* dump stats */
     printf("### dump hashtable\n");
     sht_dump_stats(h);
 
-    deinit_test_values();
     sht_destroy(h);
+    free(keys);
 
     return 0;
 }
+
+/*
+ * scaling: throughput of 1 to max_threads threads, for each mix
+ */
+
+static void
+scaling_thread(struct bench_threads * t, int id)
+{
+    uint64_t r, rng, ops;
+    struct bench_mix const * mix = t->arg;
+
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+    ops = 0;
+    while (!bench_should_stop(t)) {
+        r = bench_rand(&rng);
+        do_op(bench_mix_pick(mix, r >> 32), &keys[r % opts.num_keys]);
+        ops++;
+    }
+
+    results[id].ops = ops;
+}
+
+static double
+scaling_run(struct bench_mix const * mix, int const * cpus, int num_threads)
+{
+    int i;
+    uint64_t ops, elapsed;
+    struct bench_threads t = {
+        .num_threads = num_threads,
+        .cpus = cpus,
+        .duration_ns = opts.duration_ns,
+        .fn = scaling_thread,
+        .arg = (void *) mix,
+    };
+
+    h = sht_create(opts.size);
+    if (h == NULL)
+        return -1;
+
+    prefill(opts.num_keys);
+    elapsed = bench_threads_run(&t);
+
+    ops = 0;
+    for (i = 0 ; i < num_threads ; i++)
+        ops += results[i].ops;
+
+    sht_destroy(h);
+
+    return ops * 1e9 / elapsed;
+}
+
+/* 1, 2, 4... and the number of cpus */
+static int
+next_num_threads(int n, int max)
+{
+    return (n < max && 2 * n > max) ? max : 2 * n;
+}
+
+static int
+run_scaling(int const * cpus, int num_cpus)
+{
+    int m, n;
+    double rate, single;
+    struct bench_mix const * mix;
+
+    init_keys(opts.num_keys);
+
+    printf("# mix placement threads ops/s efficiency\n");
+    for (m = 0 ; m < bench_num_mixes ; m++) {
+        mix = &bench_mixes[m];
+        if (opts.mix != NULL && opts.mix != mix)
+            continue;
+
+        single = 0;
+        for (n = 1 ; n <= num_cpus ; n = next_num_threads(n, num_cpus)) {
+            rate = scaling_run(mix, cpus, n);
+            if (rate < 0)
+                return -1;
+
+            if (n == 1)
+                single = rate;
+
+            printf("%s %s %d %.0f %.2f\n", mix->name,
+                    bench_placement_name(opts.placement), n, rate,
+                    rate / (n * single));
+            fflush(stdout);
+        }
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+/*
+ * openloop: operations issued on a fixed schedule, whatever the latency
+ * of the previous ones. Latency is measured from the time an operation
+ * was meant to start, so that a stalled thread accounts for all the
+ * operations it should have sent meanwhile (coordinated omission).
+ */
+
+struct openloop_result {
+    uint64_t ops;
+    struct bench_hist latency; /* from the intended start */
+    struct bench_hist service; /* from the actual start */
+} CACHE_ALIGNED;
+
+static struct openloop_result * openloop_results;
+
+static void
+openloop_thread(struct bench_threads * t, int id)
+{
+    uint64_t i, r, rng, start, intended, begin, end;
+    double period = 1e9 / opts.rate;
+    struct bench_mix const * mix = t->arg;
+    struct openloop_result * res = &openloop_results[id];
+
+    /* thread id sends the operations id, id + n, id + 2n... */
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+    start = bench_now_ns();
+    for (i = id ; !bench_should_stop(t) ; i += t->num_threads) {
+        intended = start + (uint64_t) (i * period);
+        while ((begin = bench_now_ns()) < intended) {
+            if (bench_should_stop(t))
+                return;
+
+            cpu_relax();
+        }
+
+        r = bench_rand(&rng);
+        do_op(bench_mix_pick(mix, r >> 32), &keys[r % opts.num_keys]);
+        end = bench_now_ns();
+
+        bench_hist_record(&res->latency, end - intended);
+        bench_hist_record(&res->service, end - begin);
+        res->ops++;
+    }
+
+    /* the operations that were due but never sent are late too */
+    end = bench_now_ns();
+    for ( ; (intended = start + (uint64_t) (i * period)) < end ;
+            i += t->num_threads)
+        bench_hist_record(&res->latency, end - intended);
+}
+
+static void
+print_hist(struct bench_hist const * hist)
+{
+    printf(" %lu %lu %lu %lu %lu",
+            bench_hist_percentile(hist, 50), bench_hist_percentile(hist, 99),
+            bench_hist_percentile(hist, 99.9),
+            bench_hist_percentile(hist, 99.99), hist->max);
+}
+
+static int
+openloop_run(struct bench_mix const * mix, int const * cpus, int num_threads)
+{
+    int i;
+    uint64_t ops, elapsed;
+    struct bench_hist latency = {0}, service = {0};
+    struct bench_threads t = {
+        .num_threads = num_threads,
+        .cpus = cpus,
+        .duration_ns = opts.duration_ns,
+        .fn = openloop_thread,
+        .arg = (void *) mix,
+    };
+
+    openloop_results = calloc(num_threads, sizeof(*openloop_results));
+    if (openloop_results == NULL)
+        return -1;
+
+    h = sht_create(opts.size);
+    if (h == NULL) {
+        free(openloop_results);
+        return -1;
+    }
+
+    prefill(opts.num_keys);
+    elapsed = bench_threads_run(&t);
+
+    ops = 0;
+    for (i = 0 ; i < num_threads ; i++) {
+        ops += openloop_results[i].ops;
+        bench_hist_merge(&latency, &openloop_results[i].latency);
+        bench_hist_merge(&service, &openloop_results[i].service);
+    }
+
+    printf("%s %d %.0f %.0f", mix->name, num_threads, opts.rate,
+            ops * 1e9 / elapsed);
+    print_hist(&latency);
+    print_hist(&service);
+    printf("\n");
+    fflush(stdout);
+
+    sht_destroy(h);
+    free(openloop_results);
+
+    return 0;
+}
+
+static int
+run_openloop(int const * cpus, int num_cpus)
+{
+    int m;
+    struct bench_mix const * mix;
+
+    init_keys(opts.num_keys);
+
+    printf("# latency and service time, in ns: p50 p99 p99.9 p99.99 max\n");
+    printf("# mix threads target-ops/s ops/s latency service\n");
+    for (m = 0 ; m < bench_num_mixes ; m++) {
+        mix = &bench_mixes[m];
+        if (opts.mix != NULL && opts.mix != mix)
+            continue;
+
+        if (openloop_run(mix, cpus, num_cpus) != 0)
+            return -1;
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+/*
+ * wss: lookup cost as the table outgrows each cache level, for hits and
+ * misses, on a single thread
+ */
+
+static struct {
+    char const * name;
+    int flags;
+} const layouts[] = {
+    { "locked", 0 },
+    { "swmr", SHT_F_SWMR },
+    { "nosync", SHT_F_NOSYNC },
+};
+
+static int
+layout_find(char const * name)
+{
+    int i;
+
+    for (i = 0 ; i < arraylen(layouts) ; i++) {
+        if (strcmp(name, layouts[i].name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+struct wss_result {
+    double ns;
+    double misses[BENCH_NUM_COUNTERS];
+};
+
+/* look up random keys among [base, base + n), n a power of 2 */
+static void
+wss_measure(struct bench_counters * c, uint64_t base, uint64_t n,
+        struct wss_result * res)
+{
+    int i;
+    uint64_t op, num_ops, r, rng, elapsed, key;
+    uint64_t values[BENCH_NUM_COUNTERS];
+
+    num_ops = MAX(n, WSS_MIN_OPS);
+    rng = 0x9e3779b97f4a7c15ULL;
+
+    /* key i is i: computing the keys keeps their array out of the cache
+     * misses measured */
+    bench_counters_start(c);
+    elapsed = bench_now_ns();
+    for (op = 0 ; op < num_ops ; op++) {
+        r = bench_rand(&rng);
+        key = base + (r & (n - 1));
+        sht_lookup(h, &key, sizeof(key));
+    }
+    elapsed = bench_now_ns() - elapsed;
+    bench_counters_stop(c, values);
+
+    res->ns = (double) elapsed / num_ops;
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++)
+        res->misses[i] = values[i] == BENCH_COUNTER_NONE
+            ? -1 : (double) values[i] / num_ops;
+}
+
+static void
+print_wss_result(struct wss_result const * res)
+{
+    int i;
+
+    printf(" %.1f", res->ns);
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++) {
+        if (res->misses[i] < 0)
+            printf(" -");
+        else
+            printf(" %.2f", res->misses[i]);
+    }
+}
+
+static int
+run_wss(int const * cpus, int num_cpus)
+{
+    int i, l;
+    uint64_t n, k;
+    struct bench_counters c;
+    struct wss_result hits, misses;
+
+    (void) num_cpus;
+
+    /* only the keys inserted, the lookups compute theirs */
+    init_keys(opts.wss_max_keys);
+    bench_pin(cpus[0]);
+    if (bench_counters_open(&c) == 0)
+        fprintf(stderr, "no hardware counter available\n");
+
+    printf("# layout keys hits: ns/op");
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++)
+        printf(" %s/op", bench_counter_name(i));
+
+    printf(" misses: ns/op");
+    for (i = 0 ; i < BENCH_NUM_COUNTERS ; i++)
+        printf(" %s/op", bench_counter_name(i));
+
+    printf("\n");
+
+    for (l = 0 ; l < arraylen(layouts) ; l++) {
+        if (opts.layout != NULL && strcmp(opts.layout, layouts[l].name) != 0)
+            continue;
+
+        for (n = WSS_MIN_KEYS ; n <= opts.wss_max_keys ; n *= 2) {
+            h = sht_create_ext(n, layouts[l].flags, NULL, NULL, NULL);
+            if (h == NULL)
+                return -1;
+
+            for (k = 0 ; k < n ; k++)
+                sht_insert(h, &keys[k], sizeof(keys[k]), &keys[k]);
+
+            wss_measure(&c, 0, n, &hits);
+            wss_measure(&c, n, n, &misses);
+
+            printf("%s %lu", layouts[l].name, n);
+            print_wss_result(&hits);
+            print_wss_result(&misses);
+            printf("\n");
+            fflush(stdout);
+
+            sht_destroy(h);
+        }
+    }
+
+    bench_counters_close(&c);
+    free(keys);
+
+    return 0;
+}
+
+static void
+usage(char const * prog)
+{
+    int i;
+
+    fprintf(stderr, "usage: %s [-m mode] [-t max threads] [-p placement] "
+            "[-x mix] [-d duration ms] [-k keys] [-s table size] "
+            "[-r ops/s] [-M wss max keys] [-l layout] [-w trace]\n", prog);
+    fprintf(stderr, "modes: stress (default), scaling, openloop, wss\n");
+    fprintf(stderr, "placements: core (default), smt, socket\n");
+    fprintf(stderr, "mixes (lookup/insert/remove/lookup-insert %%):");
+    for (i = 0 ; i < bench_num_mixes ; i++)
+        fprintf(stderr, " %s", bench_mixes[i].name);
+
+    fprintf(stderr, ", all by default\n");
+    fprintf(stderr, "layouts:");
+    for (i = 0 ; i < arraylen(layouts) ; i++)
+        fprintf(stderr, " %s", layouts[i].name);
+
+    fprintf(stderr, ", all by default\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    int c, rv, num_cpus;
+    static int cpus[MAX_THREADS];
+
+    while ((c = getopt(argc, argv, "m:t:p:x:d:k:s:r:M:l:w:h")) != -1) {
+        switch (c) {
+        case 'm':
+            opts.mode = optarg;
+            break;
+        case 't':
+            opts.max_threads = atoi(optarg);
+            break;
+        case 'p':
+            if (bench_placement_parse(optarg, &opts.placement) != 0)
+                usage(argv[0]);
+            break;
+        case 'x':
+            opts.mix = bench_mix_find(optarg);
+            if (opts.mix == NULL)
+                usage(argv[0]);
+            break;
+        case 'd':
+            opts.duration_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'k':
+            opts.num_keys = atoi(optarg);
+            break;
+        case 's':
+            opts.size = strtoll(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.rate = strtod(optarg, NULL);
+            break;
+        case 'M':
+            opts.wss_max_keys = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            opts.trace = optarg;
+            break;
+        case 'l':
+            opts.layout = optarg;
+            if (layout_find(opts.layout) < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (opts.num_keys <= 0 || opts.duration_ns == 0 || !(opts.rate > 0)
+            || opts.wss_max_keys < WSS_MIN_KEYS)
+        usage(argv[0]);
+
+    if (opts.size < 0)
+        opts.size = opts.num_keys;
+
+    num_cpus = bench_cpus(cpus, MAX_THREADS, opts.placement);
+    if (num_cpus <= 0) {
+        fprintf(stderr, "cannot list the available cpus\n");
+        return 1;
+    }
+
+    if (opts.max_threads > 0)
+        num_cpus = MIN(num_cpus, opts.max_threads);
+
+    rv = -1;
+    if (strcmp(opts.mode, "stress") == 0)
+        rv = run_stress(cpus, num_cpus);
+    else if (strcmp(opts.mode, "scaling") == 0)
+        rv = run_scaling(cpus, num_cpus);
+    else if (strcmp(opts.mode, "openloop") == 0)
+        rv = run_openloop(cpus, num_cpus);
+    else if (strcmp(opts.mode, "wss") == 0)
+        rv = run_wss(cpus, num_cpus);
+    else
+        usage(argv[0]);
+
+    return rv == 0 ? 0 : 1;
+}
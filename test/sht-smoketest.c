@@ -1,6 +1,7 @@
 #define _GNU_SOURCE /* pthread_setaffinity_np() */
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -16,10 +17,10 @@
  * ~7 double-size
  */
 #define NUM_HT_LINES 10
-#define NUM_KEYS 10 * 1000
+#define NUM_KEYS (10 * 1000)
 #define MAX_KEYSIZE 100
 #define NUM_THREADS 10
-#define NUM_INSERT 100 * NUM_KEYS
+#define NUM_INSERT (100 * NUM_KEYS)
 
 static struct sht * h;
 
@@ -101,7 +102,8 @@ sht_test_thread(void * void_args)
     return NULL;
 }
 
-int main(void)
+static void
+run_smoketest(int flags)
 {
     int rv, i;
     void * ptr;
@@ -110,12 +112,9 @@ int main(void)
     pthread_t threads[NUM_THREADS] = {0};
     void * thread_rv[NUM_THREADS];
 
-    h = sht_create(NUM_HT_LINES);
+    h = sht_create_ext(NUM_HT_LINES, flags, NULL, NULL, NULL);
     check(h != NULL);
 
-    srand(0);
-    init_test_values();
-
     CPU_ZERO(&cpuset);
     for (i = 0 ; i < NUM_THREADS ; i++) {
         rv = pthread_create(&threads[i], NULL, &sht_test_thread, NULL);
@@ -157,8 +156,300 @@ int main(void)
     printf("### dump empty hashtable\n");
     sht_dump_stats(h);
 
-    deinit_test_values();
     sht_destroy(h);
+}
+
+static volatile int swmr_stop;
+
+/* even keys are always present, odd keys come and go */
+static void *
+sht_swmr_reader_thread(void * void_args)
+{
+    int i, reader;
+    void * ptr;
+    struct test_entry * e;
+
+    (void) void_args;
+
+    reader = sht_reader_register(h);
+    check(reader >= 0);
+
+    while (!__atomic_load_n(&swmr_stop, __ATOMIC_RELAXED)) {
+        for (i = 0 ; i < NUM_KEYS ; i++) {
+            e = test_values[i];
+            ptr = sht_lookup(h, e->key, e->keylen);
+            if (i % 2 == 0) {
+                check(ptr == e->value);
+            } else {
+                check(ptr == NULL || ptr == e->value);
+            }
+        }
+
+        sht_reader_quiescent(h, reader);
+    }
+
+    sht_reader_unregister(h, reader);
+
+    return NULL;
+}
+
+static void
+run_swmr_smoketest(void)
+{
+    int rv, i, j;
+    void * ptr;
+    struct test_entry * e;
+    pthread_t threads[NUM_THREADS] = {0};
+
+    h = sht_create_ext(NUM_HT_LINES, SHT_F_SWMR, NULL, NULL, NULL);
+    check(h != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i += 2) {
+        e = test_values[i];
+        rv = sht_insert(h, e->key, e->keylen, e->value);
+        check(rv == 0);
+    }
+
+    swmr_stop = 0;
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_create(&threads[i], NULL, &sht_swmr_reader_thread, NULL);
+        check(rv == 0);
+    }
+
+    /* this thread is the writer */
+    for (j = 0 ; j < 10 ; j++) {
+        for (i = 1 ; i < NUM_KEYS ; i += 2) {
+            e = test_values[i];
+            ptr = sht_lookup_insert(h, e->key, e->keylen, e->value);
+            check(ptr == e->value);
+        }
+
+        for (i = 1 ; i < NUM_KEYS ; i += 2) {
+            e = test_values[i];
+            rv = sht_remove(h, e->key, e->keylen);
+            check(rv == 0);
+        }
+
+        sht_gc(h, 0);
+    }
+
+    __atomic_store_n(&swmr_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+    }
+
+    printf("### dump swmr hashtable\n");
+    sht_dump_stats(h);
+
+    sht_destroy(h);
+}
+
+static int slab_done;
+
+/* keys multiple of 8 stay, each thread churns its share of the others */
+static void *
+sht_slab_churn_thread(void * void_args)
+{
+    int i, j, rv;
+    void * ptr;
+    struct test_entry * e;
+    int id = (int) (uintptr_t) void_args;
+
+    for (j = 0 ; j < 10 ; j++) {
+        for (i = id ; i < NUM_KEYS ; i += NUM_THREADS) {
+            if (i % 8 == 0)
+                continue;
+
+            e = test_values[i];
+            ptr = sht_lookup_insert(h, e->key, e->keylen, e->value);
+            check(ptr == e->value);
+        }
+
+        for (i = id ; i < NUM_KEYS ; i += NUM_THREADS) {
+            if (i % 8 == 0)
+                continue;
+
+            e = test_values[i];
+            rv = sht_remove(h, e->key, e->keylen);
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < NUM_KEYS ; i += 8) {
+            e = test_values[i];
+            ptr = sht_lookup(h, e->key, e->keylen);
+            check(ptr == e->value);
+        }
+    }
+
+    __atomic_fetch_add(&slab_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void
+run_slab_smoketest(void)
+{
+    int rv, i;
+    void * ptr;
+    struct test_entry * e;
+    pthread_t threads[NUM_THREADS] = {0};
+
+    slab_done = 0;
+    h = sht_create_ext(NUM_HT_LINES, SHT_F_SLAB, NULL, NULL, NULL);
+    check(h != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i += 8) {
+        e = test_values[i];
+        rv = sht_insert(h, e->key, e->keylen, e->value);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_create(&threads[i], NULL, &sht_slab_churn_thread,
+                (void *) (uintptr_t) i);
+        check(rv == 0);
+    }
+
+    /* this thread compacts while the others churn */
+    while (__atomic_load_n(&slab_done, __ATOMIC_ACQUIRE) < NUM_THREADS)
+        sht_gc(h, 64);
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+    }
+
+    while (sht_gc(h, 64) > 0)
+        ;
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        e = test_values[i];
+        ptr = sht_lookup(h, e->key, e->keylen);
+        if (i % 8 == 0) {
+            check(ptr == e->value);
+        } else {
+            check(ptr == NULL);
+        }
+    }
+
+    printf("### dump compacted hashtable\n");
+    sht_dump_stats(h);
+
+    sht_destroy(h);
+}
+
+/* all keys in a single line, so that the threads keep waiting for it */
+static uint32_t
+same_hash(void * data, size_t datalen)
+{
+    (void) data;
+    (void) datalen;
+
+    return 0;
+}
+
+#define COMBINE_MAX_ROUNDS 100
+
+/* the line index grows under the line lock: its holder gets descheduled
+ * there, and the other threads queue their inserts even on a single CPU */
+static void *
+yielding_alloc(size_t size)
+{
+    sched_yield();
+    return malloc(size);
+}
+
+static void * combine_found[NUM_THREADS][NUM_KEYS];
+
+/* each thread inserts all keys, with its own value, starting from its own
+ * share: new keys first, then the keys of the other threads */
+static void *
+sht_combine_thread(void * void_args)
+{
+    int i, j;
+    struct test_entry * e;
+    int id = (int) (uintptr_t) void_args;
+
+    for (j = 0 ; j < NUM_KEYS ; j++) {
+        i = (j + id * (NUM_KEYS / NUM_THREADS)) % NUM_KEYS;
+        e = test_values[i];
+        combine_found[id][i] = sht_lookup_insert(h, e->key, e->keylen,
+                &combine_found[id][i]);
+        check(combine_found[id][i] != NULL);
+    }
+
+    return NULL;
+}
+
+static void
+run_combine_smoketest(void)
+{
+    int rv, i, j, round;
+    void * ptr;
+    struct test_entry * e;
+    struct sht_stats stats;
+    pthread_t threads[NUM_THREADS] = {0};
+
+    stats.combined = 0;
+    for (round = 0 ; round < COMBINE_MAX_ROUNDS && stats.combined == 0
+            ; round++) {
+        h = sht_create_ext(1, 0, yielding_alloc, free, same_hash);
+        check(h != NULL);
+
+        for (i = 0 ; i < NUM_THREADS ; i++) {
+            rv = pthread_create(&threads[i], NULL, &sht_combine_thread,
+                    (void *) (uintptr_t) i);
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < NUM_THREADS ; i++) {
+            rv = pthread_join(threads[i], NULL);
+            check(rv == 0);
+        }
+
+        /* every thread got the value inserted first */
+        for (i = 0 ; i < NUM_KEYS ; i++) {
+            e = test_values[i];
+            ptr = sht_lookup(h, e->key, e->keylen);
+            check(ptr != NULL);
+            for (j = 0 ; j < NUM_THREADS ; j++)
+                check(combine_found[j][i] == ptr);
+        }
+
+        sht_get_stats(h, &stats);
+        check(stats.inserts == NUM_KEYS);
+
+        /* each key once */
+        for (i = 0 ; i < NUM_KEYS ; i++) {
+            e = test_values[i];
+            rv = sht_remove(h, e->key, e->keylen);
+            check(rv == 0);
+            rv = sht_remove(h, e->key, e->keylen);
+            check(rv != 0);
+        }
+
+        printf("### dump combined hashtable\n");
+        sht_dump_stats(h);
+        sht_destroy(h);
+    }
+
+    check(stats.combined > 0);
+}
+
+int main(void)
+{
+    srand(0);
+    init_test_values();
+
+    run_smoketest(0);
+    run_smoketest(SHT_F_SMALL);
+    run_smoketest(SHT_F_SLAB);
+    run_swmr_smoketest();
+    run_slab_smoketest();
+    run_combine_smoketest();
+
+    deinit_test_values();
 
     return 0;
 }
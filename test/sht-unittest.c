@@ -1,19 +1,47 @@
+#define _POSIX_C_SOURCE 200809L /* fileno(), mkdtemp() */
 #include <limits.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "check.h"
 #include "common.h"
 #include "sht.h"
 
 
+static void
+test_isqrt(void)
+{
+    uint64_t i, r;
+
+    check(isqrt(0) == 0);
+    check(isqrt(1) == 1);
+    check(isqrt(99) == 9);
+    check(isqrt(100) == 10);
+
+    /* sizes past 2^32 lines */
+    check(isqrt(((uint64_t) 1 << 32) - 1) == (1 << 16) - 1);
+    check(isqrt((uint64_t) 1 << 32) == 1 << 16);
+    check(isqrt((uint64_t) 1 << 33) == 92681);
+    check(isqrt(UINT64_MAX - 1) == UINT32_MAX);
+    check(isqrt(UINT64_MAX) == UINT32_MAX);
+
+    for (i = 1 ; i < ((uint64_t) 1 << 40) ; i = i * 3 + 1) {
+        r = isqrt(i);
+        check(r * r <= i && (r + 1) * (r + 1) > i);
+    }
+}
+
 static void
 test_creation(void)
 {
     int i;
     struct sht * h;
+    struct sht_stats stats;
     int sizes[] = {-1, 0, 1, 10, 100, 1 << 10, 1 << 20};
 
     for (i = 0 ; i < arraylen(sizes) ; i++) {
@@ -22,8 +50,13 @@ test_creation(void)
         sht_destroy(h);
     }
 
-    h = sht_create(INT32_MAX);
-    check(h == NULL);
+    /* huge sizes are clamped to 2^32 lines, allocated with the first
+     * insert of a small table */
+    h = sht_create_ext(INT64_MAX, SHT_F_SMALL, NULL, NULL, NULL);
+    check(h != NULL);
+    sht_get_stats(h, &stats);
+    check(stats.num_lines == (size_t) 1 << 32);
+    sht_destroy(h);
 }
 
 static void
@@ -86,11 +119,1026 @@ test_remove(void)
     sht_destroy(h);
 }
 
+/* worst case hash: every key ends up in the same line */
+static uint32_t
+constant_hash(void * data, size_t len)
+{
+    (void) data;
+    (void) len;
+    return 0;
+}
+
+static void
+test_treeify(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j;
+    int keys[1000];
+    struct sht_stats stats;
+    int flags[] = {0, SHT_F_SMALL, SHT_F_NOSYNC};
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(10, flags[j], NULL, NULL, constant_hash);
+        check(h != NULL);
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            keys[i] = i;
+            rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            ptr = sht_lookup_insert(h, &keys[i], sizeof(keys[i]), &rv);
+            check(ptr == &keys[i]);
+        }
+
+        /* more lines would not split the keys: the line is treeified,
+         * the table does not grow */
+        sht_get_stats(h, &stats);
+        check(stats.num_lines == 10 && stats.treeified > 0);
+
+        /* remove every other key, until the line falls back to a chain */
+        for (i = 0 ; i < arraylen(keys) ; i += 2) {
+            rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < arraylen(keys) ; i += 2) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == NULL);
+            ptr = sht_lookup(h, &keys[i + 1], sizeof(keys[i + 1]));
+            check(ptr == &keys[i + 1]);
+        }
+
+        for (i = 1 ; i < arraylen(keys) ; i += 2) {
+            rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+            check(rv == 0);
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == NULL);
+        }
+
+        sht_destroy(h);
+    }
+}
+
+static void
+test_small(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i;
+    int keys[100];
+
+    h = sht_create_ext(10, SHT_F_SMALL, NULL, NULL, NULL);
+    check(h != NULL);
+
+    /* fill past the small array to get it promoted */
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        keys[i] = i;
+        ptr = sht_lookup_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(ptr == &keys[i]);
+
+        rv = sht_remove(h, &keys[0], sizeof(keys[0]));
+        check(rv == 0);
+        rv = sht_insert(h, &keys[0], sizeof(keys[0]), &keys[0]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    sht_destroy(h);
+
+    /* small tables only allocate their lines once promoted */
+    h = sht_create_ext(INT32_MAX, SHT_F_SMALL, NULL, NULL, NULL);
+    check(h != NULL);
+    rv = sht_insert(h, &keys[0], sizeof(keys[0]), &keys[0]);
+    check(rv == 0);
+    ptr = sht_lookup(h, &keys[0], sizeof(keys[0]));
+    check(ptr == &keys[0]);
+    sht_destroy(h);
+}
+
+static void
+test_swmr(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, reader;
+    int keys[1000];
+
+    h = sht_create_ext(10, SHT_F_SMALL | SHT_F_SWMR, NULL, NULL, NULL);
+    check(h == NULL);
+
+    h = sht_create_ext(10, SHT_F_SWMR, NULL, NULL, NULL);
+    check(h != NULL);
+
+    reader = sht_reader_register(h);
+    check(reader >= 0);
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        keys[i] = i;
+        ptr = sht_lookup_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(ptr == &keys[i]);
+    }
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+        check(rv == 0);
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == NULL);
+    }
+
+    /* nothing can be reclaimed until the reader is quiescent */
+    check(sht_gc(h, 0) == 0);
+    sht_reader_quiescent(h, reader);
+    check(sht_gc(h, 0) > 0);
+
+    sht_reader_unregister(h, reader);
+    sht_destroy(h);
+}
+
+static void
+test_nosync(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j;
+    int keys[1000];
+    int flags[] = {
+        SHT_F_NOSYNC,
+        SHT_F_NOSYNC | SHT_F_SMALL,
+    };
+
+    h = sht_create_ext(10, SHT_F_NOSYNC | SHT_F_SWMR, NULL, NULL, NULL);
+    check(h == NULL);
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(10, flags[j], NULL, NULL, NULL);
+        check(h != NULL);
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            keys[i] = i;
+            ptr = sht_lookup_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(ptr == &keys[i]);
+        }
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == &keys[i]);
+            rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+            check(rv == 0);
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == NULL);
+        }
+
+        sht_destroy(h);
+    }
+
+    /* unsynchronized lines get treeified as well */
+    h = sht_create_ext(10, SHT_F_NOSYNC, NULL, NULL, constant_hash);
+    check(h != NULL);
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < arraylen(keys) ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    sht_destroy(h);
+}
+
+static void
+test_wbuf(void)
+{
+    struct sht * h;
+    struct sht_wbuf * b;
+    int * ptr;
+    int rv, i, j;
+    int keys[1000];
+    static char long_key[4096] = {1};
+    int flags[] = {0, SHT_F_SMALL, SHT_F_SWMR, SHT_F_NOSYNC};
+
+    h = sht_create(10);
+    check(h != NULL);
+    check(sht_wbuf_create(h, 0) == NULL);
+    sht_destroy(h);
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(10, flags[j], NULL, NULL, NULL);
+        check(h != NULL);
+        b = sht_wbuf_create(h, 64);
+        check(b != NULL);
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            keys[i] = i;
+            rv = sht_wbuf_insert(b, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        /* the last 1000 % 64 inserts are still buffered */
+        ptr = sht_lookup(h, &keys[999], sizeof(keys[999]));
+        check(ptr == NULL);
+        ptr = sht_lookup(h, &keys[0], sizeof(keys[0]));
+        check(ptr == &keys[0]);
+
+        rv = sht_wbuf_flush(b);
+        check(rv == 0);
+        rv = sht_wbuf_flush(b);
+        check(rv == 0);
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == &keys[i]);
+        }
+
+        /* the nodes of a batch are freed one by one */
+        for (i = 0 ; i < arraylen(keys) ; i += 2) {
+            rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == ((i & 1) ? &keys[i] : NULL));
+        }
+
+        /* keys are copied when buffered */
+        i = arraylen(keys);
+        rv = sht_wbuf_insert(b, &i, sizeof(i), &keys[0]);
+        check(rv == 0);
+        i = 0;
+        rv = sht_wbuf_flush(b);
+        check(rv == 0);
+        i = arraylen(keys);
+        ptr = sht_lookup(h, &i, sizeof(i));
+        check(ptr == &keys[0]);
+
+        /* more key bytes than buffered at first */
+        rv = sht_wbuf_insert(b, long_key, sizeof(long_key), &keys[1]);
+        check(rv == 0);
+        rv = sht_wbuf_flush(b);
+        check(rv == 0);
+        ptr = sht_lookup(h, long_key, sizeof(long_key));
+        check(ptr == &keys[1]);
+
+        rv = sht_wbuf_insert(b, NULL, 0, NULL);
+        check(rv == -1);
+
+        sht_wbuf_destroy(b);
+        sht_destroy(h);
+    }
+}
+
+static void
+test_reserve(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j;
+    int keys[1000];
+    int flags[] = {0, SHT_F_SMALL, SHT_F_SWMR, SHT_F_NOSYNC};
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(10, flags[j], NULL, NULL, NULL);
+        check(h != NULL);
+
+        /* nothing to do */
+        rv = sht_reserve(h, 5);
+        check(rv == 0);
+
+        for (i = 0 ; i < arraylen(keys) / 2 ; i++) {
+            keys[i] = i;
+            rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        /* may have to finish a migration first */
+        rv = sht_reserve(h, arraylen(keys) * 4);
+        check(rv == 0);
+
+        for (; i < arraylen(keys) ; i++) {
+            keys[i] = i;
+            rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        for (i = 0 ; i < arraylen(keys) ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == &keys[i]);
+        }
+
+        sht_destroy(h);
+    }
+}
+
+static void
+test_gc_budget(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i;
+    int * keys;
+    int num_keys = 100 * 1000;
+    struct sht_stats stats;
+
+    keys = malloc(num_keys * sizeof(*keys));
+    check(keys != NULL);
+
+    h = sht_create(10);
+    check(h != NULL);
+
+    check(sht_set_gc_budget(h, 0, 10, 0) == -1);
+    check(sht_set_gc_budget(h, 10, 5, 0) == -1);
+
+    /* a single probe per operation, bounded to 1us:
+     * inserts outpace the migration, which gets a larger budget */
+    rv = sht_set_gc_budget(h, 1, 64, 1000);
+    check(rv == 0);
+
+    for (i = 0 ; i < num_keys ; i++) {
+        keys[i] = i;
+        rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < num_keys ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    sht_get_stats(h, &stats);
+    check(stats.gc_lag > 0);
+    sht_destroy(h);
+
+    /* each step runs out of time before its probes */
+    h = sht_create(10);
+    check(h != NULL);
+    rv = sht_set_gc_budget(h, 16, 64, 1);
+    check(rv == 0);
+
+    for (i = 0 ; i < num_keys ; i++) {
+        rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < num_keys ; i++) {
+        ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+        check(ptr == &keys[i]);
+    }
+
+    sht_get_stats(h, &stats);
+    check(stats.gc_timeout > 0);
+    sht_destroy(h);
+    free(keys);
+}
+
+/* read a trace, check its header and return its records */
+static struct sht_trace_record *
+read_trace(FILE * f, int sample_rate, int * num_records)
+{
+    int n;
+    struct sht_trace_header hdr;
+    struct sht_trace_block block;
+    struct sht_trace_record * records;
+
+    fflush(f);
+    rewind(f);
+
+    check(fread(&hdr, sizeof(hdr), 1, f) == 1);
+    check(hdr.magic == SHT_TRACE_MAGIC);
+    check(hdr.version == SHT_TRACE_VERSION);
+    check(hdr.sample_rate == (uint32_t) sample_rate);
+    check(hdr.record_size == sizeof(struct sht_trace_record));
+
+    n = 0;
+    records = NULL;
+    while (fread(&block, sizeof(block), 1, f) == 1) {
+        /* a single thread */
+        check(block.thread == 0);
+        records = realloc(records, (n + block.num_records)
+                * sizeof(*records));
+        check(records != NULL);
+        check(fread(&records[n], sizeof(*records), block.num_records, f)
+                == block.num_records);
+        n += block.num_records;
+    }
+
+    *num_records = n;
+    return records;
+}
+
+static void
+test_trace(void)
+{
+    FILE * f;
+    struct sht * h;
+    int rv, i, n, op;
+    int * keys, * key;
+    int num_keys = 10 * 1000;
+    struct sht_trace_record * records;
+
+    keys = malloc(num_keys * sizeof(*keys));
+    check(keys != NULL);
+
+    h = sht_create(0);
+    check(h != NULL);
+
+    f = tmpfile();
+    check(f != NULL);
+
+    check(sht_trace_start(h, -1, 1) == -1);
+    check(sht_trace_start(h, fileno(f), 3) == -1);
+    check(sht_trace_stop(h) == -1);
+
+    /* every operation, through a few resizes */
+    rv = sht_trace_start(h, fileno(f), 1);
+    check(rv == 0);
+    check(sht_trace_start(h, fileno(f), 1) == -1);
+
+    for (i = 0 ; i < num_keys ; i++) {
+        keys[i] = i;
+        rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < num_keys ; i++)
+        sht_lookup(h, &keys[i], sizeof(keys[i]));
+
+    for (i = 0 ; i < num_keys ; i++)
+        sht_lookup_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+
+    for (i = 0 ; i < num_keys ; i++)
+        sht_remove(h, &keys[i], sizeof(keys[i]));
+
+    rv = sht_trace_stop(h);
+    check(rv == 0);
+    check(sht_trace_stop(h) == -1);
+
+    /* not recorded */
+    sht_lookup(h, &keys[0], sizeof(keys[0]));
+
+    records = read_trace(f, 1, &n);
+    check(n == 4 * num_keys);
+
+    for (i = 0 ; i < n ; i++) {
+        op = (int[]) {
+            SHT_TRACE_INSERT, SHT_TRACE_LOOKUP, SHT_TRACE_LOOKUP_INSERT,
+            SHT_TRACE_REMOVE,
+        }[i / num_keys];
+        key = &keys[i - (i / num_keys) * num_keys];
+        check(SHT_TRACE_OP(&records[i]) == (uint32_t) op);
+        check(SHT_TRACE_KEYLEN(&records[i]) == sizeof(*key));
+        check(records[i].hash == oat_hash(key, sizeof(*key)));
+        check(i == 0 || records[i].ns >= records[i - 1].ns);
+    }
+
+    free(records);
+    fclose(f);
+
+    /* a trace can restart, sampled this time */
+    f = tmpfile();
+    check(f != NULL);
+
+    rv = sht_trace_start(h, fileno(f), 4);
+    check(rv == 0);
+
+    for (i = 0 ; i < 4 * num_keys ; i++)
+        sht_lookup(h, &keys[i / 4], sizeof(keys[0]));
+
+    rv = sht_trace_stop(h);
+    check(rv == 0);
+
+    records = read_trace(f, 4, &n);
+    check(n == num_keys);
+    free(records);
+
+    /* destroying the table stops its trace */
+    rv = sht_trace_start(h, fileno(f), 1);
+    check(rv == 0);
+    sht_lookup(h, &keys[0], sizeof(keys[0]));
+
+    sht_destroy(h);
+    fclose(f);
+    free(keys);
+}
+
+#define SLAB_TEST_KEYS 10000
+#define SLAB_TEST_KEYLEN 600
+
+/* keys from 8 to 607 bytes, some of them too long for a slab slot */
+static size_t
+slab_test_key(char * key, int i)
+{
+    size_t keylen = 8 + i % SLAB_TEST_KEYLEN;
+
+    memset(key, 'a' + i % 26, keylen);
+    memcpy(key, &i, sizeof(i));
+
+    return keylen;
+}
+
+static void
+test_slab(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j, moved, total, rounds;
+    size_t keylen;
+    int present;
+    uint64_t mapped;
+    struct sht_stats stats;
+    char key[8 + SLAB_TEST_KEYLEN];
+    static int values[SLAB_TEST_KEYS];
+    int flags[] = {
+        SHT_F_SLAB,
+        SHT_F_SLAB | SHT_F_SMALL,
+        SHT_F_SLAB | SHT_F_NOSYNC,
+    };
+
+    h = sht_create_ext(10, SHT_F_SLAB | SHT_F_SWMR, NULL, NULL, NULL);
+    check(h == NULL);
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(10, flags[j], NULL, NULL, NULL);
+        check(h != NULL);
+
+        for (i = 0 ; i < SLAB_TEST_KEYS ; i++) {
+            keylen = slab_test_key(key, i);
+            ptr = sht_lookup_insert(h, key, keylen, &values[i]);
+            check(ptr == &values[i]);
+        }
+
+        sht_get_stats(h, &stats);
+        check(stats.slab_bytes > 0);
+        mapped = stats.slab_bytes;
+
+        /* leave the slabs 1/16 full */
+        for (i = 0 ; i < SLAB_TEST_KEYS ; i++) {
+            if (i % 16 == 0)
+                continue;
+
+            keylen = slab_test_key(key, i);
+            rv = sht_remove(h, key, keylen);
+            check(rv == 0);
+        }
+
+        if (flags[j] & SHT_F_NOSYNC) {
+            total = rounds = 0;
+            while ((moved = sht_gc(h, 64)) > 0) {
+                total += moved;
+                rounds++;
+                check(rounds < SLAB_TEST_KEYS);
+            }
+
+            check(total > 0);
+        } else {
+            /* the synchronized tables compact from their operations */
+            for (rounds = 0 ; rounds < SLAB_TEST_KEYS ; rounds++) {
+                sht_get_stats(h, &stats);
+                if (stats.slabs_released > 0)
+                    break;
+
+                for (i = 0 ; i < SLAB_TEST_KEYS ; i += 16) {
+                    keylen = slab_test_key(key, i);
+                    ptr = sht_lookup(h, key, keylen);
+                    check(ptr == &values[i]);
+                }
+            }
+
+            check(stats.slab_moved > 0 && stats.slabs_released > 0);
+        }
+
+        /* the released slabs give their pages back */
+        sht_get_stats(h, &stats);
+        check(stats.slab_bytes < mapped);
+
+        for (i = 0 ; i < SLAB_TEST_KEYS ; i++) {
+            keylen = slab_test_key(key, i);
+            present = (i % 16 == 0);
+            ptr = sht_lookup(h, key, keylen);
+            check(ptr == (present ? &values[i] : NULL));
+        }
+
+        /* the released slabs are reused */
+        for (i = 0 ; i < SLAB_TEST_KEYS ; i++) {
+            keylen = slab_test_key(key, i);
+            ptr = sht_lookup_insert(h, key, keylen, &values[i]);
+            check(ptr == &values[i]);
+        }
+
+        for (i = 0 ; i < SLAB_TEST_KEYS ; i++) {
+            keylen = slab_test_key(key, i);
+            ptr = sht_lookup(h, key, keylen);
+            check(ptr == &values[i]);
+        }
+
+        sht_destroy(h);
+    }
+}
+
+/* allocations fail once the budget is spent, or past max_size */
+static int alloc_budget = -1; /* -1: no limit */
+static size_t alloc_max_size = SIZE_MAX;
+static size_t alloc_largest;
+
+static void *
+failing_alloc(size_t size)
+{
+    if (alloc_budget == 0 || size > alloc_max_size)
+        return NULL;
+
+    if (alloc_budget > 0)
+        alloc_budget--;
+
+    alloc_largest = MAX(alloc_largest, size);
+
+    return malloc(size);
+}
+
+#define POOL_TEST_NODES 64
+
+static void
+test_node_pool(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j;
+    size_t line_size;
+    char long_key[32] = {0};
+    static int values[2 * POOL_TEST_NODES];
+    int flags[] = {0, SHT_F_NOSYNC};
+
+    h = sht_create_ext(10, SHT_F_SWMR, NULL, NULL, NULL);
+    check(h != NULL);
+    rv = sht_set_node_pool(h, POOL_TEST_NODES, sizeof(int));
+    check(rv == -1);
+    sht_destroy(h);
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        h = sht_create_ext(16, flags[j], failing_alloc, free, NULL);
+        check(h != NULL);
+
+        rv = sht_set_node_pool(h, POOL_TEST_NODES, sizeof(int));
+        check(rv == 0);
+        rv = sht_set_node_pool(h, POOL_TEST_NODES, 2 * sizeof(int));
+        check(rv == -1);
+
+        /* nothing can be allocated: inserts take from the pool */
+        alloc_budget = 0;
+        for (i = 0 ; i < POOL_TEST_NODES ; i++) {
+            rv = sht_insert(h, &i, sizeof(i), &values[i]);
+            check(rv == 0);
+        }
+
+        rv = sht_insert(h, &i, sizeof(i), &values[i]);
+        check(rv == -1);
+        rv = sht_insert(h, long_key, sizeof(long_key), &values[0]);
+        check(rv == -1);
+
+        /* removed nodes go back to the pool */
+        for (i = 0 ; i < POOL_TEST_NODES / 2 ; i++) {
+            rv = sht_remove(h, &i, sizeof(i));
+            check(rv == 0);
+        }
+
+        for (i = POOL_TEST_NODES ; i < 3 * POOL_TEST_NODES / 2 ; i++) {
+            rv = sht_insert(h, &i, sizeof(i), &values[i]);
+            check(rv == 0);
+        }
+
+        /* refilled by the gc once memory is back */
+        alloc_budget = -1;
+        while (sht_gc(h, 64) > 0)
+            ;
+
+        alloc_budget = 0;
+        for (i = 3 * POOL_TEST_NODES / 2 ; i < 2 * POOL_TEST_NODES ; i++) {
+            rv = sht_insert(h, &i, sizeof(i), &values[i]);
+            check(rv == 0);
+        }
+        alloc_budget = -1;
+
+        for (i = 0 ; i < 2 * POOL_TEST_NODES ; i++) {
+            ptr = sht_lookup(h, &i, sizeof(i));
+            check(ptr == (i < POOL_TEST_NODES / 2 ? NULL : &values[i]));
+        }
+
+        sht_dump_stats(h);
+        sht_destroy(h);
+    }
+
+    /* lines of 2000 entries cannot be allocated, grow by half instead:
+     * the reservation is only partial, but still succeeds */
+    alloc_largest = 0;
+    h = sht_create_ext(1000, SHT_F_NOSYNC, failing_alloc, free, NULL);
+    check(h != NULL);
+    line_size = alloc_largest / 1000;
+
+    alloc_max_size = 1999 * line_size;
+    rv = sht_reserve(h, 2000);
+    check(rv == 0);
+    check(alloc_largest == 1500 * line_size);
+    alloc_max_size = SIZE_MAX;
+
+    for (i = 0 ; i < 2 * POOL_TEST_NODES ; i++) {
+        rv = sht_insert(h, &i, sizeof(i), &values[i]);
+        check(rv == 0);
+    }
+
+    sht_destroy(h);
+}
+
+#define SHRINK_TEST_LINES 4096
+#define SHRINK_TEST_KEYS 3000
+#define SHRINK_TEST_KEPT 200
+
+static void
+test_shrink(void)
+{
+    struct sht * h;
+    int * ptr;
+    int rv, i, j;
+    size_t line_size;
+    static int keys[SHRINK_TEST_KEYS];
+    int flags[] = {0, SHT_F_NOSYNC, SHT_F_SWMR};
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        alloc_largest = 0;
+        h = sht_create_ext(SHRINK_TEST_LINES, flags[j], failing_alloc, free,
+                NULL);
+        check(h != NULL);
+        line_size = alloc_largest / SHRINK_TEST_LINES;
+
+        for (i = 0 ; i < SHRINK_TEST_KEYS ; i++) {
+            keys[i] = i;
+            rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        /* more than half the lines are still needed */
+        alloc_largest = 0;
+        rv = sht_shrink(h);
+        check(rv == 0);
+        check(alloc_largest == 0);
+
+        for (i = SHRINK_TEST_KEPT ; i < SHRINK_TEST_KEYS ; i++) {
+            rv = sht_remove(h, &keys[i], sizeof(keys[i]));
+            check(rv == 0);
+        }
+
+        /* one line per entry left */
+        rv = sht_shrink(h);
+        check(rv == 0);
+        check(alloc_largest == SHRINK_TEST_KEPT * line_size);
+
+        for (i = 0 ; i < SHRINK_TEST_KEYS ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == (i < SHRINK_TEST_KEPT ? &keys[i] : NULL));
+        }
+
+        /* and once migrated */
+        while (sht_gc(h, INT32_MAX) > 0)
+            ;
+
+        for (i = 0 ; i < SHRINK_TEST_KEYS ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == (i < SHRINK_TEST_KEPT ? &keys[i] : NULL));
+        }
+
+        sht_destroy(h);
+    }
+}
+
+static void
+write_small_file(char const * dir, char const * name, char const * content)
+{
+    FILE * f;
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    check(f != NULL);
+    fputs(content, f);
+    fclose(f);
+}
+
+static void
+remove_small_file(char const * dir, char const * name)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(path);
+}
+
+#define PRESSURE_TEST_KEYS 10000
+
+struct evict_arg {
+    int calls;
+    enum sht_pressure_level level;
+    int * keys;
+    int num_keys;
+};
+
+/* drop the second half of the keys left */
+static void
+evict_half(struct sht * h, enum sht_pressure_level level, void * arg)
+{
+    int i, rv;
+    struct evict_arg * a = arg;
+
+    __atomic_fetch_add(&a->calls, 1, __ATOMIC_RELEASE);
+    a->level = level;
+    for (i = a->num_keys / 2 ; i < a->num_keys ; i++) {
+        rv = sht_remove(h, &a->keys[i], sizeof(a->keys[i]));
+        check(rv == 0);
+    }
+
+    a->num_keys /= 2;
+}
+
+static void
+test_pressure(void)
+{
+    struct sht * h;
+    struct sht_pressure * p;
+    int * ptr;
+    int rv, i, j;
+    char dir[] = "/tmp/sht-unittest-XXXXXX";
+    static int keys[PRESSURE_TEST_KEYS];
+    struct evict_arg arg;
+    char const * events = "low 0\nhigh %d\nmax %d\noom 0\noom_kill 0\n";
+    char const * psi = "some avg10=0.00 avg60=0.00 avg300=0.00 total=%d\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=%d\n";
+    char content[256];
+    int flags[] = {0, SHT_F_SLAB, SHT_F_NOSYNC};
+
+    p = sht_pressure_create("/nonexistent", 0);
+    check(p == NULL);
+
+    check(mkdtemp(dir) != NULL);
+
+    for (j = 0 ; j < arraylen(flags) ; j++) {
+        snprintf(content, sizeof(content), events, 0, 0);
+        write_small_file(dir, "memory.events", content);
+        snprintf(content, sizeof(content), psi, 0, 0);
+        write_small_file(dir, "memory.pressure", content);
+
+        p = sht_pressure_create(dir, 0);
+        check(p != NULL);
+
+        h = sht_create_ext(1 << 16, flags[j], NULL, NULL, NULL);
+        check(h != NULL);
+
+        for (i = 0 ; i < PRESSURE_TEST_KEYS ; i++) {
+            keys[i] = i;
+            rv = sht_insert(h, &keys[i], sizeof(keys[i]), &keys[i]);
+            check(rv == 0);
+        }
+
+        arg = (struct evict_arg) {
+            .keys = keys,
+            .num_keys = PRESSURE_TEST_KEYS,
+        };
+        check(sht_pressure_add(p, h, evict_half, &arg) == 0);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_NONE);
+        check(arg.calls == 0);
+
+        /* events and stalls count once */
+        snprintf(content, sizeof(content), events, 1, 0);
+        write_small_file(dir, "memory.events", content);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_MEDIUM);
+        check(arg.calls == 1 && arg.level == SHT_PRESSURE_MEDIUM);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_NONE);
+
+        snprintf(content, sizeof(content), events, 1, 1);
+        write_small_file(dir, "memory.events", content);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_CRITICAL);
+        check(arg.calls == 2 && arg.level == SHT_PRESSURE_CRITICAL);
+
+        /* stalled for a second, since the last poll */
+        snprintf(content, sizeof(content), psi, 1000000, 0);
+        write_small_file(dir, "memory.pressure", content);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_MEDIUM);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_NONE);
+        snprintf(content, sizeof(content), psi, 2000000, 1000000);
+        write_small_file(dir, "memory.pressure", content);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_CRITICAL);
+        check(sht_pressure_poll(p) == SHT_PRESSURE_NONE);
+        check(arg.calls == 4);
+
+        /* the table was shrunk and compacted, not emptied */
+        for (i = 0 ; i < PRESSURE_TEST_KEYS ; i++) {
+            ptr = sht_lookup(h, &keys[i], sizeof(keys[i]));
+            check(ptr == (i < arg.num_keys ? &keys[i] : NULL));
+        }
+
+        check(sht_pressure_remove(p, h) == 0);
+        check(sht_pressure_remove(p, h) == -1);
+        sht_pressure_destroy(p);
+        sht_destroy(h);
+    }
+
+    /* with a watcher thread */
+    snprintf(content, sizeof(content), psi, 0, 0);
+    write_small_file(dir, "memory.pressure", content);
+    p = sht_pressure_create(dir, 1);
+    check(p != NULL);
+
+    h = sht_create(10);
+    check(h != NULL);
+    arg = (struct evict_arg) {0};
+    check(sht_pressure_add(p, h, evict_half, &arg) == 0);
+
+    snprintf(content, sizeof(content), events, 2, 1);
+    write_small_file(dir, "memory.events", content);
+    while (__atomic_load_n(&arg.calls, __ATOMIC_ACQUIRE) == 0)
+        sched_yield();
+
+    check(sht_pressure_remove(p, h) == 0);
+    sht_pressure_destroy(p);
+    sht_destroy(h);
+
+    remove_small_file(dir, "memory.events");
+    remove_small_file(dir, "memory.pressure");
+    rmdir(dir);
+}
+
+/* more than 2^32 entries, only when SHT_TEST_LARGE is set:
+ * needs about 400GB of memory */
+static void
+test_large(void)
+{
+    struct sht * h;
+    uint64_t * ptr;
+    uint64_t i, step;
+    int rv;
+    uint64_t num_keys = ((uint64_t) 1 << 32) + (1 << 20);
+    static uint64_t value;
+
+    if (getenv("SHT_TEST_LARGE") == NULL)
+        return;
+
+    h = sht_create_ext(1 << 20, SHT_F_NOSYNC, NULL, NULL, NULL);
+    check(h != NULL);
+
+    rv = sht_reserve(h, (size_t) 1 << 30);
+    check(rv == 0);
+
+    for (i = 0 ; i < num_keys ; i++) {
+        rv = sht_insert(h, &i, sizeof(i), &value);
+        check(rv == 0);
+    }
+
+    step = num_keys / (1 << 20);
+    for (i = 0 ; i < num_keys ; i += step) {
+        ptr = sht_lookup(h, &i, sizeof(i));
+        check(ptr == &value);
+    }
+
+    i = num_keys - 1;
+    ptr = sht_lookup(h, &i, sizeof(i));
+    check(ptr == &value);
+    i = num_keys;
+    ptr = sht_lookup(h, &i, sizeof(i));
+    check(ptr == NULL);
+
+    sht_dump_stats(h);
+    sht_destroy(h);
+}
+
 int main(void)
 {
+    test_isqrt();
     test_creation();
     test_insert_lookup();
     test_remove();
+    test_treeify();
+    test_small();
+    test_swmr();
+    test_nosync();
+    test_wbuf();
+    test_reserve();
+    test_gc_budget();
+    test_trace();
+    test_slab();
+    test_node_pool();
+    test_shrink();
+    test_pressure();
+    test_large();
 
     return 0;
 }
@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "topk.h"
+
+/* each thread tracks its updates in its own sampled summary,
+ * while the main thread merges them into a global one */
+#define K 64
+#define SAMPLE_RATE 8
+#define NUM_THREADS 8
+#define NUM_UPDATES 4 * 1000 * 1000 /* per thread */
+#define NUM_HOT_KEYS 4
+
+static struct topk * summaries[NUM_THREADS];
+static int num_running;
+
+/* hot key h makes 1/(4 << h) of the stream */
+static uint64_t
+stream_key(uint64_t * rng)
+{
+    int h, slice;
+    uint64_t x;
+
+    x = *rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *rng = x;
+
+    /* out of 64 values, 16 for hot key 0, 8 for hot key 1... */
+    slice = 0;
+    for (h = 0 ; h < NUM_HOT_KEYS ; h++) {
+        slice += 16 >> h;
+        if ((int) (x % 64) < slice)
+            return h;
+    }
+
+    return NUM_HOT_KEYS + (x >> 16) % (1 << 20);
+}
+
+static void *
+topk_test_thread(void * void_args)
+{
+    int i;
+    uint64_t key, rng;
+    int id = (int) (intptr_t) void_args;
+
+    rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+    for (i = 0 ; i < NUM_UPDATES ; i++) {
+        key = stream_key(&rng);
+        check(topk_add(summaries[id], &key, sizeof(key)) == 0);
+    }
+
+    atomic_decr(num_running);
+
+    return NULL;
+}
+
+#define NUM_CROSS_MERGES 20 * 1000
+
+static struct topk * cross[2];
+
+/* merges one way, while the main thread merges the other way */
+static void *
+cross_merge_thread(void * void_args)
+{
+    int i;
+
+    (void) void_args;
+
+    for (i = 0 ; i < NUM_CROSS_MERGES ; i++)
+        check(topk_merge(cross[1], cross[0], 1) == 0);
+
+    return NULL;
+}
+
+static void
+run_cross_merge(void)
+{
+    int rv, i;
+    uint64_t key;
+    pthread_t thread;
+
+    for (i = 0 ; i < 2 ; i++) {
+        cross[i] = topk_create(K, sizeof(uint64_t), 1);
+        check(cross[i] != NULL);
+    }
+
+    for (key = 0 ; key < K ; key++)
+        check(topk_add(cross[key & 1], &key, sizeof(key)) == 0);
+
+    rv = pthread_create(&thread, NULL, &cross_merge_thread, NULL);
+    check(rv == 0);
+
+    for (i = 0 ; i < NUM_CROSS_MERGES ; i++)
+        check(topk_merge(cross[0], cross[1], 1) == 0);
+
+    rv = pthread_join(thread, NULL);
+    check(rv == 0);
+
+    for (i = 0 ; i < 2 ; i++)
+        topk_destroy(cross[i]);
+}
+
+int main(void)
+{
+    int rv, i, n;
+    uint64_t key, expected;
+    struct topk * global;
+    struct topk_entry entries[NUM_HOT_KEYS];
+    pthread_t threads[NUM_THREADS];
+
+    global = topk_create(K, sizeof(uint64_t), 1);
+    check(global != NULL);
+
+    num_running = NUM_THREADS;
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        summaries[i] = topk_create(K, sizeof(uint64_t), SAMPLE_RATE);
+        check(summaries[i] != NULL);
+        rv = pthread_create(&threads[i], NULL, &topk_test_thread,
+                (void *) (intptr_t) i);
+        check(rv == 0);
+    }
+
+    while (__atomic_load_n(&num_running, __ATOMIC_ACQUIRE) > 0) {
+        for (i = 0 ; i < NUM_THREADS ; i++)
+            check(topk_merge(global, summaries[i], 1) == 0);
+    }
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+        check(topk_merge(global, summaries[i], 1) == 0);
+    }
+
+    n = topk_list(global, entries, NUM_HOT_KEYS);
+    check(n == NUM_HOT_KEYS);
+
+    /* the hot keys, in order, within 10% of their frequency */
+    for (i = 0 ; i < n ; i++) {
+        memcpy(&key, entries[i].key, sizeof(key));
+        check(key == (uint64_t) i);
+
+        expected = (uint64_t) NUM_THREADS * NUM_UPDATES / (4 << i);
+        check(entries[i].count - entries[i].error < expected * 1.1);
+        check(entries[i].count > expected * 0.9);
+    }
+
+    topk_dump_stats(global);
+
+    for (i = 0 ; i < NUM_THREADS ; i++)
+        topk_destroy(summaries[i]);
+
+    topk_destroy(global);
+
+    run_cross_merge();
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "common.h"
+#include "topk.h"
+
+#define K 16
+#define NUM_KEYS 10 * 1000
+
+static void
+test_creation(void)
+{
+    struct topk * t;
+
+    check(topk_create(0, 8, 1) == NULL);
+    check(topk_create(K, 0, 1) == NULL);
+    check(topk_create(K, 8, 3) == NULL);
+
+    t = topk_create(K, 8, 0);
+    check(t != NULL);
+    topk_destroy(t);
+
+    t = topk_create(K, 8, 16);
+    check(t != NULL);
+    topk_destroy(t);
+}
+
+static void
+test_exact(void)
+{
+    int rv, i, n;
+    uint64_t key;
+    struct topk * t;
+    struct topk_entry entries[K];
+
+    t = topk_create(K, sizeof(key), 1);
+    check(t != NULL);
+
+    rv = topk_add(t, &key, sizeof(key) + 1);
+    check(rv == -1);
+
+    /* fewer keys than counters: exact counts, key i seen i + 1 times */
+    for (key = 0 ; key < K / 2 ; key++) {
+        for (i = 0 ; i <= (int) key ; i++) {
+            rv = topk_add(t, &key, sizeof(key));
+            check(rv == 0);
+        }
+    }
+
+    n = topk_list(t, entries, K);
+    check(n == K / 2);
+    for (i = 0 ; i < n ; i++) {
+        memcpy(&key, entries[i].key, sizeof(key));
+        check(key == (uint64_t) (K / 2 - 1 - i));
+        check(entries[i].count == key + 1);
+        check(entries[i].error == 0);
+    }
+
+    topk_reset(t);
+    check(topk_list(t, entries, K) == 0);
+
+    topk_destroy(t);
+}
+
+/* key 0 makes 1/4 of the stream, key 1 1/8, and the others are rare */
+static uint64_t
+skewed_key(int i)
+{
+    if (i % 4 == 0)
+        return 0;
+
+    if (i % 8 == 1)
+        return 1;
+
+    return 2 + i;
+}
+
+static void
+check_heavy_hitters(struct topk * t, int num_updates)
+{
+    int i, n;
+    uint64_t key;
+    struct topk_entry entries[2];
+
+    n = topk_list(t, entries, arraylen(entries));
+    check(n == 2);
+
+    for (i = 0 ; i < n ; i++) {
+        memcpy(&key, entries[i].key, sizeof(key));
+        check(key == (uint64_t) i);
+        check(entries[i].count >= entries[i].error);
+        check(entries[i].count - entries[i].error
+                <= (uint64_t) num_updates / (4 << i));
+        check(entries[i].count > (uint64_t) num_updates / (4 << i) * 0.9);
+    }
+}
+
+static void
+test_heavy_hitters(void)
+{
+    int i;
+    uint64_t key;
+    struct topk * t;
+
+    t = topk_create(K, sizeof(key), 1);
+    check(t != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        key = skewed_key(i);
+        topk_add(t, &key, sizeof(key));
+    }
+
+    check_heavy_hitters(t, NUM_KEYS);
+
+    topk_destroy(t);
+}
+
+static void
+test_merge(void)
+{
+    int rv, i;
+    uint64_t key;
+    struct topk * dst, * src;
+
+    dst = topk_create(K, sizeof(key), 1);
+    src = topk_create(K, sizeof(key), 1);
+    check(dst != NULL && src != NULL);
+
+    check(topk_merge(dst, dst, 0) == -1);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        key = skewed_key(i);
+        topk_add((i & 1) ? dst : src, &key, sizeof(key));
+    }
+
+    rv = topk_merge(dst, src, 1);
+    check(rv == 0);
+    check_heavy_hitters(dst, NUM_KEYS);
+
+    /* src was emptied: merging again changes nothing */
+    rv = topk_merge(dst, src, 0);
+    check(rv == 0);
+    check_heavy_hitters(dst, NUM_KEYS);
+
+    topk_destroy(dst);
+    topk_destroy(src);
+}
+
+int main(void)
+{
+    test_creation();
+    test_exact();
+    test_heavy_hitters();
+    test_merge();
+
+    return 0;
+}
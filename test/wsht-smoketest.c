@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L /* mkdtemp() */
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "common.h"
+#include "wsht.h"
+
+#define NUM_THREADS 8
+#define NUM_KEYS (10 * 1000)
+#define NUM_OPS (50 * 1000)
+#define NUM_RECOVERY_THREADS 4
+
+static struct wsht * h;
+
+static void
+remove_dir(char const * path)
+{
+    DIR * d;
+    struct dirent * e;
+
+    d = opendir(path);
+    check(d != NULL);
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.')
+            unlinkat(dirfd(d), e->d_name, 0);
+    }
+
+    closedir(d);
+    rmdir(path);
+}
+
+/* every thread upserts and removes random keys of the whole key space,
+ * the value tells which thread wrote it last */
+static void *
+writer_thread(void * arg)
+{
+    int i, key, value;
+    uint64_t x;
+    struct wsht_writer * w;
+    int id = (int) (intptr_t) arg;
+
+    w = wsht_writer_create(h);
+    check(w != NULL);
+
+    x = id + 1;
+    for (i = 0 ; i < NUM_OPS ; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        key = x % NUM_KEYS;
+        value = id * NUM_OPS + i;
+
+        if (x & (1 << 20)) {
+            wsht_remove(w, &key, sizeof(key));
+        } else {
+            check(wsht_upsert(w, &key, sizeof(key), &value,
+                        sizeof(value)) == 0);
+        }
+
+        if (i % 10000 == 0) {
+            check(wsht_sync(w) == 0);
+        }
+    }
+
+    wsht_writer_destroy(w);
+
+    return NULL;
+}
+
+int main(void)
+{
+    int i, rv, value;
+    size_t valuelen;
+    pthread_t threads[NUM_THREADS];
+    static int values[NUM_KEYS];
+    char dir[] = "/tmp/wsht-smoketest-XXXXXX";
+
+    check(mkdtemp(dir) != NULL);
+
+    h = wsht_open(dir, NUM_KEYS, 1, 0);
+    check(h != NULL);
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_create(&threads[i], NULL, &writer_thread,
+                (void *) (intptr_t) i);
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        rv = pthread_join(threads[i], NULL);
+        check(rv == 0);
+    }
+
+    /* -1 for the keys removed */
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        valuelen = sizeof(values[i]);
+        if (wsht_lookup(h, &i, sizeof(i), &values[i], &valuelen) != 0)
+            values[i] = -1;
+    }
+
+    wsht_close(h);
+
+    /* the logs of all the threads replayed in parallel */
+    h = wsht_open(dir, 0, NUM_RECOVERY_THREADS, 0);
+    check(h != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        valuelen = sizeof(value);
+        rv = wsht_lookup(h, &i, sizeof(i), &value, &valuelen);
+        check(rv == 0 ? value == values[i] : values[i] == -1);
+    }
+
+    printf("### dump write-ahead logged hashtable\n");
+    wsht_dump_stats(h);
+
+    wsht_close(h);
+
+    remove_dir(dir);
+
+    return 0;
+}
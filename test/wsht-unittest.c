@@ -0,0 +1,315 @@
+#define _POSIX_C_SOURCE 200809L /* mkdtemp(), openat() */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "common.h"
+#include "wsht.h"
+
+#define NUM_KEYS 10000
+
+static char dir[] = "/tmp/wsht-unittest-XXXXXX";
+
+static void
+remove_logs(void)
+{
+    DIR * d;
+    struct dirent * e;
+
+    d = opendir(dir);
+    check(d != NULL);
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.')
+            unlinkat(dirfd(d), e->d_name, 0);
+    }
+
+    closedir(d);
+}
+
+/* the most recent log, which is the only one written since the last open */
+static int
+last_log(char * path, size_t size)
+{
+    DIR * d;
+    struct dirent * e;
+    unsigned long id, last;
+    int found;
+
+    found = 0;
+    last = 0;
+    d = opendir(dir);
+    check(d != NULL);
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+
+        id = strtoul(e->d_name, NULL, 10);
+        if (!found || id > last)
+            last = id;
+
+        found = 1;
+    }
+
+    closedir(d);
+    snprintf(path, size, "%s/%lu.wal", dir, last);
+
+    return found;
+}
+
+static void
+test_insert_lookup_remove(void)
+{
+    struct wsht * h;
+    struct wsht_writer * w;
+    int rv;
+    int key = 42;
+    int value = 23;
+    int out = 0;
+    size_t outlen;
+    char big[100] = {0};
+
+    h = wsht_open(dir, 10, 1, 0);
+    check(h != NULL);
+    w = wsht_writer_create(h);
+    check(w != NULL);
+
+    rv = wsht_insert(w, NULL, sizeof(key), &value, sizeof(value));
+    check(rv != 0);
+
+    rv = wsht_insert(w, &key, 0, &value, sizeof(value));
+    check(rv != 0);
+
+    rv = wsht_insert(w, &key, sizeof(key), &value, sizeof(value));
+    check(rv == 0);
+
+    /* no duplicates */
+    rv = wsht_insert(w, &key, sizeof(key), &value, sizeof(value));
+    check(rv != 0);
+
+    outlen = sizeof(out);
+    rv = wsht_lookup(h, &value, sizeof(value), &out, &outlen);
+    check(rv != 0);
+
+    rv = wsht_lookup(h, &key, sizeof(key), &out, &outlen);
+    check(rv == 0 && out == value && outlen == sizeof(value));
+
+    /* the value outgrows its entry */
+    big[sizeof(big) - 1] = 1;
+    rv = wsht_upsert(w, &key, sizeof(key), big, sizeof(big));
+    check(rv == 0);
+
+    outlen = sizeof(out);
+    rv = wsht_lookup(h, &key, sizeof(key), &out, &outlen);
+    check(rv == 0 && out == 0 && outlen == sizeof(big));
+
+    /* empty values */
+    rv = wsht_upsert(w, &key, sizeof(key), NULL, 0);
+    check(rv == 0);
+
+    rv = wsht_lookup(h, &key, sizeof(key), &out, &outlen);
+    check(rv == 0 && outlen == 0);
+
+    rv = wsht_remove(w, &key, sizeof(key));
+    check(rv == 0);
+
+    rv = wsht_lookup(h, &key, sizeof(key), NULL, NULL);
+    check(rv != 0);
+
+    rv = wsht_remove(w, &key, sizeof(key));
+    check(rv != 0);
+
+    rv = wsht_sync(w);
+    check(rv == 0);
+
+    wsht_writer_destroy(w);
+    wsht_close(h);
+    remove_logs();
+}
+
+/* key i is set to i by one writer, then to -i by another for the odd keys,
+ * and removed for the multiples of 3 */
+static void
+test_recovery(void)
+{
+    struct wsht * h;
+    struct wsht_writer * w[2];
+    int i, rv, value;
+    size_t valuelen;
+    int num_threads[] = {1, 4};
+    int j;
+
+    h = wsht_open(dir, 0, 1, 0);
+    check(h != NULL);
+    w[0] = wsht_writer_create(h);
+    check(w[0] != NULL);
+    w[1] = wsht_writer_create(h);
+    check(w[1] != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        rv = wsht_insert(w[i & 1], &i, sizeof(i), &i, sizeof(i));
+        check(rv == 0);
+    }
+
+    for (i = 1 ; i < NUM_KEYS ; i += 2) {
+        value = -i;
+        rv = wsht_upsert(w[0], &i, sizeof(i), &value, sizeof(value));
+        check(rv == 0);
+    }
+
+    for (i = 0 ; i < NUM_KEYS ; i += 3) {
+        rv = wsht_remove(w[1], &i, sizeof(i));
+        check(rv == 0);
+    }
+
+    wsht_writer_destroy(w[1]);
+    wsht_writer_destroy(w[0]);
+    wsht_close(h);
+
+    for (j = 0 ; j < arraylen(num_threads) ; j++) {
+        h = wsht_open(dir, 0, num_threads[j], 0);
+        check(h != NULL);
+
+        for (i = 0 ; i < NUM_KEYS ; i++) {
+            valuelen = sizeof(value);
+            rv = wsht_lookup(h, &i, sizeof(i), &value, &valuelen);
+            if (i % 3 == 0) {
+                check(rv != 0);
+            } else {
+                check(rv == 0 && valuelen == sizeof(value));
+                check(value == ((i & 1) ? -i : i));
+            }
+        }
+
+        /* the records of this run follow the ones replayed */
+        w[0] = wsht_writer_create(h);
+        check(w[0] != NULL);
+        i = NUM_KEYS + j;
+        value = -i;
+        rv = wsht_upsert(w[0], &i, sizeof(i), &value, sizeof(value));
+        check(rv == 0);
+
+        wsht_writer_destroy(w[0]);
+        wsht_dump_stats(h);
+        wsht_close(h);
+    }
+
+    h = wsht_open(dir, 0, 4, 0);
+    check(h != NULL);
+    for (i = NUM_KEYS ; i < NUM_KEYS + arraylen(num_threads) ; i++) {
+        valuelen = sizeof(value);
+        rv = wsht_lookup(h, &i, sizeof(i), &value, &valuelen);
+        check(rv == 0 && value == -i);
+    }
+
+    wsht_close(h);
+    remove_logs();
+}
+
+/* a crash while the last record was being written */
+static void
+test_torn_log(void)
+{
+    struct wsht * h;
+    struct wsht_writer * w;
+    struct stat st;
+    int i, rv, fd;
+    char path[PATH_MAX];
+
+    h = wsht_open(dir, 0, 1, 0);
+    check(h != NULL);
+    w = wsht_writer_create(h);
+    check(w != NULL);
+
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        rv = wsht_insert(w, &i, sizeof(i), &i, sizeof(i));
+        check(rv == 0);
+    }
+
+    wsht_writer_destroy(w);
+    wsht_close(h);
+
+    check(last_log(path, sizeof(path)));
+    fd = open(path, O_WRONLY);
+    check(fd >= 0);
+    rv = fstat(fd, &st);
+    check(rv == 0);
+    rv = ftruncate(fd, st.st_size - 3);
+    check(rv == 0);
+    close(fd);
+
+    h = wsht_open(dir, 0, 1, 0);
+    check(h != NULL);
+    for (i = 0 ; i < NUM_KEYS ; i++) {
+        rv = wsht_lookup(h, &i, sizeof(i), NULL, NULL);
+        check((rv == 0) == (i < NUM_KEYS - 1));
+    }
+
+    wsht_close(h);
+    remove_logs();
+}
+
+#define SYNC_TEST_OPS 2000
+
+/* the commit thread runs every millisecond, and syncs the same log as
+ * wsht_sync(): each sync must still see its own records written */
+static void
+test_sync_race(void)
+{
+    struct wsht * h;
+    struct wsht_writer * w;
+    struct stat st;
+    int i, rv, fd;
+    off_t size;
+    char path[PATH_MAX];
+
+    h = wsht_open(dir, 0, 1, 1);
+    check(h != NULL);
+    w = wsht_writer_create(h);
+    check(w != NULL);
+
+    check(last_log(path, sizeof(path)));
+    fd = open(path, O_RDONLY);
+    check(fd >= 0);
+
+    size = 0;
+    for (i = 0 ; i < SYNC_TEST_OPS ; i++) {
+        rv = wsht_upsert(w, &i, sizeof(i), &i, sizeof(i));
+        check(rv == 0);
+
+        rv = wsht_sync(w);
+        check(rv == 0);
+
+        rv = fstat(fd, &st);
+        check(rv == 0);
+        check(st.st_size > size);
+        size = st.st_size;
+    }
+
+    close(fd);
+    wsht_writer_destroy(w);
+    wsht_dump_stats(h);
+    wsht_close(h);
+    remove_logs();
+}
+
+int main(void)
+{
+    check(mkdtemp(dir) != NULL);
+
+    test_insert_lookup_remove();
+    test_recovery();
+    test_torn_log();
+    test_sync_race();
+
+    rmdir(dir);
+
+    return 0;
+}